@@ -8,13 +8,31 @@
 #include "napi_macros.hpp"
 #include "napi_utils.hpp"
 
+#include "key_encoding.hpp"
 #include "pbt/reader.hpp"
 #include "pbt/writer.hpp"
 
 typedef ExternalObject<tendb::pbt::Writer, const std::string &> ExternalWriter;
-typedef ExternalObject<tendb::pbt::Reader, const std::string &> ExternalReader;
+typedef ExternalObject<tendb::pbt::Reader, std::unique_ptr<tendb::pbt::StorageBackend>> ExternalReader;
 typedef ExternalObject<tendb::pbt::KeyValueItem::Iterator, const tendb::pbt::KeyValueItem::Iterator> ExternalKeyValueIterator;
 
+// Bytes of a Buffer, which is kept alive for as long as a reader uses them
+struct BufferBackend : tendb::pbt::SpanBackend
+{
+    napi_env env;
+    napi_ref buffer_ref;
+
+    BufferBackend(napi_env env, napi_value buffer, const std::string_view &data) : tendb::pbt::SpanBackend(data.data(), data.size()), env(env), buffer_ref(nullptr)
+    {
+        napi_create_reference(env, buffer, 1, &buffer_ref);
+    }
+
+    ~BufferBackend() override
+    {
+        napi_delete_reference(env, buffer_ref);
+    }
+};
+
 napi_value create_pbt_writer(napi_env env, napi_callback_info cbinfo)
 {
     NAPI_ARGV(1);
@@ -100,7 +118,20 @@ napi_value create_pbt_reader(napi_env env, napi_callback_info cbinfo)
     std::string path;
     NAPI_STATUS_THROWS_NULL(napi_utf8_to_string(env, argv[0], path));
 
-    ExternalReader *rh = new ExternalReader(env, path);
+    ExternalReader *rh = new ExternalReader(env, std::make_unique<tendb::pbt::FileBackend>(path, true));
+    NAPI_STATUS_THROWS_NULL_CLEANUP(rh->napi_init_eoh(), delete rh);
+
+    return rh->external;
+}
+
+napi_value create_pbt_reader_from_buffer(napi_env env, napi_callback_info cbinfo)
+{
+    NAPI_ARGV(1);
+
+    std::string_view data;
+    NAPI_STATUS_THROWS_NULL(napi_buffer_to_string_view(env, argv[0], data));
+
+    ExternalReader *rh = new ExternalReader(env, std::make_unique<BufferBackend>(env, argv[0], data));
     NAPI_STATUS_THROWS_NULL_CLEANUP(rh->napi_init_eoh(), delete rh);
 
     return rh->external;
@@ -194,6 +225,41 @@ napi_value pbt_reader_at(napi_env env, napi_callback_info cbinfo)
     return result;
 }
 
+napi_value pbt_reader_rank(napi_env env, napi_callback_info cbinfo)
+{
+    NAPI_ARGV(2);
+
+    ExternalReader *rh;
+    NAPI_STATUS_THROWS_NULL(napi_get_value_external(env, argv[0], (void **)&rh));
+
+    std::string_view key;
+    NAPI_STATUS_THROWS_NULL(napi_buffer_to_string_view(env, argv[1], key));
+
+    napi_value result;
+    NAPI_STATUS_THROWS_NULL(napi_create_uint32(env, (uint32_t)rh->ptr->rank(key), &result));
+
+    return result;
+}
+
+napi_value pbt_reader_count(napi_env env, napi_callback_info cbinfo)
+{
+    NAPI_ARGV(3);
+
+    ExternalReader *rh;
+    NAPI_STATUS_THROWS_NULL(napi_get_value_external(env, argv[0], (void **)&rh));
+
+    std::string_view first_key;
+    NAPI_STATUS_THROWS_NULL(napi_buffer_to_string_view(env, argv[1], first_key));
+
+    std::string_view last_key;
+    NAPI_STATUS_THROWS_NULL(napi_buffer_to_string_view(env, argv[2], last_key));
+
+    napi_value result;
+    NAPI_STATUS_THROWS_NULL(napi_create_uint32(env, (uint32_t)rh->ptr->count(first_key, last_key), &result));
+
+    return result;
+}
+
 napi_value pbt_reader_begin(napi_env env, napi_callback_info cbinfo)
 {
     NAPI_ARGV(1);
@@ -380,6 +446,155 @@ napi_value pbt_keyvalue_iterator_get_value_copy_to(napi_env env, napi_callback_i
     return result;
 }
 
+napi_value key_encode(napi_env env, napi_callback_info cbinfo)
+{
+    NAPI_ARGV(2);
+
+    uint32_t num_types;
+    NAPI_STATUS_THROWS_NULL(napi_get_array_length(env, argv[0], &num_types));
+
+    uint32_t num_parts;
+    NAPI_STATUS_THROWS_NULL(napi_get_array_length(env, argv[1], &num_parts));
+
+    if (num_types != num_parts)
+    {
+        napi_throw_range_error(env, NULL, "Number of types does not match number of key parts");
+        return nullptr;
+    }
+
+    std::string key;
+    for (uint32_t i = 0; i < num_parts; i++)
+    {
+        napi_value type_element;
+        NAPI_STATUS_THROWS_NULL(napi_get_element(env, argv[0], i, &type_element));
+
+        std::string type;
+        NAPI_STATUS_THROWS_NULL(napi_utf8_to_string(env, type_element, type));
+
+        napi_value part;
+        NAPI_STATUS_THROWS_NULL(napi_get_element(env, argv[1], i, &part));
+
+        if (type == "uint64")
+        {
+            uint64_t value;
+            bool lossless;
+            NAPI_STATUS_THROWS_NULL(napi_get_value_bigint_uint64(env, part, &value, &lossless));
+            if (!lossless)
+            {
+                // A wrapped value would be encoded out of order
+                napi_throw_range_error(env, NULL, "Key part is out of range for uint64");
+                return nullptr;
+            }
+            tendb::key_encoding::encode_uint64(key, value);
+        }
+        else if (type == "int64")
+        {
+            int64_t value;
+            bool lossless;
+            NAPI_STATUS_THROWS_NULL(napi_get_value_bigint_int64(env, part, &value, &lossless));
+            if (!lossless)
+            {
+                // A wrapped value would be encoded out of order
+                napi_throw_range_error(env, NULL, "Key part is out of range for int64");
+                return nullptr;
+            }
+            tendb::key_encoding::encode_int64(key, value);
+        }
+        else if (type == "double")
+        {
+            double value;
+            NAPI_STATUS_THROWS_NULL(napi_get_value_double(env, part, &value));
+            tendb::key_encoding::encode_double(key, value);
+        }
+        else if (type == "string")
+        {
+            std::string value;
+            NAPI_STATUS_THROWS_NULL(napi_utf8_to_string(env, part, value));
+            tendb::key_encoding::encode_string(key, value);
+        }
+        else if (type == "buffer")
+        {
+            std::string_view value;
+            NAPI_STATUS_THROWS_NULL(napi_buffer_to_string_view(env, part, value));
+            tendb::key_encoding::encode_string(key, value);
+        }
+        else
+        {
+            napi_throw_type_error(env, NULL, "Unknown key part type");
+            return nullptr;
+        }
+    }
+
+    napi_value result;
+    NAPI_STATUS_THROWS_NULL(napi_create_buffer_copy(env, key.size(), key.data(), NULL, &result));
+
+    return result;
+}
+
+napi_value key_decode(napi_env env, napi_callback_info cbinfo)
+{
+    NAPI_ARGV(2);
+
+    uint32_t num_types;
+    NAPI_STATUS_THROWS_NULL(napi_get_array_length(env, argv[0], &num_types));
+
+    std::string_view key;
+    NAPI_STATUS_THROWS_NULL(napi_buffer_to_string_view(env, argv[1], key));
+
+    napi_value result;
+    NAPI_STATUS_THROWS_NULL(napi_create_array_with_length(env, num_types, &result));
+
+    for (uint32_t i = 0; i < num_types; i++)
+    {
+        napi_value type_element;
+        NAPI_STATUS_THROWS_NULL(napi_get_element(env, argv[0], i, &type_element));
+
+        std::string type;
+        NAPI_STATUS_THROWS_NULL(napi_utf8_to_string(env, type_element, type));
+
+        napi_value part;
+        try
+        {
+            if (type == "uint64")
+            {
+                NAPI_STATUS_THROWS_NULL(napi_create_bigint_uint64(env, tendb::key_encoding::decode_uint64(key), &part));
+            }
+            else if (type == "int64")
+            {
+                NAPI_STATUS_THROWS_NULL(napi_create_bigint_int64(env, tendb::key_encoding::decode_int64(key), &part));
+            }
+            else if (type == "double")
+            {
+                NAPI_STATUS_THROWS_NULL(napi_create_double(env, tendb::key_encoding::decode_double(key), &part));
+            }
+            else if (type == "string")
+            {
+                std::string value = tendb::key_encoding::decode_string(key);
+                NAPI_STATUS_THROWS_NULL(napi_create_string_utf8(env, value.data(), value.size(), &part));
+            }
+            else if (type == "buffer")
+            {
+                std::string value = tendb::key_encoding::decode_string(key);
+                NAPI_STATUS_THROWS_NULL(napi_create_buffer_copy(env, value.size(), value.data(), NULL, &part));
+            }
+            else
+            {
+                napi_throw_type_error(env, NULL, "Unknown key part type");
+                return nullptr;
+            }
+        }
+        catch (const std::exception &e)
+        {
+            napi_throw_range_error(env, NULL, e.what());
+            return nullptr;
+        }
+
+        NAPI_STATUS_THROWS_NULL(napi_set_element(env, result, i, part));
+    }
+
+    return result;
+}
+
 napi_value init(napi_env env, napi_value exports)
 {
     NAPI_EXPORT_FUNCTION(create_pbt_writer);
@@ -387,9 +602,12 @@ napi_value init(napi_env env, napi_value exports)
     NAPI_EXPORT_FUNCTION(pbt_writer_merge);
     NAPI_EXPORT_FUNCTION(pbt_writer_finish);
     NAPI_EXPORT_FUNCTION(create_pbt_reader);
+    NAPI_EXPORT_FUNCTION(create_pbt_reader_from_buffer);
     NAPI_EXPORT_FUNCTION(pbt_reader_get);
     NAPI_EXPORT_FUNCTION(pbt_reader_get_copy_to);
     NAPI_EXPORT_FUNCTION(pbt_reader_at);
+    NAPI_EXPORT_FUNCTION(pbt_reader_rank);
+    NAPI_EXPORT_FUNCTION(pbt_reader_count);
     NAPI_EXPORT_FUNCTION(pbt_reader_begin);
     NAPI_EXPORT_FUNCTION(pbt_reader_end);
     NAPI_EXPORT_FUNCTION(pbt_reader_seek);
@@ -400,6 +618,8 @@ napi_value init(napi_env env, napi_value exports)
     NAPI_EXPORT_FUNCTION(pbt_keyvalue_iterator_get_key_copy_to);
     NAPI_EXPORT_FUNCTION(pbt_keyvalue_iterator_get_value);
     NAPI_EXPORT_FUNCTION(pbt_keyvalue_iterator_get_value_copy_to);
+    NAPI_EXPORT_FUNCTION(key_encode);
+    NAPI_EXPORT_FUNCTION(key_decode);
 
     return exports;
 }
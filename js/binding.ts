@@ -34,6 +34,9 @@ type ExternalWriter = Branded<{}, "ExternalWriter">;
 type ExternalReader = Branded<{}, "ExternalReader">;
 type ExternalKeyValueIterator = Branded<{}, "ExternalKeyValueIterator">;
 
+export type KeyPartType = "uint64" | "int64" | "double" | "string" | "buffer";
+export type KeyPart = bigint | number | string | Buffer;
+
 export function create_pbt_writer(path: string): ExternalWriter {
     return binding.create_pbt_writer(path);
 }
@@ -54,6 +57,10 @@ export function create_pbt_reader(path: string): ExternalReader {
     return binding.create_pbt_reader(path);
 }
 
+export function create_pbt_reader_from_buffer(buffer: Buffer): ExternalReader {
+    return binding.create_pbt_reader_from_buffer(buffer);
+}
+
 export function pbt_reader_get(reader: ExternalReader, key: Buffer): Buffer | null {
     return binding.pbt_reader_get(reader, key);
 }
@@ -66,6 +73,14 @@ export function pbt_reader_at(reader: ExternalReader, index: number): Buffer | n
     return binding.pbt_reader_at(reader, index);
 }
 
+export function pbt_reader_rank(reader: ExternalReader, key: Buffer): number {
+    return binding.pbt_reader_rank(reader, key);
+}
+
+export function pbt_reader_count(reader: ExternalReader, first_key: Buffer, last_key: Buffer): number {
+    return binding.pbt_reader_count(reader, first_key, last_key);
+}
+
 export function pbt_reader_begin(reader: ExternalReader): ExternalKeyValueIterator {
     return binding.pbt_reader_begin(reader);
 }
@@ -105,3 +120,11 @@ export function pbt_keyvalue_iterator_get_value(iterator: ExternalKeyValueIterat
 export function pbt_keyvalue_iterator_get_value_copy_to(iterator: ExternalKeyValueIterator, out: Buffer): number {
     return binding.pbt_keyvalue_iterator_get_value_copy_to(iterator, out);
 }
+
+export function key_encode(types: KeyPartType[], parts: KeyPart[]): Buffer {
+    return binding.key_encode(types, parts);
+}
+
+export function key_decode(types: KeyPartType[], key: Buffer): KeyPart[] {
+    return binding.key_decode(types, key);
+}
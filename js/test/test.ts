@@ -1,8 +1,11 @@
+import { readFileSync } from "fs";
+
 import {
     create_pbt_writer,
     pbt_writer_add,
     pbt_writer_finish,
     create_pbt_reader,
+    create_pbt_reader_from_buffer,
     pbt_reader_get,
     pbt_reader_at,
     pbt_reader_begin,
@@ -35,3 +38,7 @@ while (!pbt_keyvalue_iterator_equals(itr, end)) {
     console.log(`Key: ${pbt_keyvalue_iterator_get_key(itr).toString()}, Value: ${pbt_keyvalue_iterator_get_value(itr).toString()}`);
     pbt_keyvalue_iterator_increment(itr);
 }
+
+const buffer_reader = create_pbt_reader_from_buffer(readFileSync("out/nodejs.pbt"));
+console.log(`Value at key-1 from buffer: ${pbt_reader_get(buffer_reader, Buffer.from("key-1"))?.toString()}`);
+console.log(`Value at key-2 from buffer: ${pbt_reader_get(buffer_reader, Buffer.from("key-2"))?.toString()}`);
@@ -0,0 +1,49 @@
+import {
+    create_pbt_writer,
+    pbt_writer_add,
+    pbt_writer_finish,
+    create_pbt_reader,
+    pbt_reader_begin,
+    pbt_reader_end,
+    pbt_keyvalue_iterator_increment,
+    pbt_keyvalue_iterator_equals,
+    pbt_keyvalue_iterator_get_key,
+    pbt_keyvalue_iterator_get_value,
+    key_encode,
+    key_decode,
+    KeyPartType,
+} from "../binding";
+
+const types: KeyPartType[] = ["int64", "double", "string"];
+
+const writer = create_pbt_writer("out/nodejs_keys.pbt");
+for (let i = -4n; i < 4n; i++) {
+    pbt_writer_add(writer, key_encode(types, [i, -0.5, "a"]), Buffer.from(`value ${i}, -0.5, a`));
+    pbt_writer_add(writer, key_encode(types, [i, 0.5, "a"]), Buffer.from(`value ${i}, 0.5, a`));
+    pbt_writer_add(writer, key_encode(types, [i, 0.5, "b"]), Buffer.from(`value ${i}, 0.5, b`));
+}
+pbt_writer_finish(writer);
+
+const reader = create_pbt_reader("out/nodejs_keys.pbt");
+const itr = pbt_reader_begin(reader);
+const end = pbt_reader_end(reader);
+while (!pbt_keyvalue_iterator_equals(itr, end)) {
+    const key = key_decode(types, pbt_keyvalue_iterator_get_key(itr));
+    console.log(`Key: ${key.join(", ")}, Value: ${pbt_keyvalue_iterator_get_value(itr).toString()}`);
+    pbt_keyvalue_iterator_increment(itr);
+}
+
+// BigInts that do not fit the type are rejected, as a wrapped value would be encoded out of order
+const out_of_range: [KeyPartType, bigint][] = [["uint64", -1n], ["uint64", 2n ** 64n], ["int64", 2n ** 63n], ["int64", -(2n ** 63n) - 1n]];
+for (const [type, part] of out_of_range) {
+    try {
+        key_encode([type], [part]);
+    } catch (e) {
+        if (e instanceof RangeError) {
+            continue;
+        }
+        throw e;
+    }
+    throw new Error(`Out of range ${type} key part was encoded: ${part}`);
+}
+console.log("Out of range key parts are rejected");
@@ -0,0 +1,866 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "db/db.hpp"
+#include "db/flush.hpp"
+#include "db/write_ahead_log.hpp"
+#include "pbt/options.hpp"
+#include "pbt/reader.hpp"
+#include "pbt/table_cache.hpp"
+#include "pbt/writer.hpp"
+#include "skip_list/skip_list.hpp"
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    constexpr const char *manifest_name = "MANIFEST";
+    constexpr std::string_view run_extension = ".pbt";
+    constexpr std::string_view log_extension = ".log";
+    constexpr std::chrono::seconds background_retry_delay(1); // Wait before a failed flush or compaction is tried again
+
+    // Split the name of a numbered file in the directory into its number and the rest, such as "12.pbt" or "12.pbt.index"
+    bool parse_file_name(const std::string &name, uint64_t &number, std::string_view &suffix)
+    {
+        size_t digits = 0;
+        while (digits < name.size() && name[digits] >= '0' && name[digits] <= '9')
+        {
+            ++digits;
+        }
+        if (digits == 0 || digits > 19)
+        {
+            return false;
+        }
+        number = std::stoull(name.substr(0, digits));
+        suffix = std::string_view(name).substr(digits);
+        return true;
+    }
+
+    // Log records are a checksum of the rest of the record, the key size, the value size with the tombstone flag, the key and the value
+    constexpr size_t record_header_size = sizeof(uint32_t) + 2 * sizeof(uint64_t);
+    constexpr uint64_t tombstone_flag = static_cast<uint64_t>(1) << 63;
+
+    // CRC-32 (IEEE), computed with a lookup table
+    uint32_t crc32(const char *data, size_t size)
+    {
+        static const auto table = []()
+        {
+            std::array<uint32_t, 256> table;
+            for (uint32_t i = 0; i < 256; ++i)
+            {
+                uint32_t crc = i;
+                for (int j = 0; j < 8; ++j)
+                {
+                    crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+                }
+                table[i] = crc;
+            }
+            return table;
+        }();
+
+        uint32_t crc = 0xFFFFFFFF;
+        for (size_t i = 0; i < size; ++i)
+        {
+            crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+        }
+        return crc ^ 0xFFFFFFFF;
+    }
+
+    // Apply log records to a skip list in order, up to the first incomplete or damaged record; returns the number of records
+    uint64_t apply_records(const std::string &data, tendb::skip_list::SkipList &table)
+    {
+        uint64_t num_records = 0;
+        size_t offset = 0;
+        while (data.size() - offset >= record_header_size)
+        {
+            const char *record = data.data() + offset;
+            uint32_t checksum;
+            uint64_t key_size;
+            uint64_t value_size;
+            std::memcpy(&checksum, record, sizeof(uint32_t));
+            std::memcpy(&key_size, record + sizeof(uint32_t), sizeof(uint64_t));
+            std::memcpy(&value_size, record + sizeof(uint32_t) + sizeof(uint64_t), sizeof(uint64_t));
+            bool deleted = (value_size & tombstone_flag) != 0;
+            value_size &= ~tombstone_flag;
+
+            // A crash can leave a partly written record at the end, which is where the log ends
+            uint64_t available = data.size() - offset - record_header_size;
+            if (key_size > available || value_size > available - key_size)
+            {
+                break;
+            }
+            size_t record_size = record_header_size + key_size + value_size;
+            if (crc32(record + sizeof(uint32_t), record_size - sizeof(uint32_t)) != checksum)
+            {
+                break;
+            }
+
+            std::string_view key(record + record_header_size, key_size);
+            if (deleted)
+            {
+                table.del(key);
+            }
+            else
+            {
+                table.put(key, std::string_view(record + record_header_size + key_size, value_size));
+            }
+            offset += record_size;
+            ++num_records;
+        }
+        return num_records;
+    }
+
+    // Sync a file to the device, so that a rename that makes it visible cannot reach the device before its contents
+    void sync_file(const std::filesystem::path &path)
+    {
+#if defined(_WIN32)
+        int fd = _open(path.string().c_str(), _O_WRONLY | _O_BINARY);
+        int result = fd < 0 ? -1 : _commit(fd);
+#else
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        int result = fd < 0 ? -1 : ::fsync(fd);
+#endif
+        int error = errno;
+        if (fd >= 0)
+        {
+#if defined(_WIN32)
+            _close(fd);
+#else
+            ::close(fd);
+#endif
+        }
+        if (result != 0)
+        {
+            throw std::runtime_error("Failed to sync: " + path.string() + ": " + std::strerror(error));
+        }
+    }
+
+    // Sync the entries of a directory, so that files created, renamed or removed in it stay that way after a crash
+    void sync_directory([[maybe_unused]] const std::filesystem::path &path)
+    {
+        // Directories cannot be opened for syncing on Windows, where NTFS journals changes to them itself
+#if !defined(_WIN32)
+        sync_file(path);
+#endif
+    }
+}
+
+tendb::WriteAheadLog::WriteAheadLog(const std::string &path, bool sync, skip_list::SkipList *table)
+    : path(path), sync(sync), table(table), num_appended(0), num_written(0), writing(false)
+{
+#if defined(_WIN32)
+    fd = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+#endif
+    if (fd < 0)
+    {
+        throw std::runtime_error("Failed to open log: " + path);
+    }
+    size = std::filesystem::file_size(path);
+}
+
+tendb::WriteAheadLog::~WriteAheadLog()
+{
+#if defined(_WIN32)
+    _close(fd);
+#else
+    ::close(fd);
+#endif
+}
+
+void tendb::WriteAheadLog::write_group(const std::string &group) const
+{
+    size_t offset = 0;
+    while (offset < group.size())
+    {
+#if defined(_WIN32)
+        int written_size = _write(fd, group.data() + offset, static_cast<unsigned>(std::min<size_t>(group.size() - offset, 1 << 30)));
+#else
+        ssize_t written_size = ::write(fd, group.data() + offset, group.size() - offset);
+#endif
+        if (written_size < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw std::runtime_error("Failed to write log: " + path + ": " + std::strerror(errno));
+        }
+        offset += written_size;
+    }
+
+    if (!sync)
+    {
+        return;
+    }
+#if defined(_WIN32)
+    int result = _commit(fd);
+#elif defined(__linux__)
+    int result = ::fdatasync(fd);
+#else
+    int result = ::fsync(fd);
+#endif
+    if (result != 0)
+    {
+        throw std::runtime_error("Failed to sync log: " + path + ": " + std::strerror(errno));
+    }
+}
+
+void tendb::WriteAheadLog::add(const std::string_view &key, const std::string_view &value, bool deleted)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+
+    size_t record_size = record_header_size + key.size() + value.size();
+    size_t offset = buffer.size();
+    buffer.resize(offset + record_size);
+    char *record = buffer.data() + offset;
+    uint64_t key_size = key.size();
+    uint64_t value_size = value.size() | (deleted ? tombstone_flag : 0);
+    std::memcpy(record + sizeof(uint32_t), &key_size, sizeof(uint64_t));
+    std::memcpy(record + sizeof(uint32_t) + sizeof(uint64_t), &value_size, sizeof(uint64_t));
+    std::copy(key.begin(), key.end(), record + record_header_size);
+    std::copy(value.begin(), value.end(), record + record_header_size + key.size());
+    uint32_t checksum = crc32(record + sizeof(uint32_t), record_size - sizeof(uint32_t));
+    std::memcpy(record, &checksum, sizeof(uint32_t));
+    size += record_size;
+
+    uint64_t number = ++num_appended;
+    while (num_written < number)
+    {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+        if (writing)
+        {
+            // The leader is writing an earlier group, and one of the writers waiting here leads the next one
+            written.wait(lock);
+            continue;
+        }
+
+        writing = true;
+        std::string group;
+        group.swap(buffer);
+        uint64_t group_end = num_appended;
+        lock.unlock();
+
+        // The next leader waits until this group is applied, so that groups reach the memtable in log order
+        std::exception_ptr group_error;
+        try
+        {
+            write_group(group);
+            if (table)
+            {
+                apply_records(group, *table);
+            }
+        }
+        catch (...)
+        {
+            group_error = std::current_exception();
+        }
+
+        lock.lock();
+        writing = false;
+        if (group_error)
+        {
+            error = group_error;
+        }
+        else
+        {
+            num_written = group_end;
+        }
+        written.notify_all();
+    }
+}
+
+uint64_t tendb::WriteAheadLog::get_size()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return size;
+}
+
+uint64_t tendb::WriteAheadLog::replay(const std::string &path, skip_list::SkipList &table)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error("Failed to open log: " + path);
+    }
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return apply_records(data, table);
+}
+
+uint64_t tendb::flush_skip_list(const skip_list::SkipList &table, pbt::Writer &writer)
+{
+    for (auto itr = table.begin(true); itr != table.end(); ++itr)
+    {
+        // Load the data once, as a concurrent replacement of the value would otherwise mix key and value of different data
+        const skip_list::Data *data = *itr;
+        if (data->is_deleted())
+        {
+            writer.add_tombstone(data->key());
+        }
+        else
+        {
+            writer.add(data->key(), data->value());
+        }
+    }
+    writer.finish();
+    return writer.get_num_items();
+}
+
+tendb::DB::Run::Run(const std::string &path, uint64_t number, pbt::TableCache &cache)
+    : path(path), number(number), size(std::filesystem::file_size(path)), cache(cache), obsolete(false)
+{
+    cache.add(path);
+    cache.get_info(path, info);
+}
+
+tendb::DB::Run::~Run()
+{
+    // Lookups and compactions hold the run while they use its reader, so the reader is no longer used here
+    cache.remove(path);
+    if (obsolete.load())
+    {
+        std::error_code error;
+        std::filesystem::remove(path, error);
+    }
+}
+
+tendb::DB::DB(const std::string &directory, const DBOptions &opts)
+    : directory(directory),
+      options(opts),
+      table_cache(opts.max_open_runs, opts.table_options),
+      immutable_number(0),
+      memtable_size(0),
+      runs(std::make_shared<const RunList>()),
+      next_run_number(1),
+      stopping(false)
+{
+    if (!options.table_options.is_lexical())
+    {
+        throw std::runtime_error("DB requires tables with bytewise key order, like the memtable");
+    }
+
+    std::filesystem::create_directories(directory);
+    open_runs();
+    create_memtable();
+
+    background = std::thread(&DB::run_background, this);
+}
+
+tendb::DB::~DB()
+{
+    // Flush the memtable, so that its log does not have to be replayed; if that fails, the log is replayed on the next open
+    try
+    {
+        flush();
+    }
+    catch (...)
+    {
+    }
+
+    {
+        std::lock_guard<std::shared_mutex> lock(mutex);
+        stopping = true;
+    }
+    state_changed.notify_all();
+    background.join();
+
+    if (memtable->is_empty())
+    {
+        memtable_log.reset();
+        std::error_code error;
+        std::filesystem::remove(log_path(memtable_number), error);
+    }
+}
+
+std::string tendb::DB::run_path(uint64_t number) const
+{
+    return (std::filesystem::path(directory) / (std::to_string(number) + std::string(run_extension))).string();
+}
+
+std::string tendb::DB::log_path(uint64_t number) const
+{
+    return (std::filesystem::path(directory) / (std::to_string(number) + std::string(log_extension))).string();
+}
+
+void tendb::DB::open_runs()
+{
+    // Files are only removed as garbage against a manifest that was read in full, as anything else would remove live runs
+    std::vector<std::string> names;
+    std::filesystem::path manifest_path = std::filesystem::path(directory) / manifest_name;
+    bool has_manifest = std::filesystem::exists(manifest_path);
+    if (has_manifest)
+    {
+        std::ifstream manifest(manifest_path);
+        if (!manifest)
+        {
+            throw std::runtime_error("Failed to open manifest: " + manifest_path.string());
+        }
+        for (std::string name; std::getline(manifest, name);)
+        {
+            if (!name.empty())
+            {
+                names.push_back(name);
+            }
+        }
+        if (manifest.bad())
+        {
+            throw std::runtime_error("Failed to read manifest: " + manifest_path.string());
+        }
+    }
+
+    RunList run_list;
+    std::vector<uint64_t> run_numbers;
+    for (const auto &name : names)
+    {
+        uint64_t number;
+        std::string_view suffix;
+        if (!parse_file_name(name, number, suffix) || suffix != run_extension)
+        {
+            throw std::runtime_error("Invalid run in manifest: " + name);
+        }
+        run_list.push_back(std::make_shared<Run>(run_path(number), number, table_cache));
+        run_numbers.push_back(number);
+        next_run_number = std::max(next_run_number, number + 1);
+    }
+
+    // Remove files of flushes and compactions that did not make it into the manifest, and logs that were flushed
+    std::vector<uint64_t> log_numbers;
+    for (const auto &entry : std::filesystem::directory_iterator(directory))
+    {
+        std::string name = entry.path().filename().string();
+        uint64_t number;
+        std::string_view suffix;
+        if (!parse_file_name(name, number, suffix))
+        {
+            continue;
+        }
+        next_run_number = std::max(next_run_number, number + 1);
+
+        if (!has_manifest && suffix == run_extension)
+        {
+            throw std::runtime_error("Missing manifest for the runs in: " + directory);
+        }
+
+        bool in_manifest = std::find(run_numbers.begin(), run_numbers.end(), number) != run_numbers.end();
+        if (suffix == log_extension && !in_manifest)
+        {
+            log_numbers.push_back(number);
+        }
+        else if (suffix == log_extension || (suffix.starts_with(run_extension) && !(suffix == run_extension && in_manifest)))
+        {
+            std::filesystem::remove(entry.path());
+        }
+    }
+
+    // A new store starts with an empty manifest, so that a store without one is known to be damaged
+    if (!has_manifest)
+    {
+        write_manifest(run_list);
+    }
+
+    std::sort(log_numbers.begin(), log_numbers.end());
+    recover_logs(log_numbers, run_list);
+
+    runs = std::make_shared<const RunList>(std::move(run_list));
+}
+
+void tendb::DB::recover_logs(const std::vector<uint64_t> &numbers, RunList &run_list)
+{
+    if (numbers.empty())
+    {
+        return;
+    }
+
+    // Every log becomes a run of its own number, from oldest to newest, and is removed once the manifest lists that run
+    // After a crash in between, the logs of listed runs are removed on open and only the others are replayed again
+    for (uint64_t number : numbers)
+    {
+        // The table keeps its tombstones, as they hide older values of the keys in the runs
+        skip_list::SkipList table(true);
+        WriteAheadLog::replay(log_path(number), table);
+        if (!table.is_empty())
+        {
+            run_list.insert(run_list.begin(), write_run(table, number));
+            write_manifest(run_list);
+        }
+        std::filesystem::remove(log_path(number));
+    }
+}
+
+void tendb::DB::create_memtable()
+{
+    // Called with the exclusive lock held, or before the background thread starts
+    memtable_number = next_run_number++;
+    memtable = std::make_shared<skip_list::SkipList>(true); // Tombstones are flushed to hide older values in the runs
+    memtable_log = std::make_unique<WriteAheadLog>(log_path(memtable_number), options.sync, memtable.get());
+    memtable_size.store(0, std::memory_order_relaxed);
+}
+
+void tendb::DB::write_manifest(const RunList &run_list) const
+{
+    // Write a new manifest and rename it over the old one, so that the list of runs is replaced at once
+    std::filesystem::path manifest_path = std::filesystem::path(directory) / manifest_name;
+    std::filesystem::path temporary_path = manifest_path;
+    temporary_path += ".tmp";
+    {
+        std::ofstream manifest(temporary_path, std::ios::trunc);
+        for (const auto &run : run_list)
+        {
+            manifest << std::filesystem::path(run->path).filename().string() << '\n';
+        }
+        manifest.flush();
+        if (!manifest)
+        {
+            throw std::runtime_error("Failed to write manifest: " + temporary_path.string());
+        }
+    }
+
+    // The new manifest is synced before the rename, and the rename before the callers remove files that the old one listed
+    // New runs are synced by write_run and compact_runs, and their directory entries are synced along with the rename
+    sync_file(temporary_path);
+    std::filesystem::rename(temporary_path, manifest_path);
+    sync_directory(directory);
+}
+
+void tendb::DB::put(const std::string_view &key, const std::string_view &value)
+{
+    write(key, value, false);
+}
+
+void tendb::DB::del(const std::string_view &key)
+{
+    write(key, std::string_view(), true);
+}
+
+void tendb::DB::write(const std::string_view &key, const std::string_view &value, bool deleted)
+{
+    make_room_for_write();
+
+    // Shared, as writers share log groups; the memtable is only swapped under the exclusive lock
+    // The log applies the write to the memtable in log order once it is written, and returns once the log is synced
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    memtable_size.fetch_add(skip_list::Data::size(key, value), std::memory_order_relaxed);
+    memtable_log->add(key, value, deleted);
+}
+
+void tendb::DB::make_room_for_write()
+{
+    if (memtable_size.load(std::memory_order_relaxed) < options.memtable_size)
+    {
+        return;
+    }
+
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    while (true)
+    {
+        if (background_error)
+        {
+            std::rethrow_exception(background_error);
+        }
+        if (memtable_size.load(std::memory_order_relaxed) < options.memtable_size)
+        {
+            return; // Another writer froze the memtable in the meantime
+        }
+        if (!immutable)
+        {
+            freeze_memtable();
+            return;
+        }
+
+        // The previous memtable is still being flushed, so writes stall until it is done
+        state_changed.wait(lock);
+    }
+}
+
+void tendb::DB::freeze_memtable()
+{
+    // Called with the exclusive lock held, so no writer is inserting into the memtable
+    immutable = memtable;
+    immutable_log = std::move(memtable_log);
+    immutable_number = memtable_number;
+    create_memtable();
+    state_changed.notify_all();
+}
+
+std::optional<std::string> tendb::DB::get(const std::string_view &key)
+{
+    std::shared_ptr<skip_list::SkipList> tables[2];
+    std::shared_ptr<const RunList> run_list;
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        tables[0] = memtable;
+        tables[1] = immutable;
+        run_list = runs;
+    }
+
+    // The first table that has the key decides, where a tombstone means the key is deleted
+    for (const auto &table : tables)
+    {
+        if (!table)
+        {
+            continue;
+        }
+
+        // The data may be replaced and freed by concurrent writes, so it is pinned until the value is copied
+        skip_list::SkipList::Guard guard = table->pin();
+        const skip_list::Data *data = table->get_data(key);
+        if (data != nullptr)
+        {
+            return data->is_deleted() ? std::nullopt : std::optional<std::string>(data->value());
+        }
+    }
+
+    for (const auto &run : *run_list)
+    {
+        // Runs whose key range does not cover the key are skipped without opening them
+        const pbt::TableInfo &info = run->info;
+        if (info.num_items == 0 || pbt::LexicalCompare{}(key, info.first_key) < 0 || pbt::LexicalCompare{}(key, info.last_key) > 0)
+        {
+            continue;
+        }
+
+        // The reader is held until the value is copied, as the cache may close it once it is evicted
+        std::shared_ptr<const pbt::Reader> reader = table_cache.get(run->path);
+        const pbt::KeyValueItem *item = reader->get(key);
+        if (item != nullptr)
+        {
+            return item->is_tombstone() ? std::nullopt : std::optional<std::string>(item->value());
+        }
+    }
+
+    return std::nullopt;
+}
+
+void tendb::DB::flush()
+{
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    auto flushed = [&]()
+    {
+        return !immutable || background_error;
+    };
+
+    // Failed work is tried again in the background, so the error of an earlier attempt is cleared to wait for the next one
+    background_error = nullptr;
+    state_changed.wait(lock, flushed);
+    if (!background_error && !memtable->is_empty())
+    {
+        freeze_memtable();
+        state_changed.wait(lock, flushed);
+    }
+
+    if (background_error)
+    {
+        std::rethrow_exception(background_error);
+    }
+}
+
+void tendb::DB::compact()
+{
+    compact_runs(true);
+}
+
+size_t tendb::DB::get_num_runs()
+{
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return runs->size();
+}
+
+std::shared_ptr<tendb::DB::Run> tendb::DB::write_run(const skip_list::SkipList &table, uint64_t number)
+{
+    std::string path = run_path(number);
+    {
+        pbt::Writer writer(path, options.table_options);
+        flush_skip_list(table, writer);
+    }
+
+    // The writer leaves the size that finish truncates the file to unsynced, and the run must be durable before a manifest lists it
+    sync_file(path);
+    return std::make_shared<Run>(path, number, table_cache);
+}
+
+size_t tendb::DB::count_compaction_inputs(const RunList &run_list) const
+{
+    // Size-tiered: the newest runs are taken along with every older run that is not much larger than the runs before it,
+    // so that a run is rewritten about once per doubling in size rather than on every compaction
+    uint64_t newer_size = 0;
+    size_t num_inputs = 0;
+    for (const auto &run : run_list)
+    {
+        if (num_inputs > 0 && run->size > newer_size * options.compaction_size_ratio)
+        {
+            break;
+        }
+        newer_size += run->size;
+        ++num_inputs;
+    }
+    return num_inputs >= std::max<size_t>(options.compaction_trigger, 2) ? num_inputs : 0;
+}
+
+bool tendb::DB::compact_runs(bool all_runs)
+{
+    std::lock_guard<std::mutex> compaction_lock(compaction_mutex);
+
+    // Only flushes change the run list in the meantime, and they add runs in front of the inputs
+    RunList inputs;
+    bool bottom_most;
+    uint64_t number;
+    {
+        std::lock_guard<std::shared_mutex> lock(mutex);
+        size_t num_inputs = all_runs ? runs->size() : count_compaction_inputs(*runs);
+        if (num_inputs == 0)
+        {
+            return false;
+        }
+        inputs.assign(runs->begin(), runs->begin() + num_inputs);
+        bottom_most = num_inputs == runs->size();
+        number = next_run_number++;
+    }
+
+    // Tombstones can only be dropped when no older runs are left that they hide values in
+    std::string path = run_path(number);
+    std::vector<std::shared_ptr<const pbt::Reader>> handles;
+    std::vector<const pbt::Reader *> readers;
+    for (const auto &run : inputs)
+    {
+        handles.push_back(table_cache.get(run->path));
+        readers.push_back(handles.back().get());
+    }
+    pbt::MergeOptions merge_options;
+    merge_options.deduplicate = true;
+    merge_options.bottom_most = bottom_most;
+    merge_options.num_threads = options.compaction_threads;
+    {
+        pbt::Writer writer(path, options.table_options);
+        writer.merge(readers.data(), readers.size(), merge_options);
+        writer.finish();
+    }
+    sync_file(path);
+    auto output = std::make_shared<Run>(path, number, table_cache);
+    if (output->info.num_items == 0)
+    {
+        output->obsolete.store(true);
+        output = nullptr;
+    }
+
+    // The output takes the place of the inputs, behind the runs flushed during the compaction and in front of older runs
+    std::lock_guard<std::shared_mutex> lock(mutex);
+    RunList run_list;
+    for (const auto &run : *runs)
+    {
+        if (run == inputs.front() && output)
+        {
+            run_list.push_back(output);
+        }
+        if (std::find(inputs.begin(), inputs.end(), run) == inputs.end())
+        {
+            run_list.push_back(run);
+        }
+    }
+    write_manifest(run_list);
+
+    for (const auto &run : inputs)
+    {
+        run->obsolete.store(true);
+    }
+    runs = std::make_shared<const RunList>(std::move(run_list));
+    state_changed.notify_all();
+    return true;
+}
+
+void tendb::DB::run_background()
+{
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    auto has_work = [&]()
+    {
+        return stopping || immutable || count_compaction_inputs(*runs) > 0;
+    };
+    auto is_stopping = [&]()
+    {
+        return stopping;
+    };
+
+    while (true)
+    {
+        state_changed.wait(lock, has_work);
+
+        try
+        {
+            if (immutable)
+            {
+                std::shared_ptr<skip_list::SkipList> table = immutable;
+                uint64_t number = immutable_number;
+                lock.unlock();
+                std::shared_ptr<Run> run = write_run(*table, number);
+                lock.lock();
+
+                RunList run_list{run};
+                run_list.insert(run_list.end(), runs->begin(), runs->end());
+                write_manifest(run_list);
+                runs = std::make_shared<const RunList>(std::move(run_list));
+                immutable = nullptr;
+                immutable_log.reset();
+                std::filesystem::remove(log_path(number));
+            }
+            else if (stopping)
+            {
+                return;
+            }
+            else
+            {
+                lock.unlock();
+                compact_runs(false);
+                lock.lock();
+            }
+            background_error = nullptr;
+            state_changed.notify_all();
+        }
+        catch (...)
+        {
+            // Writers and flushes that wait on the background thread rethrow the error, while the work is tried again after a delay,
+            // so that a transient failure such as a full disk does not stop the store
+            if (!lock.owns_lock())
+            {
+                lock.lock();
+            }
+            background_error = std::current_exception();
+            state_changed.notify_all();
+            if (state_changed.wait_for(lock, background_retry_delay, is_stopping))
+            {
+                return; // The log of a memtable that could not be flushed is replayed on the next open
+            }
+        }
+    }
+}
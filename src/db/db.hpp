@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "db/write_ahead_log.hpp"
+#include "pbt/options.hpp"
+#include "pbt/reader.hpp"
+#include "pbt/table_cache.hpp"
+#include "skip_list/skip_list.hpp"
+
+namespace tendb
+{
+    struct DBOptions
+    {
+        pbt::Options table_options;                        // Options of the runs, whose compare_fn must order keys bytewise like the memtable
+        uint64_t memtable_size = 64 * 1024 * 1024;         // Memory use of the memtable after which it is flushed to a run
+        size_t compaction_trigger = 4;                     // Number of runs of similar size at which they are compacted into one
+        uint64_t compaction_size_ratio = 1;                // A run is compacted with the newer runs while it is at most this many times their total size
+        size_t max_open_runs = 64;                         // Number of runs whose readers are kept open
+        uint32_t compaction_threads = 1;                   // Threads of the merge that compacts runs, or 0 for the number of cores
+        bool sync = true;                                  // Whether writes wait until their log record is synced to the device, rather than only written to the file
+    };
+
+    /**
+     * Key-value store as a log-structured merge tree.
+     * Writes go to a skip list in memory (the memtable). Once it reaches its size, it is frozen and a background thread
+     * writes it to an immutable tree file (a run), while writes continue in a new memtable.
+     * Reads look at the memtable, the frozen memtable and then the runs from newest to oldest, where deletions are tombstones
+     * that shadow older values. When enough runs of similar size have piled up, the background thread merges them into one,
+     * so that a large run at the bottom is only rewritten once the runs above it add up to its size.
+     * The runs that make up the store are listed in a manifest file, which is replaced atomically whenever the list changes.
+     * Every write is first appended to the write-ahead log of its memtable, which applies it to the memtable in log order.
+     * Logs that were not flushed to a run are each replayed into a run when the store is opened. A run and the log it was
+     * flushed from share the same number.
+     * A flush or compaction that fails is tried again by the background thread after a delay. Until it succeeds, flush and
+     * writes that wait for the memtable to be flushed throw its error, while other reads and writes continue.
+     * All methods are safe to call from multiple threads.
+     */
+    struct DB
+    {
+    private:
+        struct Run
+        {
+            const std::string path;
+            const uint64_t number;
+            const uint64_t size;
+            pbt::TableInfo info; // Key range, which lets lookups skip the run without opening it
+            pbt::TableCache &cache;
+            std::atomic<bool> obsolete; // Whether the file is removed once the run is no longer used
+
+            Run(const std::string &path, uint64_t number, pbt::TableCache &cache);
+            ~Run();
+        };
+
+        typedef std::vector<std::shared_ptr<Run>> RunList; // Newest first
+
+        const std::string directory;
+        const DBOptions options;
+        pbt::TableCache table_cache; // Readers of the runs, which outlives them
+
+        // Guards the memtables and the run list, which are swapped under an exclusive lock
+        // Writers to the memtable hold a shared lock, as the skip list itself is safe for concurrent writes
+        std::shared_mutex mutex;
+        std::condition_variable_any state_changed;
+        std::shared_ptr<skip_list::SkipList> memtable;
+        std::unique_ptr<WriteAheadLog> memtable_log;
+        uint64_t memtable_number;
+        std::shared_ptr<skip_list::SkipList> immutable; // Frozen memtable that is being flushed, or nullptr
+        std::unique_ptr<WriteAheadLog> immutable_log;
+        uint64_t immutable_number;
+        std::atomic<uint64_t> memtable_size;
+        std::shared_ptr<const RunList> runs;
+        uint64_t next_run_number;
+        bool stopping;
+        std::exception_ptr background_error;
+
+        std::mutex compaction_mutex; // Only one compaction runs at a time
+        std::thread background;
+
+        std::string run_path(uint64_t number) const;
+        std::string log_path(uint64_t number) const;
+        void open_runs();
+        void recover_logs(const std::vector<uint64_t> &numbers, RunList &run_list);
+        void create_memtable();
+        void write_manifest(const RunList &run_list) const;
+        void write(const std::string_view &key, const std::string_view &value, bool deleted);
+        void make_room_for_write();
+        void freeze_memtable();
+        std::shared_ptr<Run> write_run(const skip_list::SkipList &table, uint64_t number);
+        size_t count_compaction_inputs(const RunList &run_list) const;
+        bool compact_runs(bool all_runs);
+        void run_background();
+
+    public:
+        DB(const std::string &directory, const DBOptions &opts = DBOptions());
+        ~DB();
+
+        DB(const DB &) = delete;
+        DB &operator=(const DB &) = delete;
+
+        void put(const std::string_view &key, const std::string_view &value);
+        void del(const std::string_view &key);
+        std::optional<std::string> get(const std::string_view &key);
+
+        void flush();   // Write the memtable to a run, and wait until it is written
+        void compact(); // Merge all runs into one, and wait until it is done
+        size_t get_num_runs();
+    };
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+
+#include "pbt/writer.hpp"
+#include "skip_list/skip_list.hpp"
+
+namespace tendb
+{
+    // Write all entries of a skip list to a writer in key order, with a tombstone for every deleted key, and finish the writer
+    // Only a skip list that keeps its tombstones still has every deleted key
+    // Keys and values go from the skip list into the writer without intermediate copies
+    // The skip list should no longer be written to, like a frozen memtable, while writes to other skip lists continue
+    // Returns the number of items written
+    uint64_t flush_skip_list(const skip_list::SkipList &table, pbt::Writer &writer);
+}
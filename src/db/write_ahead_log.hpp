@@ -0,0 +1,59 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "skip_list/skip_list.hpp"
+
+namespace tendb
+{
+    /**
+     * Append-only log of the writes to a memtable, from which the memtable is rebuilt after a crash.
+     * Writes are committed in groups: concurrent writers append their records to a shared buffer, and whichever writer
+     * finds no write in progress becomes the leader, which writes the whole buffer and syncs it once for everyone.
+     * Writers that arrive meanwhile fill the buffer for the next group, so the number of syncs follows the sync latency
+     * rather than the number of writers.
+     * A log can be given the memtable it belongs to, to which the leader applies every group after writing it. The memtable
+     * then takes writes in log order, like a replay does, and a write only becomes visible once it is in the log.
+     * Every record carries a checksum, and replay stops at the first incomplete or damaged record, which is where a crash
+     * interrupted the log.
+     * All methods are safe to call from multiple threads.
+     */
+    struct WriteAheadLog
+    {
+    private:
+        const std::string path;
+        const bool sync;
+        skip_list::SkipList *const table; // Memtable that written groups are applied to, or nullptr
+        int fd;
+
+        std::mutex mutex;
+        std::condition_variable written;
+        std::string buffer;       // Records of the next group
+        uint64_t num_appended;    // Records appended to the buffer so far
+        uint64_t num_written;     // Records written (and synced) so far
+        bool writing;             // Whether a leader is writing a group
+        uint64_t size;            // Bytes appended to the log so far
+        std::exception_ptr error; // Failure of a group write, after which the log is unusable
+
+        void write_group(const std::string &group) const;
+
+    public:
+        WriteAheadLog(const std::string &path, bool sync = true, skip_list::SkipList *table = nullptr);
+        ~WriteAheadLog();
+
+        WriteAheadLog(const WriteAheadLog &) = delete;
+        WriteAheadLog &operator=(const WriteAheadLog &) = delete;
+
+        // Returns once the record is written, synced to the device when the log syncs, and applied to the memtable of the log
+        void add(const std::string_view &key, const std::string_view &value, bool deleted = false);
+        uint64_t get_size();
+
+        // Apply the records of a log to a skip list, in the order they were written; returns the number of records
+        static uint64_t replay(const std::string &path, skip_list::SkipList &table);
+    };
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+/**
+ * Order-preserving key encoding.
+ * Every encoded value compares bytewise (memcmp) in the same order as the original values compare,
+ * so that typed and composite keys can be stored with the default lexical comparator.
+ * Encoded values are self-delimiting, so a tuple is encoded by appending the encodings of its parts.
+ * Decoding requires knowing the types of the parts; no type tags are stored.
+ */
+namespace tendb::key_encoding
+{
+    constexpr static char STRING_ESCAPE = '\x00';
+    constexpr static char STRING_ESCAPED_ZERO = '\xFF';
+    constexpr static char STRING_TERMINATOR = '\x01';
+
+    inline void encode_uint64(std::string &out, uint64_t value)
+    {
+        char buffer[sizeof(uint64_t)];
+        for (size_t i = 0; i < sizeof(uint64_t); ++i)
+        {
+            buffer[i] = static_cast<char>(value >> (8 * (sizeof(uint64_t) - 1 - i)));
+        }
+        out.append(buffer, sizeof(buffer));
+    }
+
+    inline void encode_int64(std::string &out, int64_t value)
+    {
+        // Flip the sign bit, so that negative values sort before positive values
+        encode_uint64(out, static_cast<uint64_t>(value) ^ (static_cast<uint64_t>(1) << 63));
+    }
+
+    inline void encode_double(std::string &out, double value)
+    {
+        // Normalize values that compare equal but have different representations
+        if (value == 0.0)
+        {
+            value = 0.0;
+        }
+        if (std::isnan(value))
+        {
+            value = std::numeric_limits<double>::quiet_NaN();
+        }
+
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+
+        // Negative values have all bits inverted, so that larger magnitudes sort first
+        // Positive values only have the sign bit set, so that they sort after all negative values
+        if ((bits >> 63) != 0)
+        {
+            bits = ~bits;
+        }
+        else
+        {
+            bits |= static_cast<uint64_t>(1) << 63;
+        }
+        encode_uint64(out, bits);
+    }
+
+    inline void encode_string(std::string &out, std::string_view value)
+    {
+        // Zero bytes are escaped, and the terminator sorts before any escaped or regular byte
+        // This keeps a string ordered before every longer string that it is a prefix of
+        size_t start = 0;
+        size_t zero;
+        while ((zero = value.find(STRING_ESCAPE, start)) != std::string_view::npos)
+        {
+            out.append(value.substr(start, zero - start));
+            out.push_back(STRING_ESCAPE);
+            out.push_back(STRING_ESCAPED_ZERO);
+            start = zero + 1;
+        }
+        out.append(value.substr(start));
+        out.push_back(STRING_ESCAPE);
+        out.push_back(STRING_TERMINATOR);
+    }
+
+    inline uint64_t decode_uint64(std::string_view &in)
+    {
+        if (in.size() < sizeof(uint64_t))
+        {
+            throw std::runtime_error("Encoded key is too short for an integer");
+        }
+
+        uint64_t value = 0;
+        for (size_t i = 0; i < sizeof(uint64_t); ++i)
+        {
+            value = (value << 8) | static_cast<uint8_t>(in[i]);
+        }
+        in.remove_prefix(sizeof(uint64_t));
+        return value;
+    }
+
+    inline int64_t decode_int64(std::string_view &in)
+    {
+        return static_cast<int64_t>(decode_uint64(in) ^ (static_cast<uint64_t>(1) << 63));
+    }
+
+    inline double decode_double(std::string_view &in)
+    {
+        uint64_t bits = decode_uint64(in);
+        if ((bits >> 63) != 0)
+        {
+            bits &= ~(static_cast<uint64_t>(1) << 63);
+        }
+        else
+        {
+            bits = ~bits;
+        }
+
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    inline std::string decode_string(std::string_view &in)
+    {
+        std::string value;
+        size_t start = 0;
+        size_t escape;
+        while ((escape = in.find(STRING_ESCAPE, start)) != std::string_view::npos && escape + 1 < in.size())
+        {
+            value.append(in.substr(start, escape - start));
+            if (in[escape + 1] == STRING_TERMINATOR)
+            {
+                in.remove_prefix(escape + 2);
+                return value;
+            }
+            if (in[escape + 1] != STRING_ESCAPED_ZERO)
+            {
+                break;
+            }
+            value.push_back(STRING_ESCAPE);
+            start = escape + 2;
+        }
+
+        throw std::runtime_error("Encoded key contains an unterminated or malformed string");
+    }
+
+    /**
+     * Append the encoding of a value to the output, choosing the encoding based on the type of the value.
+     * Integers are widened to 64 bits, so that integers of different widths share an encoding.
+     */
+    template <typename T>
+    void encode(std::string &out, const T &value)
+    {
+        if constexpr (std::is_floating_point_v<T>)
+        {
+            encode_double(out, static_cast<double>(value));
+        }
+        else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>)
+        {
+            encode_int64(out, static_cast<int64_t>(value));
+        }
+        else if constexpr (std::is_integral_v<T>)
+        {
+            encode_uint64(out, static_cast<uint64_t>(value));
+        }
+        else
+        {
+            encode_string(out, std::string_view(value));
+        }
+    }
+
+    /**
+     * Encode a tuple of values into a single key.
+     */
+    template <typename... Args>
+    std::string encode_key(const Args &...parts)
+    {
+        std::string key;
+        (encode(key, parts), ...);
+        return key;
+    }
+}
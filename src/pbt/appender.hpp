@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <string_view>
+#include <vector>
 
 #include "pbt/format.hpp"
 #include "pbt/storage.hpp"
@@ -13,17 +14,23 @@ namespace tendb::pbt
     private:
         Storage &storage;
         uint64_t offset;
+        const uint64_t writeback_window; // Size of the ranges that are written back and dropped behind the offset, or 0 to leave this to the kernel
+        uint64_t writeback_offset;       // End of the range for which writeback has been started
 
+        void write_behind();
         void ensure_size(uint64_t size);
         void *get_base() const;
 
     public:
-        Appender(Storage &storage);
+        Appender(Storage &storage, uint64_t writeback_window = 0);
 
         uint64_t get_offset() const;
         void append_header();
-        void append_item(const std::string_view &key, const std::string_view &value);
+        void append_item(const std::string_view &key, const std::string_view &value, bool tombstone = false);
         void append_leaf_node(uint32_t item_start, uint32_t item_end, KeyValueItem::Iterator &itr);
-        void append_internal_node(uint32_t child_start, uint32_t child_end, Node::Iterator &itr);
+        void append_leaf_node(uint32_t item_start, uint32_t item_end, uint64_t node_size, KeyValueItem::Iterator &itr);
+        void append_internal_node(uint32_t depth, const std::vector<ChildEntry> &children);
+        void append_bytes(const void *data, uint64_t size);
+        uint64_t append_space(uint64_t size); // Space that is filled in by the caller, returns its offset
     };
 }
@@ -0,0 +1,71 @@
+#pragma once
+
+#if defined(__linux__)
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "pbt/format.hpp"
+#include "pbt/io_ring.hpp"
+#include "pbt/options.hpp"
+
+namespace tendb::pbt
+{
+    // Called once for every key of a batch, with the item of the key or nullptr if it is not found
+    // The item is only valid during the call
+    typedef std::function<void(size_t key_index, const KeyValueItem *item)> lookup_fn_t;
+
+    /**
+     * Looks up batches of keys in a tree, reading nodes and items with asynchronous reads instead of through a memory mapping.
+     * All keys of a batch descend the tree together: every step submits the next node or item read of each key,
+     * up to the queue depth, and continues with whichever reads complete first.
+     * This keeps many reads in flight from a single thread, which is what fast devices need for data that is not cached.
+     * The root node is read once and kept in memory.
+     */
+    struct BatchReader
+    {
+    private:
+        struct Lookup
+        {
+            std::string_view key;
+            uint64_t offset;          // Offset of the node or item being read
+            bool is_item;             // Whether an item is read, rather than a node
+            std::vector<char> buffer; // Data read at the offset
+        };
+
+        static constexpr uint32_t initial_read_size = 4096; // Nodes and items are read with this size first, and again if larger
+
+        const std::string path;
+        const Options options;
+        const bool lexical; // Whether options.compare_fn is LexicalCompare, which is then called directly
+
+        int fd;
+        uint64_t file_size;
+        Header header;
+        std::vector<char> root;
+        IoRing ring;
+
+        int compare(const std::string_view &a, const std::string_view &b) const;
+        void read_fully(void *buffer, uint64_t size, uint64_t offset) const;
+        bool step(Lookup &lookup, const Node *node) const;
+        void prepare(Lookup &lookup, size_t index);
+
+    public:
+        static constexpr unsigned default_queue_depth = 64;
+
+        BatchReader(const std::string &path, const Options &opts = Options(), unsigned queue_depth = default_queue_depth);
+        ~BatchReader();
+
+        BatchReader(const BatchReader &) = delete;
+        BatchReader &operator=(const BatchReader &) = delete;
+
+        bool is_async() const; // Whether reads go through io_uring, rather than synchronous reads
+        const Header *get_header() const;
+        void get(const std::string_view *keys, size_t num_keys, const lookup_fn_t &fn);
+    };
+}
+
+#endif
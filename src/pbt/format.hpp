@@ -2,6 +2,8 @@
 
 #include <cstdint>
 #include <iterator>
+#include <span>
+#include <string>
 #include <string_view>
 
 #include "pbt/storage.hpp"
@@ -27,9 +29,11 @@ namespace tendb::pbt
     {
     private:
         uint64_t key_size;   // Size of the key in bytes
-        uint64_t value_size; // Size of the value in bytes
+        uint64_t value_size; // Size of the value in bytes, with tombstone_flag set for tombstones
         char data[1];        // Key and value data (allocated dynamically)
 
+        static constexpr uint64_t tombstone_flag = static_cast<uint64_t>(1) << 63;
+
         KeyValueItem(const KeyValueItem &) = delete;
         KeyValueItem(KeyValueItem &&) = delete;
         KeyValueItem &operator=(const KeyValueItem &) = delete;
@@ -39,12 +43,13 @@ namespace tendb::pbt
         static uint64_t size_of(uint64_t key_size, uint64_t value_size);
         std::string_view key() const;
         std::string_view value() const;
-        void set_key_value(const std::string_view &key, const std::string_view &value);
+        bool is_tombstone() const; // Whether the item marks its key as deleted, for merges that deduplicate
+        void set_key_value(const std::string_view &key, const std::string_view &value, bool tombstone = false);
 
         struct Iterator
         {
         private:
-            const Storage &storage;
+            const Storage *storage; // Pointer rather than reference, so that iterators can be assigned
             uint64_t current_offset;
 
             using iterator_category = std::input_iterator_tag;
@@ -107,6 +112,15 @@ namespace tendb::pbt
     };
 #pragma pack(pop)
 
+    // In-memory description of a child of a node that is still being built
+    struct ChildEntry
+    {
+        std::string key;     // Smallest key under the child
+        uint64_t offset;     // Offset of the child node or item
+        uint64_t item_start; // Index of the first item under the child
+        uint64_t num_items;  // Number of items under the child
+    };
+
 #pragma pack(push, 1)
     struct Node
     {
@@ -129,8 +143,10 @@ namespace tendb::pbt
         void set_item_start(uint32_t start);
         void set_num_children(uint32_t num);
         void set_node_size(uint32_t size);
+        uint32_t get_depth() const;
         uint32_t get_item_start() const;
         uint32_t get_item_end() const;
+        uint32_t get_node_size() const;
         const ChildReference *first_child() const;
         const ChildReference::Iterator begin() const;
         const ChildReference::Iterator end() const;
@@ -154,10 +170,12 @@ namespace tendb::pbt
             uint64_t get_offset() const;
         };
 
+        static uint64_t size_of_header();
         static uint64_t size_of(uint32_t num_items, KeyValueItem::Iterator itr);
-        static uint64_t size_of(uint32_t num_children, Node::Iterator itr);
+        static uint64_t size_of(std::span<const ChildEntry> children);
         void set_items(uint32_t num_items, KeyValueItem::Iterator &itr);
-        void set_children(uint32_t num_children, Node::Iterator &itr);
+        void set_children(std::span<const ChildEntry> children);
+        void relocate_children(uint64_t delta);
     };
 #pragma pack(pop)
 }
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "pbt/appender.hpp"
+#include "pbt/format.hpp"
+#include "pbt/storage.hpp"
+
+namespace tendb::pbt
+{
+    /**
+     * Builds the nodes of a tree while its items are being appended.
+     * Only the right spine (the one leaf node and the internal nodes that are not yet full) is kept in memory.
+     * Completed nodes are written to a spill file, with offsets of child nodes relative to the start of the spill file.
+     * After the last item, the spill file is copied behind the items and the child node offsets are relocated.
+     * With an empty spill path, the spilled nodes are kept in memory instead.
+     *
+     * Finishing therefore costs O(index size) rather than O(depth). The nodes cannot be appended at their final offsets,
+     * as the file format puts the index after the items, whose total size is only known after the last one.
+     * The index is small next to the items, about one child reference per branch_factor items, and the items are not read again.
+     */
+    struct IndexBuilder
+    {
+    private:
+        const Storage &item_storage;
+        const uint32_t branch_factor;
+        const std::string spill_path;
+        std::unique_ptr<Storage> spill_storage;
+        std::unique_ptr<Appender> spill_appender;
+
+        // Items that are not yet covered by a leaf node
+        uint64_t leaf_item_offset;
+        uint64_t leaf_item_start;
+        uint32_t leaf_num_items;
+        uint64_t leaf_node_size;
+
+        // Children of the internal nodes on the right spine, where spine[i] holds the children of the pending node at depth i + 1
+        std::vector<std::vector<ChildEntry>> spine;
+
+        uint64_t num_items;
+        uint32_t num_leaf_nodes;
+        uint32_t num_internal_nodes;
+        uint32_t depth;
+        uint64_t root_offset;
+
+        void emit_leaf_node();
+        void emit_internal_node(size_t level);
+        void add_child(size_t level, ChildEntry &&child);
+
+    public:
+        IndexBuilder(const Storage &item_storage, const std::string &spill_path, uint32_t branch_factor);
+        ~IndexBuilder();
+
+        IndexBuilder(const IndexBuilder &) = delete;
+        IndexBuilder &operator=(const IndexBuilder &) = delete;
+
+        void add_item(uint64_t item_offset, uint64_t key_size);
+        void finish();
+
+        const void *get_spill_address() const;
+        uint64_t get_spill_size() const;
+        uint32_t get_depth() const;
+        uint32_t get_num_leaf_nodes() const;
+        uint32_t get_num_internal_nodes() const;
+        uint64_t get_root_offset() const;
+    };
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#if defined(__linux__)
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace tendb::pbt
+{
+    /**
+     * Queue of asynchronous file reads, submitted to the kernel through io_uring.
+     * Reads are prepared without a system call, then submitted together, and their completions are reaped from a shared ring.
+     * The caller keeps at most queue_depth reads prepared or in flight at any time.
+     * If the kernel does not support io_uring, reads are done synchronously when submitted, with the same interface.
+     */
+    struct IoRing
+    {
+    private:
+        struct Read
+        {
+            int fd;
+            void *buffer;
+            uint32_t size;
+            uint64_t offset;
+            uint64_t user_data;
+        };
+
+        struct Completion
+        {
+            uint64_t user_data;
+            int64_t result;
+        };
+
+        const unsigned queue_depth;
+        int ring_fd;
+
+        // Submission queue, shared with the kernel
+        void *sq_ring;
+        size_t sq_ring_size;
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned sq_mask;
+        unsigned *sq_array;
+        io_uring_sqe *sqes;
+        size_t sqes_size;
+        unsigned num_unsubmitted;
+
+        // Completion queue, shared with the kernel, possibly in the same mapping as the submission queue
+        void *cq_ring;
+        size_t cq_ring_size;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned cq_mask;
+        io_uring_cqe *cqes;
+
+        // Reads for the synchronous fallback, and their results
+        std::vector<Read> fallback_reads;
+        std::deque<Completion> fallback_completions;
+
+        void setup();
+        void teardown();
+
+    public:
+        IoRing(unsigned queue_depth);
+        ~IoRing();
+
+        IoRing(const IoRing &) = delete;
+        IoRing &operator=(const IoRing &) = delete;
+        IoRing(IoRing &&) = delete;
+        IoRing &operator=(IoRing &&) = delete;
+
+        bool is_async() const; // Whether reads go through io_uring, rather than the synchronous fallback
+        unsigned get_queue_depth() const;
+
+        void prepare_read(int fd, void *buffer, uint32_t size, uint64_t offset, uint64_t user_data);
+        void submit_and_wait(unsigned min_completions); // Submit the prepared reads and wait for at least this many completions
+        bool pop_completion(uint64_t &user_data, int64_t &result); // Result is the number of bytes read, or a negative errno
+    };
+}
+
+#endif
@@ -0,0 +1,311 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "pbt/format.hpp"
+#include "pbt/options.hpp"
+#include "pbt/reader.hpp"
+
+namespace tendb::pbt
+{
+    /**
+     * Merges the items of multiple readers in key order, using a tournament tree of losers.
+     * Every step costs O(log K) key comparisons for K readers, instead of O(K) for a linear scan.
+     * Items with equal keys are produced in the order of their readers, lowest index first.
+     * The comparator is stored by value, so a temporary comparator can be passed.
+     */
+    template <typename Compare>
+    struct Merger
+    {
+    private:
+        const Compare compare;
+        std::vector<const Reader *> readers;
+        std::vector<KeyValueItem::Iterator> iterators;
+        std::vector<KeyValueItem::Iterator> ends;
+        std::vector<std::string_view> keys; // Current key of every source, which saves a lookup through the storage per comparison
+        std::vector<bool> exhausted;
+
+        // tree[0] holds the index of the winning source, tree[1..K-1] hold the losers of the matches played at each internal node
+        // Node n has children 2n and 2n + 1, where nodes K..2K-1 are the sources themselves
+        std::vector<size_t> tree;
+
+        bool is_before(size_t a, size_t b) const;
+        size_t play(size_t node);
+        void load_key(size_t source);
+        void replay(size_t source);
+        void start();
+
+    public:
+        Merger(const Reader **readers, size_t num_readers, const Compare &compare);
+        Merger(const Reader **readers, const ItemRange *ranges, size_t num_readers, const Compare &compare); // Merge only a range of every reader
+
+        bool valid() const;
+        size_t source() const; // Index of the reader of the current item
+        const KeyValueItem *current() const;
+        const KeyValueItem::Iterator &position() const; // Iterator to the current item
+        void next();
+
+        // Iterator past the items of the current reader that come before the items of every other reader
+        // These items can be taken as one contiguous range, after which skip_to moves the current reader past them
+        KeyValueItem::Iterator run_end() const;
+        void skip_to(const KeyValueItem::Iterator &itr);
+    };
+
+    /**
+     * Write the items of a merger to a sink, applying the merge options.
+     * The sink provides add_item(key, value, tombstone) for single items, and append_items(begin, end) for runs of items
+     * that are copied unchanged from one reader.
+     */
+    template <typename Compare, typename Sink>
+    void merge_into(Merger<Compare> &merger, const MergeOptions &merge_options, const Compare &compare, Sink &sink);
+}
+
+template <typename Compare>
+tendb::pbt::Merger<Compare>::Merger(const Reader **readers, size_t num_readers, const Compare &compare)
+    : compare(compare), readers(readers, readers + num_readers)
+{
+    for (size_t i = 0; i < num_readers; ++i)
+    {
+        iterators.emplace_back(readers[i]->begin());
+        ends.emplace_back(readers[i]->end());
+    }
+    start();
+}
+
+template <typename Compare>
+tendb::pbt::Merger<Compare>::Merger(const Reader **readers, const ItemRange *ranges, size_t num_readers, const Compare &compare)
+    : compare(compare), readers(readers, readers + num_readers)
+{
+    for (size_t i = 0; i < num_readers; ++i)
+    {
+        iterators.emplace_back(ranges[i].begin);
+        ends.emplace_back(ranges[i].end);
+    }
+    start();
+}
+
+template <typename Compare>
+void tendb::pbt::Merger<Compare>::start()
+{
+    size_t num_sources = iterators.size();
+    keys.resize(num_sources);
+    exhausted.resize(num_sources);
+    tree.resize(std::max<size_t>(num_sources, 1));
+
+    for (size_t i = 0; i < num_sources; ++i)
+    {
+        load_key(i);
+    }
+    if (num_sources > 0)
+    {
+        tree[0] = play(1);
+    }
+}
+
+template <typename Compare>
+bool tendb::pbt::Merger<Compare>::is_before(size_t a, size_t b) const
+{
+    // Exhausted sources sort after everything else, and equal keys are ordered by source index
+    if (exhausted[a] || exhausted[b])
+    {
+        return exhausted[a] == exhausted[b] ? a < b : exhausted[b];
+    }
+
+    int result = compare(keys[a], keys[b]);
+    return result < 0 || (result == 0 && a < b);
+}
+
+template <typename Compare>
+size_t tendb::pbt::Merger<Compare>::play(size_t node)
+{
+    size_t num_sources = iterators.size();
+    if (node >= num_sources)
+    {
+        return node - num_sources;
+    }
+
+    size_t left = play(2 * node);
+    size_t right = play(2 * node + 1);
+    if (is_before(left, right))
+    {
+        tree[node] = right;
+        return left;
+    }
+    tree[node] = left;
+    return right;
+}
+
+template <typename Compare>
+void tendb::pbt::Merger<Compare>::load_key(size_t source)
+{
+    exhausted[source] = iterators[source] == ends[source];
+    if (!exhausted[source])
+    {
+        keys[source] = (*iterators[source])->key();
+    }
+}
+
+template <typename Compare>
+bool tendb::pbt::Merger<Compare>::valid() const
+{
+    return !iterators.empty() && !exhausted[tree[0]];
+}
+
+template <typename Compare>
+size_t tendb::pbt::Merger<Compare>::source() const
+{
+    return tree[0];
+}
+
+template <typename Compare>
+const tendb::pbt::KeyValueItem *tendb::pbt::Merger<Compare>::current() const
+{
+    return *iterators[tree[0]];
+}
+
+template <typename Compare>
+const tendb::pbt::KeyValueItem::Iterator &tendb::pbt::Merger<Compare>::position() const
+{
+    return iterators[tree[0]];
+}
+
+template <typename Compare>
+void tendb::pbt::Merger<Compare>::replay(size_t source)
+{
+    // Replay the matches on the path from the advanced source to the root
+    size_t num_sources = iterators.size();
+    for (size_t node = (source + num_sources) / 2; node > 0; node /= 2)
+    {
+        if (is_before(tree[node], source))
+        {
+            std::swap(tree[node], source);
+        }
+    }
+    tree[0] = source;
+}
+
+template <typename Compare>
+void tendb::pbt::Merger<Compare>::next()
+{
+    size_t winner = tree[0];
+    ++iterators[winner];
+    load_key(winner);
+    replay(winner);
+}
+
+template <typename Compare>
+tendb::pbt::KeyValueItem::Iterator tendb::pbt::Merger<Compare>::run_end() const
+{
+    // The runner-up is the best of the sources that lost to the winner on its path to the root
+    size_t winner = tree[0];
+    size_t num_sources = iterators.size();
+    size_t runner_up = winner;
+    for (size_t node = (winner + num_sources) / 2; node > 0; node /= 2)
+    {
+        if (runner_up == winner || is_before(tree[node], runner_up))
+        {
+            runner_up = tree[node];
+        }
+    }
+
+    if (runner_up == winner || exhausted[runner_up])
+    {
+        return ends[winner];
+    }
+
+    // Items equal to the key of the runner-up are left to the regular merge, so the run may be empty
+    KeyValueItem::Iterator end = readers[winner]->seek_at(readers[winner]->rank(keys[runner_up], compare));
+    if (end.get_offset() <= iterators[winner].get_offset())
+    {
+        return iterators[winner];
+    }
+    return end.get_offset() < ends[winner].get_offset() ? end : ends[winner];
+}
+
+template <typename Compare>
+void tendb::pbt::Merger<Compare>::skip_to(const KeyValueItem::Iterator &itr)
+{
+    size_t winner = tree[0];
+    iterators[winner] = itr;
+    load_key(winner);
+    replay(winner);
+}
+
+template <typename Compare, typename Sink>
+void tendb::pbt::merge_into(Merger<Compare> &merger, const MergeOptions &merge_options, const Compare &compare, Sink &sink)
+{
+    // After this many items in a row from the same reader, the rest of its run is looked up and copied as a whole
+    constexpr size_t run_copy_threshold = 16;
+
+    // Runs are only copied when items pass through unchanged
+    bool copy_runs = !merge_options.deduplicate && !merge_options.filter_fn;
+
+    // Removed items only need a tombstone when a deduplicating merge may leave older items of the same key elsewhere
+    bool remove_by_tombstone = merge_options.deduplicate && !merge_options.bottom_most;
+
+    std::string new_value;
+    size_t streak_source = 0;
+    size_t streak_length = 0;
+    while (merger.valid())
+    {
+        if (copy_runs)
+        {
+            streak_length = merger.source() == streak_source ? streak_length + 1 : 1;
+            streak_source = merger.source();
+
+            if (streak_length >= run_copy_threshold)
+            {
+                KeyValueItem::Iterator end = merger.run_end();
+                sink.append_items(merger.position(), end);
+                merger.skip_to(end);
+                streak_length = 0;
+                continue;
+            }
+        }
+
+        const KeyValueItem *item = merger.current();
+        if (item->is_tombstone())
+        {
+            if (!(merge_options.deduplicate && merge_options.bottom_most))
+            {
+                sink.add_item(item->key(), item->value(), true);
+            }
+        }
+        else if (merge_options.filter_fn)
+        {
+            switch (merge_options.filter_fn(item->key(), item->value(), new_value))
+            {
+            case FilterDecision::keep:
+                sink.add_item(item->key(), item->value(), false);
+                break;
+            case FilterDecision::remove:
+                if (remove_by_tombstone)
+                {
+                    sink.add_item(item->key(), "", true);
+                }
+                break;
+            case FilterDecision::change_value:
+                sink.add_item(item->key(), new_value, false);
+                break;
+            }
+        }
+        else
+        {
+            sink.add_item(item->key(), item->value(), false);
+        }
+        merger.next();
+
+        // Equal keys come out in reader order, so the first one is the newest and the rest are shadowed by it
+        if (merge_options.deduplicate)
+        {
+            while (merger.valid() && compare(merger.current()->key(), item->key()) == 0)
+            {
+                merger.next();
+            }
+        }
+    }
+}
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <functional>
+#include <string>
 #include <string_view>
 
 namespace tendb::pbt
@@ -16,14 +19,73 @@ namespace tendb::pbt
     //     requires std::same_as<std::ranges::range_value_t<T>, const PBT *>
     // static void merge(const T &sources, PBT &target);
 
-    static compare_fn_t compare_lexically = [](const std::string_view &a, const std::string_view &b)
+    // Bytewise comparison of keys, usable as a compile-time comparator type
+    // Readers and writers detect when compare_fn holds this type, and then avoid the indirect call through std::function
+    struct LexicalCompare
     {
-        return a.compare(b);
+        int operator()(const std::string_view &a, const std::string_view &b) const
+        {
+            size_t size = std::min(a.size(), b.size());
+            int result = size == 0 ? 0 : std::memcmp(a.data(), b.data(), size);
+            if (result != 0)
+            {
+                return result;
+            }
+            return a.size() < b.size() ? -1 : (a.size() > b.size() ? 1 : 0);
+        }
     };
 
+    static compare_fn_t compare_lexically = LexicalCompare{};
+
     struct Options
     {
         uint32_t branch_factor = 8;
         compare_fn_t compare_fn = compare_lexically;
+
+        // By default, the index is built while items are added
+        // With defer_index, it is built in finish() instead, using index_threads threads (0 means one per hardware thread)
+        bool defer_index = false;
+        uint32_t index_threads = 0;
+
+        // When not 0, writers write back their output in windows of this many bytes behind the write position,
+        // and drop written windows from the page cache, so that large writes do not evict other data or cause writeback storms
+        // Some file systems cache files in large folios (e.g. 2 MB), which are only dropped when they fit in one window
+        uint64_t writeback_window = 0;
+
+        bool is_lexical() const
+        {
+            return compare_fn.target<LexicalCompare>() != nullptr;
+        }
+    };
+
+    enum class FilterDecision
+    {
+        keep,         // Write the item as is
+        remove,       // Drop the item, or replace it by a tombstone where older items may still exist
+        change_value, // Write the item with the new value
+    };
+
+    // Called during a merge for every item that survives deduplication, except for tombstones
+    // To change the value, the new value is assigned to new_value and change_value is returned
+    typedef std::function<FilterDecision(const std::string_view &key, const std::string_view &value, std::string &new_value)> filter_fn_t;
+
+    struct MergeOptions
+    {
+        // Emit only the first item of every key, taken from the reader with the lowest index
+        // Readers are then expected to be ordered from newest to oldest
+        bool deduplicate = false;
+
+        // Whether no older items of any key exist outside of the readers, as for the bottom-most level of an LSM tree
+        // When deduplicating, tombstones are then dropped instead of kept to shadow older items
+        bool bottom_most = false;
+
+        // Threads that merge partitions of the key range in parallel (0 means one per hardware thread)
+        // Partition boundaries are chosen from keys sampled from the readers, and each partition is written into its own region of the output
+        // With deduplicate or filter_fn, every partition is merged into a segment of its own first, which is then copied into its region
+        uint32_t num_threads = 1;
+
+        // Optional filter, for example to expire or rewrite items while merging
+        // It is called once per item, also when num_threads is not 1, in which case it is called concurrently from multiple threads
+        filter_fn_t filter_fn;
     };
 }
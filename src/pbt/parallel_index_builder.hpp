@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "pbt/appender.hpp"
+#include "pbt/format.hpp"
+#include "pbt/storage.hpp"
+
+namespace tendb::pbt
+{
+    /**
+     * Builds the nodes of a tree after all items have been appended, using multiple threads.
+     * While items are added, only the offset and node size of every leaf node is recorded.
+     * The tree is then built level by level: every thread emits the nodes of its own range of the level,
+     * into its own region of the file, which are laid out contiguously by the node sizes that are known up front.
+     */
+    struct ParallelIndexBuilder
+    {
+    private:
+        struct LeafEntry
+        {
+            uint64_t item_offset;
+            uint64_t node_size;
+        };
+
+        const Storage &item_storage;
+        const uint32_t branch_factor;
+        const size_t num_threads;
+
+        // Leaf nodes with branch_factor items each, except for the last one
+        std::vector<LeafEntry> leaves;
+        uint32_t leaf_num_items;
+
+        uint64_t num_items;
+        uint32_t num_leaf_nodes;
+        uint32_t num_internal_nodes;
+        uint32_t depth;
+        uint64_t root_offset;
+
+        std::vector<ChildEntry> build_leaf_level(Appender &appender);
+        std::vector<ChildEntry> build_internal_level(Appender &appender, uint32_t level_depth, std::vector<ChildEntry> &children);
+
+    public:
+        // Consecutive items that one thread adds concurrently with the other ranges, such as one partition of a parallel merge
+        struct Range
+        {
+            uint64_t first_item;
+            uint64_t next_item;
+            uint64_t carry_size; // Size that the items add to the leaf node that an earlier range started
+        };
+
+        ParallelIndexBuilder(const Storage &item_storage, uint32_t branch_factor, size_t num_threads);
+
+        void add_item(uint64_t item_offset, uint64_t key_size);
+
+        // Ranges are reserved in order before any of their items are added, and every range adds exactly num_items items
+        // Ranges only write to the leaf nodes that they start, and finish_range adds the carry once all ranges are done
+        Range reserve_range(uint64_t num_items);
+        void add_item(Range &range, uint64_t item_offset, uint64_t key_size);
+        void finish_range(const Range &range);
+
+        void finish(Appender &appender);
+
+        uint32_t get_depth() const;
+        uint32_t get_num_leaf_nodes() const;
+        uint32_t get_num_internal_nodes() const;
+        uint64_t get_root_offset() const;
+    };
+}
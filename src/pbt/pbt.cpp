@@ -1,25 +1,167 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <cstdint>
+#include <cstring>
+#include <exception>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iterator>
+#include <memory>
+#include <mutex>
 #include <ranges>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <vector>
 
 #include "pbt/appender.hpp"
+#include "pbt/batch_reader.hpp"
 #include "pbt/format.hpp"
+#include "pbt/index_builder.hpp"
+#include "pbt/io_ring.hpp"
 #include "pbt/options.hpp"
+#include "pbt/parallel_index_builder.hpp"
 #include "pbt/reader.hpp"
+#include "pbt/sorter.hpp"
+#include "pbt/split_writer.hpp"
 #include "pbt/storage.hpp"
+#include "pbt/table_cache.hpp"
 #include "pbt/writer.hpp"
 
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
 static uint64_t div_ceil(uint64_t x, uint64_t y)
 {
     return (x + y - 1) / y;
 }
 
+// Capacity of a buffer after growing it to hold the needed size, doubling it like the standard containers do
+static uint64_t grown_capacity(uint64_t capacity, uint64_t needed)
+{
+    return needed <= capacity ? capacity : std::max(needed, 2 * capacity);
+}
+
+// Run fn over contiguous chunks of [0, num_tasks), one chunk per thread, with at least min_chunk_size tasks per chunk
+static void run_in_chunks(size_t num_tasks, size_t num_threads, size_t min_chunk_size, const std::function<void(size_t begin, size_t end)> &fn)
+{
+    size_t num_chunks = std::min(num_threads, div_ceil(num_tasks, min_chunk_size));
+    if (num_chunks <= 1)
+    {
+        fn(0, num_tasks);
+        return;
+    }
+
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto worker = [&](size_t chunk)
+    {
+        try
+        {
+            fn(num_tasks * chunk / num_chunks, num_tasks * (chunk + 1) / num_chunks);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error)
+            {
+                error = std::current_exception();
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < num_chunks; ++i)
+    {
+        threads.emplace_back(worker, i);
+    }
+    worker(0);
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+
+// Stable sort using multiple threads: slices are sorted in parallel, then adjacent slices are merged pairwise until one is left
+template <typename T, typename Less>
+static void parallel_stable_sort(std::vector<T> &values, size_t num_threads, const Less &less)
+{
+    size_t num_slices = std::max<size_t>(std::min<size_t>(num_threads, div_ceil(values.size(), 4096)), 1);
+    std::vector<size_t> bounds;
+    for (size_t i = 0; i <= num_slices; ++i)
+    {
+        bounds.push_back(values.size() * i / num_slices);
+    }
+
+    auto sort_slices = [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            std::stable_sort(values.begin() + bounds[i], values.begin() + bounds[i + 1], less);
+        }
+    };
+    run_in_chunks(num_slices, num_threads, 1, sort_slices);
+
+    while (bounds.size() > 2)
+    {
+        auto merge_pairs = [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                std::inplace_merge(values.begin() + bounds[2 * i], values.begin() + bounds[2 * i + 1], values.begin() + bounds[2 * i + 2], less);
+            }
+        };
+        run_in_chunks((bounds.size() - 1) / 2, num_threads, 1, merge_pairs);
+
+        // Every pair is now a single slice, and an odd slice at the end is left as is
+        std::vector<size_t> merged_bounds;
+        for (size_t i = 0; i < bounds.size(); i += 2)
+        {
+            merged_bounds.push_back(bounds[i]);
+        }
+        if (merged_bounds.back() != bounds.back())
+        {
+            merged_bounds.push_back(bounds.back());
+        }
+        bounds = std::move(merged_bounds);
+    }
+}
+
+void tendb::pbt::Appender::write_behind()
+{
+    // Once a full window has been written after a window, the earlier window has had time to be written back, and is dropped
+    while (writeback_window > 0 && offset >= writeback_offset + writeback_window)
+    {
+        if (writeback_offset >= writeback_window)
+        {
+            storage.drop_pages(writeback_offset - writeback_window, writeback_window);
+        }
+        storage.start_writeback(writeback_offset, writeback_window);
+        writeback_offset += writeback_window;
+    }
+}
+
 void tendb::pbt::Appender::ensure_size(uint64_t size)
 {
+    write_behind(); // Everything before the offset is written at this point
+
     if (storage.get_size() < offset + size)
     {
         storage.set_size(std::max(offset + size, 2 * storage.get_size()));
@@ -31,7 +173,8 @@ void *tendb::pbt::Appender::get_base() const
     return reinterpret_cast<char *>(storage.get_address()) + offset;
 }
 
-tendb::pbt::Appender::Appender(Storage &storage) : storage(storage), offset(0) {}
+tendb::pbt::Appender::Appender(Storage &storage, uint64_t writeback_window)
+    : storage(storage), offset(0), writeback_window(writeback_window), writeback_offset(0) {}
 
 uint64_t tendb::pbt::Appender::get_offset() const
 {
@@ -53,46 +196,74 @@ void tendb::pbt::Appender::append_header()
     offset += sizeof(Header);
 }
 
-void tendb::pbt::Appender::append_item(const std::string_view &key, const std::string_view &value)
+void tendb::pbt::Appender::append_item(const std::string_view &key, const std::string_view &value, bool tombstone)
 {
     uint64_t total_size = KeyValueItem::size_of(key.size(), value.size());
     ensure_size(total_size);
 
     KeyValueItem *item = reinterpret_cast<KeyValueItem *>(get_base());
-    item->set_key_value(key, value);
+    item->set_key_value(key, value, tombstone);
 
     offset += total_size;
 }
 
 void tendb::pbt::Appender::append_leaf_node(uint32_t item_start, uint32_t item_end, KeyValueItem::Iterator &itr)
 {
-    uint64_t total_size = Node::size_of(item_end - item_start, itr);
-    ensure_size(total_size);
+    append_leaf_node(item_start, item_end, Node::size_of(item_end - item_start, itr), itr);
+}
+
+void tendb::pbt::Appender::append_leaf_node(uint32_t item_start, uint32_t item_end, uint64_t node_size, KeyValueItem::Iterator &itr)
+{
+    ensure_size(node_size);
 
     Node *node = reinterpret_cast<Node *>(get_base());
     node->set_depth(0);
     node->set_item_start(item_start);
     node->set_item_end(item_end);
     node->set_num_children(item_end - item_start);
-    node->set_node_size(total_size);
+    node->set_node_size(node_size);
     node->set_items(item_end - item_start, itr);
 
-    offset += total_size;
+    offset += node_size;
 }
 
-void tendb::pbt::Appender::append_internal_node(uint32_t child_start, uint32_t child_end, Node::Iterator &itr)
+void tendb::pbt::Appender::append_internal_node(uint32_t depth, const std::vector<ChildEntry> &children)
 {
-    uint64_t total_size = Node::size_of(child_end - child_start, itr);
+    uint64_t total_size = Node::size_of(children);
     ensure_size(total_size);
 
+    uint64_t num_items = 0;
+    for (const auto &child : children)
+    {
+        num_items += child.num_items;
+    }
+
     Node *node = reinterpret_cast<Node *>(get_base());
-    node->set_num_children(child_end - child_start);
+    node->set_depth(depth);
+    node->set_item_start(children.front().item_start);
+    node->set_item_end(children.front().item_start + num_items);
+    node->set_num_children(children.size());
     node->set_node_size(total_size);
-    node->set_children(child_end - child_start, itr);
+    node->set_children(children);
 
     offset += total_size;
 }
 
+void tendb::pbt::Appender::append_bytes(const void *data, uint64_t size)
+{
+    ensure_size(size);
+    std::memcpy(get_base(), data, size);
+    offset += size;
+}
+
+uint64_t tendb::pbt::Appender::append_space(uint64_t size)
+{
+    ensure_size(size);
+    uint64_t start = offset;
+    offset += size;
+    return start;
+}
+
 uint64_t tendb::pbt::KeyValueItem::size_of(uint64_t key_size, uint64_t value_size)
 {
     return sizeof(KeyValueItem) + key_size + value_size - sizeof(data);
@@ -105,28 +276,33 @@ std::string_view tendb::pbt::KeyValueItem::key() const
 
 std::string_view tendb::pbt::KeyValueItem::value() const
 {
-    return std::string_view(data + key_size, value_size);
+    return std::string_view(data + key_size, value_size & ~tombstone_flag);
+}
+
+bool tendb::pbt::KeyValueItem::is_tombstone() const
+{
+    return (value_size & tombstone_flag) != 0;
 }
 
-void tendb::pbt::KeyValueItem::set_key_value(const std::string_view &key, const std::string_view &value)
+void tendb::pbt::KeyValueItem::set_key_value(const std::string_view &key, const std::string_view &value, bool tombstone)
 {
     key_size = key.size();
-    value_size = value.size();
-    std::memcpy(data, key.data(), key_size);
-    std::memcpy(data + key_size, value.data(), value_size);
+    value_size = value.size() | (tombstone ? tombstone_flag : 0);
+    std::memcpy(data, key.data(), key.size());
+    std::memcpy(data + key.size(), value.data(), value.size());
 }
 
-tendb::pbt::KeyValueItem::Iterator::Iterator(const Storage &storage, uint64_t offset) : storage(storage), current_offset(offset) {}
+tendb::pbt::KeyValueItem::Iterator::Iterator(const Storage &storage, uint64_t offset) : storage(&storage), current_offset(offset) {}
 
 const tendb::pbt::KeyValueItem *tendb::pbt::KeyValueItem::Iterator::operator*() const
 {
-    return reinterpret_cast<const KeyValueItem *>(reinterpret_cast<const char *>(storage.get_address()) + current_offset);
+    return reinterpret_cast<const KeyValueItem *>(reinterpret_cast<const char *>(storage->get_address()) + current_offset);
 }
 
 tendb::pbt::KeyValueItem::Iterator &tendb::pbt::KeyValueItem::Iterator::operator++()
 {
     const KeyValueItem *item = operator*();
-    current_offset += KeyValueItem::size_of(item->key_size, item->value_size);
+    current_offset += KeyValueItem::size_of(item->key_size, item->value().size());
     return *this;
 }
 
@@ -234,6 +410,11 @@ void tendb::pbt::Node::set_node_size(uint32_t size)
     node_size = size;
 }
 
+uint32_t tendb::pbt::Node::get_depth() const
+{
+    return depth;
+}
+
 uint32_t tendb::pbt::Node::get_item_start() const
 {
     return item_start;
@@ -244,6 +425,11 @@ uint32_t tendb::pbt::Node::get_item_end() const
     return item_end;
 }
 
+uint32_t tendb::pbt::Node::get_node_size() const
+{
+    return node_size;
+}
+
 const tendb::pbt::ChildReference *tendb::pbt::Node::first_child() const
 {
     return reinterpret_cast<const ChildReference *>(data);
@@ -290,9 +476,14 @@ uint64_t tendb::pbt::Node::Iterator::get_offset() const
     return current_offset;
 }
 
+uint64_t tendb::pbt::Node::size_of_header()
+{
+    return sizeof(Node) - sizeof(data);
+}
+
 uint64_t tendb::pbt::Node::size_of(uint32_t num_items, KeyValueItem::Iterator itr)
 {
-    uint64_t total_size = sizeof(Node) - sizeof(data);
+    uint64_t total_size = size_of_header();
     for (uint32_t i = 0; i < num_items; ++i)
     {
         const KeyValueItem *item = *itr++;
@@ -301,13 +492,12 @@ uint64_t tendb::pbt::Node::size_of(uint32_t num_items, KeyValueItem::Iterator it
     return total_size;
 }
 
-uint64_t tendb::pbt::Node::size_of(uint32_t num_children, Node::Iterator itr)
+uint64_t tendb::pbt::Node::size_of(std::span<const ChildEntry> children)
 {
-    uint64_t total_size = sizeof(Node) - sizeof(data);
-    for (uint32_t i = 0; i < num_children; ++i)
+    uint64_t total_size = size_of_header();
+    for (const auto &child : children)
     {
-        const Node *child_node = *itr++;
-        total_size += ChildReference::size_of(child_node->first_child()->key().size());
+        total_size += ChildReference::size_of(child.key.size());
     }
     return total_size;
 }
@@ -330,405 +520,2318 @@ void tendb::pbt::Node::set_items(uint32_t num_items, KeyValueItem::Iterator &itr
     }
 }
 
-void tendb::pbt::Node::set_children(uint32_t num_children, Node::Iterator &itr)
+void tendb::pbt::Node::set_children(std::span<const ChildEntry> children)
 {
     uint64_t data_offset = 0;
-    for (uint32_t i = 0; i < num_children; ++i)
+    for (const auto &entry : children)
     {
-        uint64_t child_offset = itr.get_offset();
-        const Node *child_node = *itr++;
-
-        std::string_view min_key = child_node->first_child()->key();
         ChildReference *child = reinterpret_cast<ChildReference *>(data + data_offset);
-        child->set_offset(child_offset);
-        child->set_key(min_key);
-        child->set_num_items(child_node->item_end - child_node->item_start);
+        child->set_offset(entry.offset);
+        child->set_key(entry.key);
+        child->set_num_items(entry.num_items);
 
-        data_offset += ChildReference::size_of(min_key.size());
-
-        depth = std::max(depth, child_node->depth + 1);
-        if (i == 0)
-        {
-            item_start = child_node->item_start;
-        }
-        if (i == num_children - 1)
-        {
-            item_end = child_node->item_end;
-        }
+        data_offset += ChildReference::size_of(entry.key.size());
     }
 }
 
-tendb::pbt::Node *tendb::pbt::Reader::get_node_at_offset(uint64_t offset) const
+void tendb::pbt::Node::relocate_children(uint64_t delta)
 {
-    return reinterpret_cast<Node *>(reinterpret_cast<char *>(storage.get_address()) + offset);
-}
+    uint64_t data_offset = 0;
+    for (uint32_t i = 0; i < num_children; ++i)
+    {
+        ChildReference *child = reinterpret_cast<ChildReference *>(data + data_offset);
+        child->set_offset(child->get_offset() + delta);
 
-tendb::pbt::KeyValueItem *tendb::pbt::Reader::get_item_at_offset(uint64_t offset) const
-{
-    return reinterpret_cast<KeyValueItem *>(reinterpret_cast<char *>(storage.get_address()) + offset);
+        data_offset += ChildReference::size_of(child->key().size());
+    }
 }
 
-tendb::pbt::Reader::Reader(const std::string &path, const Options &opts) : storage(path, true), options(opts) {}
-
-const tendb::pbt::Header *tendb::pbt::Reader::get_header() const
+tendb::pbt::IndexBuilder::IndexBuilder(const Storage &item_storage, const std::string &spill_path, uint32_t branch_factor)
+    : item_storage(item_storage), branch_factor(branch_factor), spill_path(spill_path),
+      leaf_item_offset(0), leaf_item_start(0), leaf_num_items(0), leaf_node_size(Node::size_of_header()),
+      num_items(0), num_leaf_nodes(0), num_internal_nodes(0), depth(0), root_offset(0)
 {
-    return reinterpret_cast<Header *>(storage.get_address());
+    if (spill_path.empty())
+    {
+        spill_storage = std::make_unique<Storage>(std::make_unique<MemoryBackend>());
+    }
+    else
+    {
+        spill_storage = std::make_unique<Storage>(spill_path, false);
+    }
+    spill_appender = std::make_unique<Appender>(*spill_storage);
 }
 
-const tendb::pbt::KeyValueItem::Iterator tendb::pbt::Reader::begin() const
+tendb::pbt::IndexBuilder::~IndexBuilder()
 {
-    const Header *header = get_header();
-    return KeyValueItem::Iterator(storage, header->begin_key_value_items_offset);
+    spill_appender.reset();
+    spill_storage.reset();
+    if (!spill_path.empty())
+    {
+        std::filesystem::remove(spill_path);
+    }
 }
 
-const tendb::pbt::KeyValueItem::Iterator tendb::pbt::Reader::end() const
+void tendb::pbt::IndexBuilder::emit_leaf_node()
 {
-    const Header *header = get_header();
-    return KeyValueItem::Iterator(storage, header->first_node_offset);
+    KeyValueItem::Iterator itr(item_storage, leaf_item_offset);
+    std::string key((*itr)->key());
+
+    uint64_t node_offset = spill_appender->get_offset();
+    uint64_t leaf_item_end = leaf_item_start + leaf_num_items;
+    spill_appender->append_leaf_node(leaf_item_start, leaf_item_end, leaf_node_size, itr);
+    ++num_leaf_nodes;
+
+    add_child(0, ChildEntry{std::move(key), node_offset, leaf_item_start, leaf_num_items});
+
+    leaf_item_offset = itr.get_offset();
+    leaf_item_start = leaf_item_end;
+    leaf_num_items = 0;
+    leaf_node_size = Node::size_of_header();
 }
 
-const tendb::pbt::KeyValueItem::Iterator tendb::pbt::Reader::seek(const std::string_view &key) const
+void tendb::pbt::IndexBuilder::emit_internal_node(size_t level)
 {
-    const Header *header = get_header();
+    std::vector<ChildEntry> &children = spine[level];
 
-    if (header->num_items == 0)
-    {
-        return end();
-    }
+    uint64_t node_offset = spill_appender->get_offset();
+    spill_appender->append_internal_node(level + 1, children);
+    ++num_internal_nodes;
 
-    uint64_t offset = header->root_offset;
-    uint32_t depth = header->depth;
-    while (depth > 0 && offset != 0)
+    uint64_t node_num_items = 0;
+    for (const auto &child : children)
     {
-        Node *node = get_node_at_offset(offset);
-        offset = 0;
-
-        for (const auto *child : *node)
-        {
-            if (options.compare_fn(key, child->key()) >= 0)
-            {
-                offset = child->get_offset();
-            }
-            else
-            {
-                break;
-            }
-        }
-
-        --depth;
+        node_num_items += child.num_items;
     }
+    ChildEntry entry{std::move(children.front().key), node_offset, children.front().item_start, node_num_items};
+    children.clear();
 
-    if (offset == 0)
+    add_child(level + 1, std::move(entry));
+}
+
+void tendb::pbt::IndexBuilder::add_child(size_t level, ChildEntry &&child)
+{
+    if (spine.size() <= level)
     {
-        return end();
+        spine.resize(level + 1);
+        spine[level].reserve(branch_factor);
     }
 
-    Node *leaf_node = get_node_at_offset(offset);
-    for (const auto *child : *leaf_node)
+    spine[level].push_back(std::move(child));
+    if (spine[level].size() == branch_factor)
     {
-        if (options.compare_fn(key, child->key()) == 0)
-        {
-            return KeyValueItem::Iterator{storage, child->get_offset()};
-        }
+        emit_internal_node(level);
     }
-
-    return end();
 }
 
-const tendb::pbt::KeyValueItem::Iterator tendb::pbt::Reader::seek_at(size_t index) const
+void tendb::pbt::IndexBuilder::add_item(uint64_t item_offset, uint64_t key_size)
 {
-    const Header *header = get_header();
-
-    if (header->num_items == 0)
+    if (leaf_num_items == 0)
     {
-        return end();
+        leaf_item_offset = item_offset;
     }
 
-    uint64_t offset = header->root_offset;
-    uint32_t depth = header->depth;
-    while (depth > 0 && offset != 0)
-    {
-        Node *node = get_node_at_offset(offset);
-        offset = 0;
-
-        for (const auto *child : *node)
-        {
-            if (index >= child->get_num_items())
-            {
-                index -= child->get_num_items();
-            }
-            else
-            {
-                offset = child->get_offset();
-                break;
-            }
-        }
+    ++leaf_num_items;
+    ++num_items;
+    leaf_node_size += ChildReference::size_of(key_size);
 
-        --depth;
+    if (leaf_num_items == branch_factor)
+    {
+        emit_leaf_node();
     }
+}
 
-    if (offset == 0)
+void tendb::pbt::IndexBuilder::finish()
+{
+    if (leaf_num_items > 0)
     {
-        return end();
+        emit_leaf_node();
     }
 
-    Node *leaf_node = get_node_at_offset(offset);
-    for (const auto *child : *leaf_node)
+    // Close the pending nodes bottom-up, until a level holds a single node and nothing above it, which is the root
+    for (size_t level = 0; level < spine.size(); ++level)
     {
-        if (index == 0)
+        bool is_top = true;
+        for (size_t i = level + 1; i < spine.size(); ++i)
         {
-            return KeyValueItem::Iterator{storage, child->get_offset()};
+            is_top = is_top && spine[i].empty();
+        }
+
+        if (is_top && spine[level].size() == 1)
+        {
+            depth = static_cast<uint32_t>(level);
+            root_offset = spine[level].front().offset;
+            break;
+        }
+        if (!spine[level].empty())
+        {
+            emit_internal_node(level);
         }
-        --index;
     }
+}
 
-    return end();
+const void *tendb::pbt::IndexBuilder::get_spill_address() const
+{
+    return spill_storage->get_address();
 }
 
-const tendb::pbt::KeyValueItem *tendb::pbt::Reader::get(const std::string_view &key) const
+uint64_t tendb::pbt::IndexBuilder::get_spill_size() const
 {
-    auto itr = seek(key);
-    if (itr == end())
-    {
-        return nullptr; // Key not found
-    }
-    return *itr;
+    return spill_appender->get_offset();
 }
 
-const tendb::pbt::KeyValueItem *tendb::pbt::Reader::at(size_t index) const
+uint32_t tendb::pbt::IndexBuilder::get_depth() const
 {
-    auto itr = seek_at(index);
-    if (itr == end())
-    {
-        return nullptr; // Index out of bounds
-    }
-    return *itr;
+    return depth;
 }
 
-void tendb::pbt::Storage::init()
+uint32_t tendb::pbt::IndexBuilder::get_num_leaf_nodes() const
 {
-    if (!std::filesystem::exists(path))
-    {
-        if (read_only)
-        {
-            throw std::runtime_error("File does not exist: " + path);
-        }
-        create_file();
-    }
+    return num_leaf_nodes;
+}
 
-    if (!read_only)
+uint32_t tendb::pbt::IndexBuilder::get_num_internal_nodes() const
+{
+    return num_internal_nodes;
+}
+
+uint64_t tendb::pbt::IndexBuilder::get_root_offset() const
+{
+    return root_offset;
+}
+
+tendb::pbt::ParallelIndexBuilder::ParallelIndexBuilder(const Storage &item_storage, uint32_t branch_factor, size_t num_threads)
+    : item_storage(item_storage), branch_factor(branch_factor), num_threads(num_threads),
+      leaf_num_items(0), num_items(0), num_leaf_nodes(0), num_internal_nodes(0), depth(0), root_offset(0) {}
+
+void tendb::pbt::ParallelIndexBuilder::add_item(uint64_t item_offset, uint64_t key_size)
+{
+    if (leaf_num_items == 0)
     {
-        set_size(initial_file_size);
+        leaves.push_back(LeafEntry{item_offset, Node::size_of_header()});
     }
 
-    if (!mapping)
+    leaves.back().node_size += ChildReference::size_of(key_size);
+    ++num_items;
+
+    if (++leaf_num_items == branch_factor)
     {
-        map_file();
+        leaf_num_items = 0;
     }
 }
 
-void tendb::pbt::Storage::create_file()
+tendb::pbt::ParallelIndexBuilder::Range tendb::pbt::ParallelIndexBuilder::reserve_range(uint64_t range_num_items)
 {
-    std::ofstream ofs;
-    ofs.exceptions(std::ofstream::failbit | std::ofstream::badbit);
-    ofs.open(path, std::ios::out | std::ios::binary);
-    ofs.close();
+    Range range{num_items, num_items, 0};
+    num_items += range_num_items;
+    leaves.resize(div_ceil(num_items, branch_factor), LeafEntry{0, Node::size_of_header()});
+    leaf_num_items = num_items % branch_factor;
+    return range;
 }
 
-void tendb::pbt::Storage::map_file()
+void tendb::pbt::ParallelIndexBuilder::add_item(Range &range, uint64_t item_offset, uint64_t key_size)
 {
-    if (read_only)
+    uint64_t index = range.next_item++;
+    LeafEntry &leaf = leaves[index / branch_factor];
+    if (index % branch_factor == 0)
     {
-        mapping = new boost::interprocess::file_mapping(path.c_str(), boost::interprocess::read_only);
-        region = new boost::interprocess::mapped_region(*mapping, boost::interprocess::read_only);
+        leaf.item_offset = item_offset;
+    }
+
+    if (index - index % branch_factor < range.first_item)
+    {
+        range.carry_size += ChildReference::size_of(key_size);
     }
     else
     {
-        mapping = new boost::interprocess::file_mapping(path.c_str(), boost::interprocess::read_write);
-        region = new boost::interprocess::mapped_region(*mapping, boost::interprocess::read_write);
+        leaf.node_size += ChildReference::size_of(key_size);
     }
 }
 
-void tendb::pbt::Storage::unmap_file()
+void tendb::pbt::ParallelIndexBuilder::finish_range(const Range &range)
 {
-    delete region;
-    delete mapping;
-    region = nullptr;
-    mapping = nullptr;
+    if (range.carry_size > 0)
+    {
+        leaves[range.first_item / branch_factor].node_size += range.carry_size;
+    }
 }
 
-void tendb::pbt::Storage::set_file_size(uint64_t size)
+std::vector<tendb::pbt::ChildEntry> tendb::pbt::ParallelIndexBuilder::build_leaf_level(Appender &appender)
 {
-    std::filesystem::resize_file(path, size);
-    file_size = size;
-}
-
-tendb::pbt::Storage::Storage(const std::string &path, bool read_only)
+    // Node sizes are known, so the offset of every leaf node follows from a prefix sum
+    uint64_t level_size = 0;
+    std::vector<ChildEntry> entries(leaves.size());
+    for (size_t i = 0; i < leaves.size(); ++i)
+    {
+        entries[i].offset = level_size;
+        level_size += leaves[i].node_size;
+    }
+    uint64_t level_offset = appender.append_space(level_size);
+    char *base = reinterpret_cast<char *>(item_storage.get_address());
+
+    auto emit_leaf_nodes = [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            uint64_t item_start = i * branch_factor;
+            uint64_t item_end = std::min(item_start + branch_factor, num_items);
+            KeyValueItem::Iterator itr(item_storage, leaves[i].item_offset);
+
+            ChildEntry &entry = entries[i];
+            entry.key = (*itr)->key();
+            entry.offset += level_offset;
+            entry.item_start = item_start;
+            entry.num_items = item_end - item_start;
+
+            Node *node = reinterpret_cast<Node *>(base + entry.offset);
+            node->set_depth(0);
+            node->set_item_start(item_start);
+            node->set_item_end(item_end);
+            node->set_num_children(item_end - item_start);
+            node->set_node_size(leaves[i].node_size);
+            node->set_items(item_end - item_start, itr);
+        }
+    };
+    run_in_chunks(leaves.size(), num_threads, 1024, emit_leaf_nodes);
+
+    num_leaf_nodes = leaves.size();
+    return entries;
+}
+
+std::vector<tendb::pbt::ChildEntry> tendb::pbt::ParallelIndexBuilder::build_internal_level(Appender &appender, uint32_t level_depth, std::vector<ChildEntry> &children)
+{
+    size_t num_nodes = div_ceil(children.size(), branch_factor);
+    auto node_children = [&](size_t i)
+    {
+        size_t first = i * branch_factor;
+        return std::span<const ChildEntry>(children).subspan(first, std::min<size_t>(branch_factor, children.size() - first));
+    };
+
+    // Size the nodes in parallel, then lay them out contiguously and emit them in parallel
+    std::vector<ChildEntry> entries(num_nodes);
+    std::vector<uint64_t> node_sizes(num_nodes);
+    auto size_nodes = [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            node_sizes[i] = Node::size_of(node_children(i));
+        }
+    };
+    run_in_chunks(num_nodes, num_threads, 1024, size_nodes);
+
+    uint64_t level_size = 0;
+    for (size_t i = 0; i < num_nodes; ++i)
+    {
+        entries[i].offset = level_size;
+        level_size += node_sizes[i];
+    }
+    uint64_t level_offset = appender.append_space(level_size);
+    char *base = reinterpret_cast<char *>(item_storage.get_address());
+
+    auto emit_nodes = [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            std::span<const ChildEntry> node_entries = node_children(i);
+            uint64_t node_num_items = 0;
+            for (const auto &child : node_entries)
+            {
+                node_num_items += child.num_items;
+            }
+
+            ChildEntry &entry = entries[i];
+            entry.offset += level_offset;
+            entry.item_start = node_entries.front().item_start;
+            entry.num_items = node_num_items;
+
+            Node *node = reinterpret_cast<Node *>(base + entry.offset);
+            node->set_depth(level_depth);
+            node->set_item_start(entry.item_start);
+            node->set_item_end(entry.item_start + node_num_items);
+            node->set_num_children(node_entries.size());
+            node->set_node_size(node_sizes[i]);
+            node->set_children(node_entries);
+
+            entry.key = std::move(children[i * branch_factor].key);
+        }
+    };
+    run_in_chunks(num_nodes, num_threads, 1024, emit_nodes);
+
+    num_internal_nodes += num_nodes;
+    return entries;
+}
+
+void tendb::pbt::ParallelIndexBuilder::finish(Appender &appender)
+{
+    if (leaves.empty())
+    {
+        return;
+    }
+
+    // Build the tree level by level, until a level holds a single node, which is the root
+    std::vector<ChildEntry> level = build_leaf_level(appender);
+    leaves = std::vector<LeafEntry>();
+
+    while (level.size() > 1)
+    {
+        ++depth;
+        level = build_internal_level(appender, depth, level);
+    }
+    root_offset = level.front().offset;
+}
+
+uint32_t tendb::pbt::ParallelIndexBuilder::get_depth() const
+{
+    return depth;
+}
+
+uint32_t tendb::pbt::ParallelIndexBuilder::get_num_leaf_nodes() const
+{
+    return num_leaf_nodes;
+}
+
+uint32_t tendb::pbt::ParallelIndexBuilder::get_num_internal_nodes() const
+{
+    return num_internal_nodes;
+}
+
+uint64_t tendb::pbt::ParallelIndexBuilder::get_root_offset() const
+{
+    return root_offset;
+}
+
+tendb::pbt::Node *tendb::pbt::Reader::get_node_at_offset(uint64_t offset) const
+{
+    return reinterpret_cast<Node *>(reinterpret_cast<char *>(storage.get_address()) + offset);
+}
+
+tendb::pbt::KeyValueItem *tendb::pbt::Reader::get_item_at_offset(uint64_t offset) const
+{
+    return reinterpret_cast<KeyValueItem *>(reinterpret_cast<char *>(storage.get_address()) + offset);
+}
+
+const tendb::pbt::Node *tendb::pbt::Reader::find_leaf_at(size_t &index) const
+{
+    const Header *header = get_header();
+
+    if (header->num_items == 0)
+    {
+        return nullptr;
+    }
+
+    // Descend to the leaf node holding the item, leaving the index of the item within that leaf
+    uint64_t offset = header->root_offset;
+    uint32_t depth = header->depth;
+    while (depth > 0 && offset != 0)
+    {
+        Node *node = get_node_at_offset(offset);
+        offset = 0;
+
+        for (const auto *child : *node)
+        {
+            if (index >= child->get_num_items())
+            {
+                index -= child->get_num_items();
+            }
+            else
+            {
+                offset = child->get_offset();
+                break;
+            }
+        }
+
+        --depth;
+    }
+
+    if (offset == 0)
+    {
+        return nullptr;
+    }
+
+    return get_node_at_offset(offset);
+}
+
+tendb::pbt::Reader::Reader(const std::string &path, const Options &opts) : storage(path, true), options(opts), lexical(opts.is_lexical()) {}
+
+tendb::pbt::Reader::Reader(std::unique_ptr<StorageBackend> backend, const Options &opts) : storage(std::move(backend)), options(opts), lexical(opts.is_lexical()) {}
+
+const tendb::pbt::Header *tendb::pbt::Reader::get_header() const
+{
+    return reinterpret_cast<Header *>(storage.get_address());
+}
+
+const tendb::pbt::KeyValueItem::Iterator tendb::pbt::Reader::begin() const
+{
+    const Header *header = get_header();
+    return KeyValueItem::Iterator(storage, header->begin_key_value_items_offset);
+}
+
+const tendb::pbt::KeyValueItem::Iterator tendb::pbt::Reader::end() const
+{
+    const Header *header = get_header();
+    return KeyValueItem::Iterator(storage, header->first_node_offset);
+}
+
+const tendb::pbt::KeyValueItem::Iterator tendb::pbt::Reader::seek(const std::string_view &key) const
+{
+    if (lexical)
+    {
+        return seek(key, LexicalCompare{});
+    }
+    return seek(key, options.compare_fn);
+}
+
+const tendb::pbt::KeyValueItem::Iterator tendb::pbt::Reader::seek_at(size_t index) const
+{
+    const Node *leaf_node = find_leaf_at(index);
+
+    if (!leaf_node)
+    {
+        return end();
+    }
+
+    for (const auto *child : *leaf_node)
+    {
+        if (index == 0)
+        {
+            return KeyValueItem::Iterator{storage, child->get_offset()};
+        }
+        --index;
+    }
+
+    return end();
+}
+
+const tendb::pbt::KeyValueItem *tendb::pbt::Reader::get(const std::string_view &key) const
+{
+    auto itr = seek(key);
+    if (itr == end())
+    {
+        return nullptr; // Key not found
+    }
+    return *itr;
+}
+
+const tendb::pbt::KeyValueItem *tendb::pbt::Reader::at(size_t index) const
+{
+    auto itr = seek_at(index);
+    if (itr == end())
+    {
+        return nullptr; // Index out of bounds
+    }
+    return *itr;
+}
+
+size_t tendb::pbt::Reader::rank(const std::string_view &key) const
+{
+    if (lexical)
+    {
+        return rank(key, LexicalCompare{});
+    }
+    return rank(key, options.compare_fn);
+}
+
+size_t tendb::pbt::Reader::count(const std::string_view &first_key, const std::string_view &last_key) const
+{
+    size_t first = rank(first_key);
+    size_t last = rank(last_key);
+    return last > first ? last - first : 0;
+}
+
+std::vector<tendb::pbt::ItemRange> tendb::pbt::Reader::split(size_t num_ranges) const
+{
+    const Header *header = get_header();
+    std::vector<ItemRange> ranges;
+
+    if (header->num_items == 0 || num_ranges == 0)
+    {
+        return ranges;
+    }
+
+    // Cut the items at the leaf node holding each evenly spaced index, so that every range starts at a leaf boundary
+    uint64_t start = 0;
+    uint64_t start_offset = header->begin_key_value_items_offset;
+    for (size_t i = 1; i < num_ranges; ++i)
+    {
+        size_t index = i * header->num_items / num_ranges;
+        const Node *leaf_node = find_leaf_at(index);
+        uint64_t cut = leaf_node->get_item_start();
+
+        if (cut <= start)
+        {
+            continue; // Fewer leaf nodes than requested ranges
+        }
+
+        uint64_t cut_offset = leaf_node->first_child()->get_offset();
+        ranges.push_back({start, cut, KeyValueItem::Iterator{storage, start_offset}, KeyValueItem::Iterator{storage, cut_offset}});
+        start = cut;
+        start_offset = cut_offset;
+    }
+
+    ranges.push_back({start, header->num_items, KeyValueItem::Iterator{storage, start_offset}, end()});
+
+    return ranges;
+}
+
+std::vector<tendb::pbt::KeySample> tendb::pbt::Reader::sample_keys(size_t num_samples) const
+{
+    const Header *header = get_header();
+    std::vector<KeySample> samples;
+
+    if (header->num_items == 0)
+    {
+        return samples;
+    }
+
+    // Descend from the root until the nodes of a level have at least num_samples children together, and sample those children
+    std::vector<const Node *> level = {get_node_at_offset(header->root_offset)};
+    for (uint32_t depth = header->depth; depth > 0; --depth)
+    {
+        std::vector<const Node *> children;
+        for (const Node *node : level)
+        {
+            for (const auto *child : *node)
+            {
+                children.push_back(get_node_at_offset(child->get_offset()));
+            }
+        }
+        if (children.size() >= num_samples)
+        {
+            break;
+        }
+        level = std::move(children);
+    }
+
+    for (const Node *node : level)
+    {
+        for (const auto *child : *node)
+        {
+            samples.push_back(KeySample{child->key(), child->get_num_items()});
+        }
+    }
+
+    return samples;
+}
+
+void tendb::pbt::Reader::scan_parallel(size_t num_ranges, size_t num_threads, const scan_fn_t &fn) const
+{
+    std::vector<ItemRange> ranges = split(num_ranges);
+
+    if (num_threads == 0)
+    {
+        num_threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    }
+    num_threads = std::min(num_threads, ranges.size());
+
+    // Every worker takes the next unprocessed range until all ranges are done
+    std::atomic<size_t> next_range = 0;
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto worker = [&]()
+    {
+        size_t i;
+        while ((i = next_range.fetch_add(1)) < ranges.size())
+        {
+            try
+            {
+                fn(i, ranges[i]);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error)
+                {
+                    error = std::current_exception();
+                }
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < num_threads; ++i)
+    {
+        threads.emplace_back(worker);
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+
+void tendb::pbt::StorageBackend::flush() const {}
+
+void tendb::pbt::StorageBackend::start_writeback(uint64_t /*offset*/, uint64_t /*size*/) const {}
+
+void tendb::pbt::StorageBackend::drop_pages(uint64_t /*offset*/, uint64_t /*size*/) const {}
+
+void tendb::pbt::FileBackend::init()
+{
+    if (!std::filesystem::exists(path))
+    {
+        if (read_only)
+        {
+            throw std::runtime_error("File does not exist: " + path);
+        }
+        create_file();
+    }
+
+    map_file();
+
+    if (!read_only)
+    {
+        set_size(initial_file_size);
+    }
+}
+
+void tendb::pbt::FileBackend::create_file()
+{
+    std::ofstream ofs;
+    ofs.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+    ofs.open(path, std::ios::out | std::ios::binary);
+    ofs.close();
+}
+
+uint64_t tendb::pbt::FileBackend::get_size() const
+{
+    return file_size;
+}
+
+#if defined(_WIN32)
+
+void tendb::pbt::FileBackend::map_file()
+{
+    file_size = std::filesystem::file_size(path);
+
+    if (read_only)
+    {
+        mapping = new boost::interprocess::file_mapping(path.c_str(), boost::interprocess::read_only);
+        region = new boost::interprocess::mapped_region(*mapping, boost::interprocess::read_only);
+    }
+    else
+    {
+        mapping = new boost::interprocess::file_mapping(path.c_str(), boost::interprocess::read_write);
+        region = new boost::interprocess::mapped_region(*mapping, boost::interprocess::read_write);
+    }
+}
+
+void tendb::pbt::FileBackend::unmap_file()
+{
+    delete region;
+    delete mapping;
+    region = nullptr;
+    mapping = nullptr;
+}
+
+void tendb::pbt::FileBackend::set_file_size(uint64_t size)
+{
+    std::filesystem::resize_file(path, size);
+    file_size = size;
+}
+
+tendb::pbt::FileBackend::FileBackend(const std::string &path, bool read_only)
     : path(path), mapping(nullptr), region(nullptr), read_only(read_only), file_size(0)
 {
-    init();
+    init();
+}
+
+tendb::pbt::FileBackend::~FileBackend()
+{
+    if (mapping)
+    {
+        unmap_file();
+    }
+}
+
+void tendb::pbt::FileBackend::set_size(uint64_t size)
+{
+    if (read_only)
+    {
+        throw std::runtime_error("Cannot set size on read-only storage");
+    }
+    if (size == file_size)
+    {
+        return; // No change needed
+    }
+
+    unmap_file();
+    set_file_size(size);
+    map_file();
+}
+
+void *tendb::pbt::FileBackend::get_address() const
+{
+    return region->get_address();
+}
+
+void tendb::pbt::FileBackend::flush() const
+{
+    if (region && !region->flush(0, 0, false))
+    {
+        throw std::runtime_error("Failed to flush file: " + path);
+    }
+}
+
+void tendb::pbt::FileBackend::start_writeback(uint64_t offset, uint64_t size) const
+{
+    if (region)
+    {
+        region->flush(offset, size, true);
+    }
+}
+
+void tendb::pbt::FileBackend::drop_pages(uint64_t offset, uint64_t size) const
+{
+    if (region)
+    {
+        region->flush(offset, size);
+    }
+}
+
+#else
+
+static uint64_t round_up_to_page(uint64_t size)
+{
+    static const uint64_t page_size = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    return div_ceil(size, page_size) * page_size;
+}
+
+void tendb::pbt::FileBackend::reserve_address_space(uint64_t size, uint64_t min_size)
+{
+    // The reservation is inaccessible and not backed by memory or swap; file pages are mapped over it as the file grows
+    void *result = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (result == MAP_FAILED && size > min_size)
+    {
+        size = min_size; // Address space is limited, fall back to reserving only what is needed now
+        result = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    }
+    if (result == MAP_FAILED)
+    {
+        throw std::runtime_error("Failed to reserve address space for file: " + path);
+    }
+
+    address = static_cast<char *>(result);
+    reserved_size = size;
+    mapped_size = 0;
+}
+
+void tendb::pbt::FileBackend::extend_mapping(uint64_t size)
+{
+    uint64_t new_mapped_size = round_up_to_page(size);
+    if (new_mapped_size <= mapped_size)
+    {
+        return; // Already mapped, also when the file shrinks
+    }
+
+    if (new_mapped_size > reserved_size)
+    {
+        // The file outgrew the reservation, so move everything to a larger reservation at a new address
+        munmap(address, reserved_size);
+        reserve_address_space(std::max(new_mapped_size, 2 * reserved_size), new_mapped_size);
+    }
+
+    int protection = read_only ? PROT_READ : PROT_READ | PROT_WRITE;
+    void *result = mmap(address + mapped_size, new_mapped_size - mapped_size, protection, MAP_SHARED | MAP_FIXED, fd, mapped_size);
+    if (result == MAP_FAILED)
+    {
+        throw std::runtime_error("Failed to map file: " + path);
+    }
+
+    mapped_size = new_mapped_size;
+}
+
+void tendb::pbt::FileBackend::map_file()
+{
+    if (owns_fd)
+    {
+        fd = open(path.c_str(), read_only ? O_RDONLY : O_RDWR);
+        if (fd < 0)
+        {
+            throw std::runtime_error("Failed to open file: " + path);
+        }
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0)
+    {
+        if (owns_fd)
+        {
+            close(fd);
+            fd = -1;
+        }
+        throw std::runtime_error("Failed to stat file: " + path);
+    }
+    file_size = static_cast<uint64_t>(file_stat.st_size);
+
+    // Read-only files never grow, so they only reserve the space they need
+    uint64_t min_size = std::max<uint64_t>(round_up_to_page(file_size), round_up_to_page(1));
+    reserve_address_space(read_only ? min_size : std::max(min_size, reserved_address_space), min_size);
+    extend_mapping(file_size);
+}
+
+void tendb::pbt::FileBackend::unmap_file()
+{
+    if (address)
+    {
+        munmap(address, reserved_size);
+    }
+    if (owns_fd && fd >= 0)
+    {
+        close(fd);
+    }
+
+    fd = owns_fd ? -1 : fd; // A borrowed descriptor stays, so that it can be mapped again
+    address = nullptr;
+    reserved_size = 0;
+    mapped_size = 0;
+}
+
+void tendb::pbt::FileBackend::set_file_size(uint64_t size)
+{
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0)
+    {
+        throw std::runtime_error("Failed to resize file: " + path);
+    }
+    file_size = size;
+}
+
+tendb::pbt::FileBackend::FileBackend(const std::string &path, bool read_only)
+    : path(path), fd(-1), owns_fd(true), address(nullptr), reserved_size(0), mapped_size(0), read_only(read_only), file_size(0)
+{
+    init();
+}
+
+tendb::pbt::FileBackend::FileBackend(int fd, bool read_only)
+    : path("file descriptor " + std::to_string(fd)), fd(fd), owns_fd(false), address(nullptr), reserved_size(0), mapped_size(0), read_only(read_only), file_size(0)
+{
+    map_file();
+
+    if (!read_only)
+    {
+        set_size(initial_file_size);
+    }
+}
+
+tendb::pbt::FileBackend::~FileBackend()
+{
+    unmap_file();
+}
+
+void tendb::pbt::FileBackend::set_size(uint64_t size)
+{
+    if (read_only)
+    {
+        throw std::runtime_error("Cannot set size on read-only storage");
+    }
+    if (size == file_size)
+    {
+        return; // No change needed
+    }
+
+    set_file_size(size);
+    extend_mapping(size);
+}
+
+void *tendb::pbt::FileBackend::get_address() const
+{
+    return address;
+}
+
+void tendb::pbt::FileBackend::flush() const
+{
+    if (address && file_size > 0 && msync(address, std::min(round_up_to_page(file_size), mapped_size), MS_SYNC) != 0)
+    {
+        throw std::runtime_error("Failed to flush file: " + path + ": " + std::strerror(errno));
+    }
+}
+
+void tendb::pbt::FileBackend::start_writeback(uint64_t offset, uint64_t size) const
+{
+#if defined(__linux__)
+    sync_file_range(fd, offset, size, SYNC_FILE_RANGE_WRITE);
+#else
+    uint64_t begin = offset - offset % round_up_to_page(1);
+    msync(address + begin, offset + size - begin, MS_ASYNC);
+#endif
+}
+
+void tendb::pbt::FileBackend::drop_pages(uint64_t offset, uint64_t size) const
+{
+    // Only whole pages within the range are dropped
+    uint64_t page_size = round_up_to_page(1);
+    uint64_t begin = round_up_to_page(offset);
+    uint64_t end = (offset + size) / page_size * page_size;
+    if (end <= begin)
+    {
+        return;
+    }
+
+#if defined(__linux__)
+    sync_file_range(fd, begin, end - begin, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+    msync(address + begin, end - begin, MS_SYNC);
+#endif
+
+    // Unmap the pages from this process first, as the page cache does not drop pages that are still mapped
+    madvise(address + begin, end - begin, MADV_DONTNEED);
+#if defined(POSIX_FADV_DONTNEED)
+    posix_fadvise(fd, begin, end - begin, POSIX_FADV_DONTNEED);
+#endif
+}
+
+#endif
+
+void tendb::pbt::FileBackend::set_read_only(bool ro)
+{
+    if (ro == read_only)
+    {
+        return; // No change needed
+    }
+
+    unmap_file();
+    read_only = ro;
+    map_file();
+}
+
+bool tendb::pbt::FileBackend::is_read_only() const
+{
+    return read_only;
+}
+
+#if defined(_WIN32)
+
+tendb::pbt::MemoryBackend::MemoryBackend() : read_only(false), size(0) {}
+
+tendb::pbt::MemoryBackend::~MemoryBackend() {}
+
+void tendb::pbt::MemoryBackend::set_size(uint64_t new_size)
+{
+    if (read_only)
+    {
+        throw std::runtime_error("Cannot set size on read-only storage");
+    }
+    buffer.resize(new_size);
+    size = new_size;
+}
+
+void *tendb::pbt::MemoryBackend::get_address() const
+{
+    return const_cast<char *>(buffer.data());
+}
+
+#else
+
+tendb::pbt::MemoryBackend::MemoryBackend() : address(nullptr), reserved_size(0), committed_size(0), read_only(false), size(0)
+{
+    // If address space is limited, nothing is reserved here, and set_size reserves only what is needed
+    void *result = mmap(nullptr, reserved_address_space, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (result != MAP_FAILED)
+    {
+        address = static_cast<char *>(result);
+        reserved_size = reserved_address_space;
+    }
+}
+
+tendb::pbt::MemoryBackend::~MemoryBackend()
+{
+    if (address)
+    {
+        munmap(address, reserved_size);
+    }
+}
+
+void tendb::pbt::MemoryBackend::set_size(uint64_t new_size)
+{
+    if (read_only)
+    {
+        throw std::runtime_error("Cannot set size on read-only storage");
+    }
+
+    uint64_t new_committed_size = round_up_to_page(new_size);
+    if (new_committed_size > reserved_size)
+    {
+        // Outgrew the reservation, so move the contents to a larger reservation at a new address
+        uint64_t new_reserved_size = std::max(new_committed_size, 2 * reserved_size);
+        void *result = mmap(nullptr, new_reserved_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (result == MAP_FAILED || mprotect(result, new_committed_size, PROT_READ | PROT_WRITE) != 0)
+        {
+            if (result != MAP_FAILED)
+            {
+                munmap(result, new_reserved_size);
+            }
+            throw std::runtime_error("Failed to allocate memory storage");
+        }
+
+        if (address)
+        {
+            std::memcpy(result, address, size);
+            munmap(address, reserved_size);
+        }
+        address = static_cast<char *>(result);
+        reserved_size = new_reserved_size;
+        committed_size = new_committed_size;
+    }
+    else if (new_committed_size > committed_size)
+    {
+        if (mprotect(address + committed_size, new_committed_size - committed_size, PROT_READ | PROT_WRITE) != 0)
+        {
+            throw std::runtime_error("Failed to allocate memory storage");
+        }
+        committed_size = new_committed_size;
+    }
+    else if (new_committed_size < committed_size)
+    {
+        // Give the memory of the pages past the new size back, they read as zeros when the storage grows again
+        madvise(address + new_committed_size, committed_size - new_committed_size, MADV_DONTNEED);
+    }
+
+    size = new_size;
+}
+
+void *tendb::pbt::MemoryBackend::get_address() const
+{
+    return address;
+}
+
+#endif
+
+uint64_t tendb::pbt::MemoryBackend::get_size() const
+{
+    return size;
+}
+
+bool tendb::pbt::MemoryBackend::is_read_only() const
+{
+    return read_only;
+}
+
+void tendb::pbt::MemoryBackend::set_read_only(bool ro)
+{
+    read_only = ro;
+}
+
+tendb::pbt::SpanBackend::SpanBackend(const void *data, uint64_t size) : data(static_cast<const char *>(data)), size(size) {}
+
+uint64_t tendb::pbt::SpanBackend::get_size() const
+{
+    return size;
+}
+
+void tendb::pbt::SpanBackend::set_size(uint64_t /*size*/)
+{
+    throw std::runtime_error("Cannot set size on read-only storage");
+}
+
+bool tendb::pbt::SpanBackend::is_read_only() const
+{
+    return true;
+}
+
+void tendb::pbt::SpanBackend::set_read_only(bool ro)
+{
+    if (!ro)
+    {
+        throw std::runtime_error("Cannot make span storage writable");
+    }
+}
+
+void *tendb::pbt::SpanBackend::get_address() const
+{
+    return const_cast<char *>(data);
+}
+
+tendb::pbt::Storage::Storage(const std::string &path, bool read_only) : Storage(std::make_unique<FileBackend>(path, read_only)) {}
+
+tendb::pbt::Storage::Storage(std::unique_ptr<StorageBackend> backend) : backend(std::move(backend))
+{
+    update();
+}
+
+void tendb::pbt::Storage::update()
+{
+    address = static_cast<char *>(backend->get_address());
+    size = backend->get_size();
+}
+
+uint64_t tendb::pbt::Storage::get_size() const
+{
+    return size;
+}
+
+void tendb::pbt::Storage::set_size(uint64_t new_size)
+{
+    backend->set_size(new_size);
+    update();
+}
+
+void tendb::pbt::Storage::set_read_only(bool ro)
+{
+    backend->set_read_only(ro);
+    update();
+}
+
+void *tendb::pbt::Storage::get_address() const
+{
+    return address;
+}
+
+void tendb::pbt::Storage::flush() const
+{
+    backend->flush();
+}
+
+void tendb::pbt::Storage::start_writeback(uint64_t offset, uint64_t size) const
+{
+    backend->start_writeback(offset, size);
+}
+
+void tendb::pbt::Storage::drop_pages(uint64_t offset, uint64_t size) const
+{
+    backend->drop_pages(offset, size);
+}
+
+tendb::pbt::Header *tendb::pbt::Writer::get_header() const
+{
+    return reinterpret_cast<Header *>(storage.get_address());
+}
+
+tendb::pbt::Writer::Writer(const std::string &path, const Options &opts)
+    : path(path), storage(path, false), options(opts), appender(storage, opts.writeback_window)
+{
+    start();
+}
+
+tendb::pbt::Writer::Writer(std::unique_ptr<StorageBackend> backend, const Options &opts)
+    : storage(std::move(backend)), options(opts), appender(storage, opts.writeback_window)
+{
+    start();
+}
+
+void tendb::pbt::Writer::start()
+{
+    if (options.defer_index)
+    {
+        size_t num_threads = options.index_threads > 0 ? options.index_threads : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+        parallel_index = std::make_unique<ParallelIndexBuilder>(storage, options.branch_factor, num_threads);
+    }
+    else
+    {
+        index = std::make_unique<IndexBuilder>(storage, path.empty() ? path : path + ".index", options.branch_factor);
+    }
+
+    appender.append_header();
+    begin_key_value_items_offset = appender.get_offset();
+    num_items = 0;
+}
+
+const tendb::pbt::Options &tendb::pbt::Writer::get_options()
+{
+    return options;
+}
+
+const tendb::pbt::Storage &tendb::pbt::Writer::get_storage() const
+{
+    return storage;
+}
+
+uint64_t tendb::pbt::Writer::get_num_items() const
+{
+    return num_items;
+}
+
+uint64_t tendb::pbt::Writer::get_size() const
+{
+    return appender.get_offset();
+}
+
+void tendb::pbt::Writer::index_item(uint64_t item_offset, uint64_t key_size)
+{
+    if (parallel_index)
+    {
+        parallel_index->add_item(item_offset, key_size);
+    }
+    else
+    {
+        index->add_item(item_offset, key_size);
+    }
+    ++num_items;
+}
+
+void tendb::pbt::Writer::add_item(const std::string_view &key, const std::string_view &value, bool tombstone)
+{
+    uint64_t item_offset = appender.get_offset();
+    appender.append_item(key, value, tombstone);
+    index_item(item_offset, key.size());
+}
+
+void tendb::pbt::Writer::append_items(const KeyValueItem::Iterator &begin, const KeyValueItem::Iterator &end)
+{
+    if (begin == end)
+    {
+        return;
+    }
+
+    // Items are self-contained, so a contiguous range of them is copied as a whole, and only indexed afterwards
+    uint64_t first_offset = appender.get_offset();
+    appender.append_bytes(*begin, end.get_offset() - begin.get_offset());
+
+    KeyValueItem::Iterator itr(storage, first_offset);
+    KeyValueItem::Iterator copied_end(storage, appender.get_offset());
+    for (; itr != copied_end; ++itr)
+    {
+        index_item(itr.get_offset(), (*itr)->key().size());
+    }
+}
+
+void tendb::pbt::Writer::write_partitions(std::vector<Partition> &partitions, const std::vector<PartitionSize> &sizes, const std::function<void(size_t partition)> &merge_partition, size_t num_threads)
+{
+    // A parallel merge into an empty tree builds the index in parallel as well, which lets the partitions record their leaf nodes
+    if (index && num_items == 0)
+    {
+        index.reset();
+        parallel_index = std::make_unique<ParallelIndexBuilder>(storage, options.branch_factor, num_threads);
+    }
+
+    uint64_t total_size = 0;
+    uint64_t total_items = 0;
+    for (const auto &size : sizes)
+    {
+        total_size += size.size;
+        total_items += size.num_items;
+    }
+    uint64_t first_offset = appender.append_space(total_size);
+
+    // The regions and index ranges are laid out in order before any partition is written
+    uint64_t offset = first_offset;
+    for (const auto &size : sizes)
+    {
+        ParallelIndexBuilder::Range range = parallel_index ? parallel_index->reserve_range(size.num_items) : ParallelIndexBuilder::Range{};
+        partitions.push_back(Partition{storage, offset, offset + size.size, 0, size.num_items, parallel_index.get(), range});
+        offset += size.size;
+    }
+    run_in_parallel(partitions.size(), num_threads, merge_partition);
+
+    // A region that is not filled exactly would leave a gap of garbage between the items
+    for (const auto &partition : partitions)
+    {
+        if (partition.offset != partition.end_offset || partition.num_items != partition.max_items)
+        {
+            throw std::runtime_error("Partition of a parallel merge did not fill its region");
+        }
+    }
+
+    if (parallel_index)
+    {
+        for (const auto &partition : partitions)
+        {
+            parallel_index->finish_range(partition.range);
+        }
+        num_items += total_items;
+        return;
+    }
+
+    // The index that is built while items are added already covers earlier items, so the merged items are indexed in order
+    KeyValueItem::Iterator itr(storage, first_offset);
+    KeyValueItem::Iterator end(storage, first_offset + total_size);
+    for (; itr != end; ++itr)
+    {
+        index_item(itr.get_offset(), (*itr)->key().size());
+    }
+}
+
+void tendb::pbt::Writer::run_in_parallel(size_t num_tasks, size_t num_threads, const std::function<void(size_t task)> &fn)
+{
+    auto run_tasks = [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            fn(i);
+        }
+    };
+    run_in_chunks(num_tasks, num_threads, 1, run_tasks);
+}
+
+tendb::pbt::Writer::Segment::Segment(const std::string &path) : path(path), num_items(0)
+{
+    if (path.empty())
+    {
+        storage = std::make_unique<Storage>(std::make_unique<MemoryBackend>());
+    }
+    else
+    {
+        storage = std::make_unique<Storage>(path, false);
+    }
+    appender = std::make_unique<Appender>(*storage);
+}
+
+tendb::pbt::Writer::Segment::~Segment()
+{
+    appender.reset();
+    storage.reset();
+    if (!path.empty())
+    {
+        std::filesystem::remove(path);
+    }
+}
+
+void tendb::pbt::Writer::Segment::add_item(const std::string_view &key, const std::string_view &value, bool tombstone)
+{
+    appender->append_item(key, value, tombstone);
+    ++num_items;
+}
+
+void tendb::pbt::Writer::Segment::append_items(const KeyValueItem::Iterator &begin, const KeyValueItem::Iterator &end)
+{
+    if (begin == end)
+    {
+        return;
+    }
+
+    appender->append_bytes(*begin, end.get_offset() - begin.get_offset());
+    for (KeyValueItem::Iterator itr = begin; itr != end; ++itr)
+    {
+        ++num_items;
+    }
+}
+
+void tendb::pbt::Writer::Partition::add_item(const std::string_view &key, const std::string_view &value, bool tombstone)
+{
+    uint64_t item_size = KeyValueItem::size_of(key.size(), value.size());
+    if (item_size > end_offset - offset || num_items == max_items)
+    {
+        throw std::runtime_error("Partition of a parallel merge overflows its region");
+    }
+
+    KeyValueItem *item = reinterpret_cast<KeyValueItem *>(reinterpret_cast<char *>(storage.get_address()) + offset);
+    item->set_key_value(key, value, tombstone);
+    if (index)
+    {
+        index->add_item(range, offset, key.size());
+    }
+    offset += item_size;
+    ++num_items;
+}
+
+void tendb::pbt::Writer::Partition::append_items(const KeyValueItem::Iterator &begin, const KeyValueItem::Iterator &end)
+{
+    if (begin == end)
+    {
+        return;
+    }
+
+    uint64_t size = end.get_offset() - begin.get_offset();
+    uint64_t range_num_items = 0;
+    for (KeyValueItem::Iterator itr = begin; itr != end; ++itr)
+    {
+        ++range_num_items;
+    }
+    if (size > end_offset - offset || range_num_items > max_items - num_items)
+    {
+        throw std::runtime_error("Partition of a parallel merge overflows its region");
+    }
+
+    std::memcpy(reinterpret_cast<char *>(storage.get_address()) + offset, *begin, size);
+    if (index)
+    {
+        // The copied items are indexed by their offset relative to the source
+        for (KeyValueItem::Iterator itr = begin; itr != end; ++itr)
+        {
+            index->add_item(range, offset + (itr.get_offset() - begin.get_offset()), (*itr)->key().size());
+        }
+    }
+    offset += size;
+    num_items += range_num_items;
+}
+
+void tendb::pbt::Writer::add(const std::string_view &key, const std::string_view &value)
+{
+    add_item(key, value, false);
+}
+
+void tendb::pbt::Writer::add_tombstone(const std::string_view &key)
+{
+    add_item(key, "", true);
+}
+
+void tendb::pbt::Writer::merge(const Reader **readers, size_t num_readers)
+{
+    merge(readers, num_readers, MergeOptions());
+}
+
+void tendb::pbt::Writer::merge(const Reader **readers, size_t num_readers, const MergeOptions &merge_options)
+{
+    if (options.is_lexical())
+    {
+        merge(readers, num_readers, merge_options, LexicalCompare{});
+    }
+    else
+    {
+        merge(readers, num_readers, merge_options, options.compare_fn);
+    }
+}
+
+void tendb::pbt::Writer::finish()
+{
+    uint64_t first_node_offset = appender.get_offset();
+    uint32_t depth;
+    uint32_t num_leaf_nodes;
+    uint32_t num_internal_nodes;
+    uint64_t root_offset;
+
+    if (parallel_index)
+    {
+        parallel_index->finish(appender);
+
+        depth = parallel_index->get_depth();
+        num_leaf_nodes = parallel_index->get_num_leaf_nodes();
+        num_internal_nodes = parallel_index->get_num_internal_nodes();
+        root_offset = parallel_index->get_root_offset();
+    }
+    else
+    {
+        index->finish();
+
+        // Copy the index behind the items, and relocate the child node offsets from the spill file to this file
+        appender.append_bytes(index->get_spill_address(), index->get_spill_size());
+
+        char *base = reinterpret_cast<char *>(storage.get_address());
+        for (uint64_t offset = first_node_offset; offset < appender.get_offset();)
+        {
+            Node *node = reinterpret_cast<Node *>(base + offset);
+            if (node->get_depth() > 0)
+            {
+                node->relocate_children(first_node_offset);
+            }
+            offset += node->get_node_size();
+        }
+
+        depth = index->get_depth();
+        num_leaf_nodes = index->get_num_leaf_nodes();
+        num_internal_nodes = index->get_num_internal_nodes();
+        root_offset = first_node_offset + index->get_root_offset();
+    }
+
+    get_header()->first_node_offset = first_node_offset;
+    get_header()->begin_key_value_items_offset = begin_key_value_items_offset;
+    get_header()->depth = depth;
+    get_header()->num_leaf_nodes = num_leaf_nodes;
+    get_header()->num_internal_nodes = num_internal_nodes;
+    get_header()->num_items = num_items;
+    get_header()->root_offset = num_items > 0 ? root_offset : 0;
+
+    storage.flush();
+    storage.set_size(appender.get_offset());
+}
+
+tendb::pbt::Sorter::Sorter(const std::string &path, const Options &opts, uint64_t memory_budget, size_t num_threads)
+    : path(path), options(opts), memory_budget(memory_budget),
+      num_threads(num_threads > 0 ? num_threads : std::max<size_t>(std::thread::hardware_concurrency(), 1)) {}
+
+tendb::pbt::Sorter::~Sorter()
+{
+    for (const auto &run_path : run_paths)
+    {
+        std::filesystem::remove(run_path);
+    }
+}
+
+void tendb::pbt::Sorter::sort_entries()
+{
+    const char *data = buffer.data();
+    auto key_of = [data](const Entry &entry)
+    {
+        return std::string_view(data + entry.offset, entry.key_size);
+    };
+
+    if (options.is_lexical())
+    {
+        auto less = [&](const Entry &a, const Entry &b)
+        {
+            return LexicalCompare{}(key_of(a), key_of(b)) < 0;
+        };
+        parallel_stable_sort(entries, num_threads, less);
+    }
+    else
+    {
+        auto less = [&](const Entry &a, const Entry &b)
+        {
+            return options.compare_fn(key_of(a), key_of(b)) < 0;
+        };
+        parallel_stable_sort(entries, num_threads, less);
+    }
+}
+
+void tendb::pbt::Sorter::write_entries(const std::string &target_path)
+{
+    Writer writer(target_path, options);
+    for (const auto &entry : entries)
+    {
+        const char *key = buffer.data() + entry.offset;
+        writer.add(std::string_view(key, entry.key_size), std::string_view(key + entry.key_size, entry.value_size));
+    }
+    writer.finish();
+}
+
+void tendb::pbt::Sorter::spill()
+{
+    sort_entries();
+
+    std::string run_path = path + ".run" + std::to_string(run_paths.size());
+    run_paths.push_back(run_path);
+    write_entries(run_path);
+
+    // Keep the capacity of the buffers for the next run
+    buffer.clear();
+    entries.clear();
+}
+
+void tendb::pbt::Sorter::add(const std::string_view &key, const std::string_view &value)
+{
+    // The budget counts the capacity of the buffers, which is what they occupy
+    // The buffers are grown here rather than by push_back, so the capacity after growing is known, and the buffered items
+    // are spilled instead when growing would exceed the budget; the capacity is kept for the next run
+    uint64_t buffer_capacity = grown_capacity(buffer.capacity(), buffer.size() + key.size() + value.size());
+    uint64_t entries_capacity = grown_capacity(entries.capacity(), entries.size() + 1);
+    if (!entries.empty() && buffer_capacity + entries_capacity * sizeof(Entry) > memory_budget)
+    {
+        spill();
+        buffer_capacity = grown_capacity(buffer.capacity(), key.size() + value.size());
+        entries_capacity = grown_capacity(entries.capacity(), 1);
+    }
+    buffer.reserve(buffer_capacity);
+    entries.reserve(entries_capacity);
+
+    entries.push_back(Entry{buffer.size(), key.size(), value.size()});
+    buffer.insert(buffer.end(), key.begin(), key.end());
+    buffer.insert(buffer.end(), value.begin(), value.end());
+}
+
+void tendb::pbt::Sorter::finish()
+{
+    // Everything fits in memory, so there is nothing to merge
+    if (run_paths.empty())
+    {
+        sort_entries();
+        write_entries(path);
+        return;
+    }
+
+    if (!entries.empty())
+    {
+        spill();
+    }
+    buffer = std::vector<char>();
+    entries = std::vector<Entry>();
+
+    // Runs are merged in the order they were written, which keeps items with equal keys in the order they were added
+    std::vector<std::unique_ptr<Reader>> runs;
+    std::vector<const Reader *> run_readers;
+    for (const auto &run_path : run_paths)
+    {
+        runs.push_back(std::make_unique<Reader>(run_path, options));
+        run_readers.push_back(runs.back().get());
+    }
+
+    Writer writer(path, options);
+    writer.merge(run_readers.data(), run_readers.size());
+    writer.finish();
+
+    runs.clear();
+    for (const auto &run_path : run_paths)
+    {
+        std::filesystem::remove(run_path);
+    }
+    run_paths.clear();
+}
+
+tendb::pbt::SplitWriter::SplitWriter(const std::string &path, const Options &opts, uint64_t max_file_size, uint64_t max_items)
+    : path(path), options(opts), max_file_size(max_file_size), max_items(max_items), lexical(opts.is_lexical()), last_item_offset(0) {}
+
+int tendb::pbt::SplitWriter::compare(const std::string_view &a, const std::string_view &b) const
+{
+    if (lexical)
+    {
+        return LexicalCompare{}(a, b);
+    }
+    return options.compare_fn(a, b);
+}
+
+bool tendb::pbt::SplitWriter::is_full() const
+{
+    return writer->get_size() >= max_file_size || writer->get_num_items() >= max_items;
+}
+
+std::string_view tendb::pbt::SplitWriter::last_key() const
+{
+    return (*KeyValueItem::Iterator(writer->get_storage(), last_item_offset))->key();
+}
+
+void tendb::pbt::SplitWriter::add_item(const std::string_view &key, const std::string_view &value, bool tombstone)
+{
+    // Only cut between different keys
+    if (writer && is_full() && compare(key, last_key()) != 0)
+    {
+        finish_file();
+    }
+
+    if (!writer)
+    {
+        files.push_back(OutputFile{path + "." + std::to_string(files.size()), std::string(key), std::string(), 0});
+        writer = std::make_unique<Writer>(files.back().path, options);
+    }
+
+    last_item_offset = writer->get_size();
+    if (tombstone)
+    {
+        writer->add_tombstone(key);
+    }
+    else
+    {
+        writer->add(key, value);
+    }
+    ++files.back().num_items;
+}
+
+void tendb::pbt::SplitWriter::append_items(const KeyValueItem::Iterator &begin, const KeyValueItem::Iterator &end)
+{
+    KeyValueItem::Iterator itr = begin;
+    while (itr != end)
+    {
+        // Items that may start a new file are added one by one, to cut between different keys
+        if (!writer || is_full())
+        {
+            add_item((*itr)->key(), (*itr)->value(), (*itr)->is_tombstone());
+            ++itr;
+            continue;
+        }
+
+        // The items up to and including the one that fills the file are copied as a whole
+        uint64_t size = writer->get_size();
+        uint64_t num_items = writer->get_num_items();
+        KeyValueItem::Iterator run_end = itr;
+        uint64_t last_offset = itr.get_offset();
+        while (run_end != end && size < max_file_size && num_items < max_items)
+        {
+            last_offset = run_end.get_offset();
+            ++run_end;
+            size += run_end.get_offset() - last_offset;
+            ++num_items;
+        }
+
+        last_item_offset = writer->get_size() + (last_offset - itr.get_offset());
+        files.back().num_items += num_items - writer->get_num_items();
+        writer->append_items(itr, run_end);
+        itr = run_end;
+    }
 }
 
-tendb::pbt::Storage::~Storage()
+void tendb::pbt::SplitWriter::finish_file()
 {
-    if (mapping)
+    files.back().last_key = last_key();
+    writer->finish();
+    writer.reset();
+}
+
+void tendb::pbt::SplitWriter::add(const std::string_view &key, const std::string_view &value)
+{
+    add_item(key, value, false);
+}
+
+void tendb::pbt::SplitWriter::add_tombstone(const std::string_view &key)
+{
+    add_item(key, "", true);
+}
+
+void tendb::pbt::SplitWriter::merge(const Reader **readers, size_t num_readers, const MergeOptions &merge_options)
+{
+    if (options.is_lexical())
     {
-        unmap_file();
+        merge(readers, num_readers, merge_options, LexicalCompare{});
+    }
+    else
+    {
+        merge(readers, num_readers, merge_options, options.compare_fn);
     }
 }
 
-uint64_t tendb::pbt::Storage::get_size() const
+std::vector<tendb::pbt::OutputFile> tendb::pbt::SplitWriter::finish()
 {
-    return file_size;
+    if (writer)
+    {
+        finish_file();
+    }
+    return files;
 }
 
-void tendb::pbt::Storage::set_size(uint64_t size)
+tendb::pbt::TableCache::TableCache(size_t capacity, const Options &opts)
+    : capacity(std::max<size_t>(capacity, 1)), options(opts), lexical(opts.is_lexical()) {}
+
+int tendb::pbt::TableCache::compare(const std::string_view &a, const std::string_view &b) const
 {
-    if (read_only)
+    if (lexical)
     {
-        throw std::runtime_error("Cannot set size on read-only storage");
+        return LexicalCompare{}(a, b);
     }
-    if (size == file_size)
+    return options.compare_fn(a, b);
+}
+
+tendb::pbt::TableInfo tendb::pbt::TableCache::read_info(const std::string &path, const Reader &reader)
+{
+    const Header *header = reader.get_header();
+    TableInfo info{path, "", "", header->num_items};
+    if (header->num_items > 0)
     {
-        return; // No change needed
+        info.first_key = reader.at(0)->key();
+        info.last_key = reader.at(header->num_items - 1)->key();
+    }
+    return info;
+}
+
+void tendb::pbt::TableCache::insert_reader(Entry &entry, const std::shared_ptr<const Reader> &reader)
+{
+    entry.reader = reader;
+    lru.push_front(entry.info.path);
+    entry.lru = lru.begin();
+
+    // Evicted readers close when the last handle to them is released
+    while (lru.size() > capacity)
+    {
+        entries.at(lru.back()).reader.reset();
+        lru.pop_back();
     }
+}
 
-    unmap_file();
-    set_file_size(size);
-    map_file();
+void tendb::pbt::TableCache::add(const std::string &path)
+{
+    get(path);
 }
 
-void tendb::pbt::Storage::set_read_only(bool ro)
+void tendb::pbt::TableCache::add(const TableInfo &info)
 {
-    if (ro == read_only)
+    std::lock_guard<std::mutex> lock(mutex);
+    auto itr = entries.find(info.path);
+    if (itr != entries.end())
     {
-        return; // No change needed
+        itr->second.info = info;
+        return;
     }
+    entries.emplace(info.path, Entry{info, nullptr, lru.end()});
+}
 
-    unmap_file();
-    read_only = ro;
-    map_file();
+void tendb::pbt::TableCache::remove(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto itr = entries.find(path);
+    if (itr == entries.end())
+    {
+        return;
+    }
+    if (itr->second.reader)
+    {
+        lru.erase(itr->second.lru);
+    }
+    entries.erase(itr);
 }
 
-void *tendb::pbt::Storage::get_address() const
+std::shared_ptr<const tendb::pbt::Reader> tendb::pbt::TableCache::get(const std::string &path)
 {
-    return region->get_address();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto itr = entries.find(path);
+        if (itr != entries.end() && itr->second.reader)
+        {
+            lru.splice(lru.begin(), lru, itr->second.lru);
+            return itr->second.reader;
+        }
+    }
+
+    // Files are opened without holding the lock, so that lookups of open readers do not wait on the file system
+    auto reader = std::make_shared<const Reader>(path, options);
+    TableInfo info = read_info(path, *reader);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto itr = entries.find(path);
+    if (itr == entries.end())
+    {
+        itr = entries.emplace(path, Entry{info, nullptr, lru.end()}).first;
+    }
+    else if (itr->second.reader)
+    {
+        // Another thread opened the same file in the meantime
+        lru.splice(lru.begin(), lru, itr->second.lru);
+        return itr->second.reader;
+    }
+    insert_reader(itr->second, reader);
+    return reader;
 }
 
-void tendb::pbt::Storage::flush() const
+bool tendb::pbt::TableCache::get_info(const std::string &path, TableInfo &info) const
 {
-    if (region)
+    std::lock_guard<std::mutex> lock(mutex);
+    auto itr = entries.find(path);
+    if (itr == entries.end())
     {
-        region->flush();
+        return false;
     }
+    info = itr->second.info;
+    return true;
 }
 
-tendb::pbt::Header *tendb::pbt::Writer::get_header() const
+std::vector<tendb::pbt::TableInfo> tendb::pbt::TableCache::find(const std::string_view &first_key, const std::string_view &last_key) const
 {
-    return reinterpret_cast<Header *>(storage.get_address());
+    std::vector<TableInfo> result;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto &[path, entry] : entries)
+        {
+            const TableInfo &info = entry.info;
+            if (info.num_items > 0 && compare(info.last_key, first_key) >= 0 && compare(info.first_key, last_key) <= 0)
+            {
+                result.push_back(info);
+            }
+        }
+    }
+
+    auto by_first_key = [this](const TableInfo &a, const TableInfo &b)
+    {
+        return compare(a.first_key, b.first_key) < 0;
+    };
+    std::sort(result.begin(), result.end(), by_first_key);
+    return result;
 }
 
-tendb::pbt::Writer::Writer(const std::string &path, const Options &opts) : storage(path, false), appender(storage), options(opts)
+size_t tendb::pbt::TableCache::get_num_files() const
 {
-    appender.append_header();
-    begin_key_value_items_offset = appender.get_offset();
-    num_items = 0;
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.size();
 }
 
-const tendb::pbt::Options &tendb::pbt::Writer::get_options()
+size_t tendb::pbt::TableCache::get_num_open() const
 {
-    return options;
+    std::lock_guard<std::mutex> lock(mutex);
+    return lru.size();
 }
 
-void tendb::pbt::Writer::add(const std::string_view &key, const std::string_view &value)
+#if defined(__linux__)
+
+static int io_uring_setup(unsigned entries, io_uring_params *params)
 {
-    appender.append_item(key, value);
-    ++num_items;
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
 }
 
-void tendb::pbt::Writer::merge(const Reader **readers, size_t num_readers)
+static int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
 {
-    uint64_t total_items = 0;
-    std::vector<KeyValueItem::Iterator> iterators;
-    std::vector<KeyValueItem::Iterator> ends;
+    return static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+tendb::pbt::IoRing::IoRing(unsigned queue_depth)
+    : queue_depth(std::max(queue_depth, 1u)), ring_fd(-1), sq_ring(nullptr), sq_ring_size(0), sqes(nullptr), sqes_size(0), num_unsubmitted(0), cq_ring(nullptr), cq_ring_size(0)
+{
+    setup();
+}
+
+tendb::pbt::IoRing::~IoRing()
+{
+    teardown();
+}
+
+void tendb::pbt::IoRing::setup()
+{
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    ring_fd = io_uring_setup(queue_depth, &params);
+    if (ring_fd < 0)
+    {
+        ring_fd = -1;
+        return; // Not supported or not permitted, reads fall back to pread
+    }
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap)
+    {
+        sq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        cq_ring_size = sq_ring_size;
+    }
+
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED)
+    {
+        sq_ring = nullptr;
+        teardown();
+        return;
+    }
+    cq_ring = single_mmap ? sq_ring : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED)
+    {
+        cq_ring = nullptr;
+        teardown();
+        return;
+    }
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes_address = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes_address == MAP_FAILED)
+    {
+        teardown();
+        return;
+    }
+    sqes = static_cast<io_uring_sqe *>(sqes_address);
+
+    char *sq = static_cast<char *>(sq_ring);
+    sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+
+    char *cq = static_cast<char *>(cq_ring);
+    cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+}
 
-    for (size_t i = 0; i < num_readers; ++i)
+void tendb::pbt::IoRing::teardown()
+{
+    if (sqes)
+    {
+        munmap(sqes, sqes_size);
+    }
+    if (cq_ring && cq_ring != sq_ring)
+    {
+        munmap(cq_ring, cq_ring_size);
+    }
+    if (sq_ring)
+    {
+        munmap(sq_ring, sq_ring_size);
+    }
+    if (ring_fd >= 0)
+    {
+        close(ring_fd);
+    }
+
+    ring_fd = -1;
+    sq_ring = nullptr;
+    cq_ring = nullptr;
+    sqes = nullptr;
+}
+
+bool tendb::pbt::IoRing::is_async() const
+{
+    return ring_fd >= 0;
+}
+
+unsigned tendb::pbt::IoRing::get_queue_depth() const
+{
+    return queue_depth;
+}
+
+void tendb::pbt::IoRing::prepare_read(int fd, void *buffer, uint32_t size, uint64_t offset, uint64_t user_data)
+{
+    if (!is_async())
     {
-        const Reader *source = readers[i];
-        const Header *header = source->get_header();
+        fallback_reads.push_back(Read{fd, buffer, size, offset, user_data});
+        return;
+    }
 
-        total_items += header->num_items;
-        iterators.emplace_back(source->begin());
-        ends.emplace_back(source->end());
+    // Only this thread writes the tail, but the kernel moves the head as it consumes entries
+    unsigned tail = *sq_tail;
+    unsigned head = std::atomic_ref<unsigned>(*sq_head).load(std::memory_order_acquire);
+    if (tail - head >= queue_depth)
+    {
+        throw std::runtime_error("Submission queue is full");
     }
 
-    for (uint64_t i = 0; i < total_items; ++i)
+    unsigned index = tail & sq_mask;
+    io_uring_sqe *sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(io_uring_sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buffer);
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    sq_array[index] = index;
+
+    std::atomic_ref<unsigned>(*sq_tail).store(tail + 1, std::memory_order_release);
+    ++num_unsubmitted;
+}
+
+void tendb::pbt::IoRing::submit_and_wait(unsigned min_completions)
+{
+    if (!is_async())
     {
-        uint64_t min_index;
-        std::string_view min_key;
+        for (const Read &read : fallback_reads)
+        {
+            ssize_t result = pread(read.fd, read.buffer, read.size, static_cast<off_t>(read.offset));
+            fallback_completions.push_back(Completion{read.user_data, result < 0 ? -static_cast<int64_t>(errno) : static_cast<int64_t>(result)});
+        }
+        fallback_reads.clear();
+        return;
+    }
 
-        for (uint64_t j = 0; j < iterators.size(); ++j)
+    unsigned flags = min_completions > 0 ? IORING_ENTER_GETEVENTS : 0;
+    while (true)
+    {
+        int result = io_uring_enter(ring_fd, num_unsubmitted, min_completions, flags);
+        if (result < 0)
         {
-            if (iterators[j] == ends[j])
+            if (errno == EINTR)
             {
                 continue;
             }
-            if (min_key.empty() || options.compare_fn((*iterators[j])->key(), min_key) < 0)
-            {
-                min_index = j;
-                min_key = (*iterators[j])->key();
-            }
+            throw std::runtime_error("Failed to submit reads: " + std::string(std::strerror(errno)));
+        }
+        num_unsubmitted -= std::min(num_unsubmitted, static_cast<unsigned>(result));
+        if (num_unsubmitted == 0)
+        {
+            break;
+        }
+    }
+}
+
+bool tendb::pbt::IoRing::pop_completion(uint64_t &user_data, int64_t &result)
+{
+    if (!is_async())
+    {
+        if (fallback_completions.empty())
+        {
+            return false;
         }
+        user_data = fallback_completions.front().user_data;
+        result = fallback_completions.front().result;
+        fallback_completions.pop_front();
+        return true;
+    }
 
-        add(min_key, (*iterators[min_index])->value());
-        ++iterators[min_index];
+    // Only this thread writes the head, but the kernel moves the tail as it posts completions
+    unsigned head = *cq_head;
+    unsigned tail = std::atomic_ref<unsigned>(*cq_tail).load(std::memory_order_acquire);
+    if (head == tail)
+    {
+        return false;
     }
+
+    const io_uring_cqe *cqe = &cqes[head & cq_mask];
+    user_data = cqe->user_data;
+    result = cqe->res;
+    std::atomic_ref<unsigned>(*cq_head).store(head + 1, std::memory_order_release);
+    return true;
 }
 
-void tendb::pbt::Writer::finish()
+tendb::pbt::BatchReader::BatchReader(const std::string &path, const Options &opts, unsigned queue_depth)
+    : path(path), options(opts), lexical(opts.is_lexical()), fd(-1), file_size(0), ring(queue_depth)
 {
-    uint64_t num_leaf_nodes = div_ceil(num_items, options.branch_factor);
-    uint64_t first_node_offset = appender.get_offset();
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Failed to open file: " + path);
+    }
 
-    get_header()->first_node_offset = first_node_offset;
-    get_header()->begin_key_value_items_offset = begin_key_value_items_offset;
+    try
+    {
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0)
+        {
+            throw std::runtime_error("Failed to stat file: " + path);
+        }
+        file_size = static_cast<uint64_t>(file_stat.st_size);
+
+        read_fully(&header, sizeof(Header), 0);
+        if (header.num_items > 0)
+        {
+            // The root is read by its header first, which holds its size
+            root.resize(Node::size_of_header());
+            read_fully(root.data(), root.size(), header.root_offset);
+            root.resize(reinterpret_cast<const Node *>(root.data())->get_node_size());
+            read_fully(root.data(), root.size(), header.root_offset);
+        }
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+}
+
+tendb::pbt::BatchReader::~BatchReader()
+{
+    close(fd);
+}
+
+int tendb::pbt::BatchReader::compare(const std::string_view &a, const std::string_view &b) const
+{
+    if (lexical)
+    {
+        return LexicalCompare{}(a, b);
+    }
+    return options.compare_fn(a, b);
+}
 
-    tendb::pbt::KeyValueItem::Iterator kv_itr(storage, begin_key_value_items_offset);
-    tendb::pbt::Node::Iterator node_itr(storage, first_node_offset);
+void tendb::pbt::BatchReader::read_fully(void *buffer, uint64_t size, uint64_t offset) const
+{
+    if (offset + size > file_size)
+    {
+        throw std::runtime_error("Read past the end of file: " + path);
+    }
 
-    uint64_t last_node_offset = 0;
-    for (uint64_t i = 0; i < num_items; i += options.branch_factor)
+    char *data = static_cast<char *>(buffer);
+    while (size > 0)
     {
-        uint32_t item_start = static_cast<uint32_t>(i);
-        uint32_t item_end = static_cast<uint32_t>(std::min(i + options.branch_factor, num_items));
-        last_node_offset = appender.get_offset();
-        appender.append_leaf_node(item_start, item_end, kv_itr);
+        ssize_t result = pread(fd, data, size, static_cast<off_t>(offset));
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            throw std::runtime_error("Failed to read file: " + path);
+        }
+        data += result;
+        offset += static_cast<uint64_t>(result);
+        size -= static_cast<uint64_t>(result);
     }
+}
 
-    uint64_t prev_depth_num_nodes = num_leaf_nodes;
-    uint32_t num_internal_nodes = 0;
-    uint32_t depth = 0;
-    while (prev_depth_num_nodes > 1)
+bool tendb::pbt::BatchReader::step(Lookup &lookup, const Node *node) const
+{
+    // Same descent as Reader::seek: the last child whose key is not greater, and in a leaf the child with the exact key
+    bool is_leaf = node->get_depth() == 0;
+    uint64_t offset = 0;
+    for (const auto *child : *node)
     {
-        for (size_t i = 0; i < prev_depth_num_nodes; i += options.branch_factor)
+        int result = compare(lookup.key, child->key());
+        if (result < 0)
+        {
+            break;
+        }
+        if (is_leaf && result == 0)
+        {
+            offset = child->get_offset();
+            break;
+        }
+        if (!is_leaf)
         {
-            uint32_t child_start = static_cast<uint32_t>(i);
-            uint32_t child_end = static_cast<uint32_t>(std::min<uint64_t>(i + options.branch_factor, prev_depth_num_nodes));
-            last_node_offset = appender.get_offset();
-            appender.append_internal_node(child_start, child_end, node_itr);
+            offset = child->get_offset();
         }
+    }
 
-        prev_depth_num_nodes = div_ceil(prev_depth_num_nodes, options.branch_factor);
-        num_internal_nodes += prev_depth_num_nodes;
-        ++depth;
+    if (offset == 0)
+    {
+        return false;
     }
 
-    get_header()->depth = depth;
-    get_header()->num_leaf_nodes = num_leaf_nodes;
-    get_header()->num_internal_nodes = num_internal_nodes;
-    get_header()->num_items = num_items;
-    get_header()->root_offset = last_node_offset;
+    lookup.is_item = is_leaf;
+    lookup.offset = offset;
+    lookup.buffer.clear();
+    return true;
+}
 
-    storage.flush();
-    storage.set_size(appender.get_offset());
+void tendb::pbt::BatchReader::prepare(Lookup &lookup, size_t index)
+{
+    // Reads are never past the end of the file, which ends with the nodes, so a clamped read still holds the whole node or item
+    uint64_t size = std::max<uint64_t>(lookup.buffer.size(), initial_read_size);
+    size = std::min(size, file_size - std::min(lookup.offset, file_size));
+    lookup.buffer.resize(size);
+    ring.prepare_read(fd, lookup.buffer.data(), static_cast<uint32_t>(size), lookup.offset, index);
+}
+
+bool tendb::pbt::BatchReader::is_async() const
+{
+    return ring.is_async();
+}
+
+const tendb::pbt::Header *tendb::pbt::BatchReader::get_header() const
+{
+    return &header;
+}
+
+void tendb::pbt::BatchReader::get(const std::string_view *keys, size_t num_keys, const lookup_fn_t &fn)
+{
+    std::vector<Lookup> lookups(num_keys);
+    std::vector<size_t> ready; // Lookups with a read to submit
+    for (size_t i = 0; i < num_keys; ++i)
+    {
+        lookups[i].key = keys[i];
+        if (header.num_items > 0 && step(lookups[i], reinterpret_cast<const Node *>(root.data())))
+        {
+            ready.push_back(i);
+        }
+        else
+        {
+            fn(i, nullptr);
+        }
+    }
+    std::reverse(ready.begin(), ready.end()); // Submit in key order, as ready is taken from the back
+
+    // After a failed read, the reads still in flight are reaped before throwing, as they write into the buffers of the lookups
+    bool failed = false;
+    size_t in_flight = 0;
+    while (in_flight > 0 || (!failed && !ready.empty()))
+    {
+        while (!failed && !ready.empty() && in_flight < ring.get_queue_depth())
+        {
+            size_t index = ready.back();
+            ready.pop_back();
+            prepare(lookups[index], index);
+            ++in_flight;
+        }
+        ring.submit_and_wait(1);
+
+        uint64_t index;
+        int64_t result;
+        while (ring.pop_completion(index, result))
+        {
+            --in_flight;
+            Lookup &lookup = lookups[index];
+            if (failed || result != static_cast<int64_t>(lookup.buffer.size()))
+            {
+                failed = true;
+                continue;
+            }
+
+            if (lookup.is_item)
+            {
+                const KeyValueItem *item = reinterpret_cast<const KeyValueItem *>(lookup.buffer.data());
+                uint64_t item_size = KeyValueItem::size_of(item->key().size(), item->value().size());
+                if (item_size > lookup.buffer.size())
+                {
+                    lookup.buffer.resize(item_size); // Read again as a whole
+                    ready.push_back(index);
+                    continue;
+                }
+                fn(index, item);
+                std::vector<char>().swap(lookup.buffer);
+            }
+            else
+            {
+                const Node *node = reinterpret_cast<const Node *>(lookup.buffer.data());
+                if (node->get_node_size() > lookup.buffer.size())
+                {
+                    lookup.buffer.resize(node->get_node_size()); // Read again as a whole
+                    ready.push_back(index);
+                }
+                else if (step(lookup, node))
+                {
+                    ready.push_back(index);
+                }
+                else
+                {
+                    fn(index, nullptr);
+                }
+            }
+        }
+    }
+
+    if (failed)
+    {
+        throw std::runtime_error("Failed to read file: " + path);
+    }
 }
+
+#endif
@@ -1,7 +1,10 @@
 #pragma once
 
 #include <cstdint>
+#include <functional>
+#include <memory>
 #include <string_view>
+#include <vector>
 
 #include "pbt/format.hpp"
 #include "pbt/options.hpp"
@@ -9,24 +12,155 @@
 
 namespace tendb::pbt
 {
+    struct ItemRange
+    {
+        uint64_t item_start;          // Index of the first item in the range
+        uint64_t item_end;            // Index of the last item in the range (exclusive)
+        KeyValueItem::Iterator begin; // Iterator to the first item in the range
+        KeyValueItem::Iterator end;   // Iterator past the last item in the range
+    };
+
+    typedef std::function<void(size_t range_index, const ItemRange &range)> scan_fn_t;
+
+    struct KeySample
+    {
+        std::string_view key; // Smallest key of the sampled child
+        uint64_t num_items;   // Number of items under the sampled child
+    };
+
     struct Reader
     {
     private:
         const Storage storage;
         const Options options;
+        const bool lexical; // Whether options.compare_fn is LexicalCompare, which is then called directly
 
         Node *get_node_at_offset(uint64_t offset) const;
         KeyValueItem *get_item_at_offset(uint64_t offset) const;
+        const Node *find_leaf_at(size_t &index) const;
 
     public:
         Reader(const std::string &path, const Options &opts = Options());
+        Reader(std::unique_ptr<StorageBackend> backend, const Options &opts = Options());
 
         const Header *get_header() const;
         const KeyValueItem::Iterator begin() const;
         const KeyValueItem::Iterator end() const;
         const KeyValueItem::Iterator seek(const std::string_view &key) const;
+        template <typename Compare>
+        const KeyValueItem::Iterator seek(const std::string_view &key, const Compare &compare) const;
         const KeyValueItem::Iterator seek_at(size_t index) const;
         const KeyValueItem *get(const std::string_view &key) const;
         const KeyValueItem *at(size_t index) const;
+        size_t rank(const std::string_view &key) const;
+        template <typename Compare>
+        size_t rank(const std::string_view &key, const Compare &compare) const;
+        size_t count(const std::string_view &first_key, const std::string_view &last_key) const;
+        std::vector<ItemRange> split(size_t num_ranges) const;
+        std::vector<KeySample> sample_keys(size_t num_samples) const;
+        void scan_parallel(size_t num_ranges, size_t num_threads, const scan_fn_t &fn) const;
     };
 }
+
+template <typename Compare>
+const tendb::pbt::KeyValueItem::Iterator tendb::pbt::Reader::seek(const std::string_view &key, const Compare &compare) const
+{
+    const Header *header = get_header();
+
+    if (header->num_items == 0)
+    {
+        return end();
+    }
+
+    uint64_t offset = header->root_offset;
+    uint32_t depth = header->depth;
+    while (depth > 0 && offset != 0)
+    {
+        Node *node = get_node_at_offset(offset);
+        offset = 0;
+
+        for (const auto *child : *node)
+        {
+            if (compare(key, child->key()) >= 0)
+            {
+                offset = child->get_offset();
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        --depth;
+    }
+
+    if (offset == 0)
+    {
+        return end();
+    }
+
+    Node *leaf_node = get_node_at_offset(offset);
+    for (const auto *child : *leaf_node)
+    {
+        if (compare(key, child->key()) == 0)
+        {
+            return KeyValueItem::Iterator{storage, child->get_offset()};
+        }
+    }
+
+    return end();
+}
+
+template <typename Compare>
+size_t tendb::pbt::Reader::rank(const std::string_view &key, const Compare &compare) const
+{
+    const Header *header = get_header();
+
+    if (header->num_items == 0)
+    {
+        return 0;
+    }
+
+    // Sum the item counts of all subtrees that lie entirely before the key, along the path to the key
+    size_t index = 0;
+    uint64_t offset = header->root_offset;
+    uint32_t depth = header->depth;
+    while (depth > 0)
+    {
+        Node *node = get_node_at_offset(offset);
+        const ChildReference *target = nullptr;
+
+        for (const auto *child : *node)
+        {
+            if (compare(child->key(), key) >= 0)
+            {
+                break;
+            }
+            if (target)
+            {
+                index += target->get_num_items();
+            }
+            target = child;
+        }
+
+        if (!target)
+        {
+            return index; // All items in this subtree are at or after the key
+        }
+
+        offset = target->get_offset();
+        --depth;
+    }
+
+    Node *leaf_node = get_node_at_offset(offset);
+    for (const auto *child : *leaf_node)
+    {
+        if (compare(child->key(), key) >= 0)
+        {
+            break;
+        }
+        ++index;
+    }
+
+    return index;
+}
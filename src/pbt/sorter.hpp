@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "pbt/options.hpp"
+
+namespace tendb::pbt
+{
+    /**
+     * Writes a tree from items that are added in any order.
+     * Items are buffered in memory until the memory budget is reached, after which the buffer is sorted using multiple threads
+     * and spilled to a temporary tree (a run). When finished, the runs are merged into the final tree.
+     * If all items fit within the budget, they are written to the final tree directly.
+     * Items with equal keys keep the order in which they were added.
+     */
+    struct Sorter
+    {
+    private:
+        struct Entry
+        {
+            uint64_t offset; // Offset of the key in the buffer, directly followed by the value
+            uint64_t key_size;
+            uint64_t value_size;
+        };
+
+        const std::string path;
+        const Options options;
+        const uint64_t memory_budget;
+        const size_t num_threads;
+
+        std::vector<char> buffer;
+        std::vector<Entry> entries;
+        std::vector<std::string> run_paths;
+
+        void sort_entries();
+        void write_entries(const std::string &target_path);
+        void spill();
+
+    public:
+        static constexpr uint64_t default_memory_budget = 256 * 1024 * 1024; // 256 MB
+
+        Sorter(const std::string &path, const Options &opts = Options(), uint64_t memory_budget = default_memory_budget, size_t num_threads = 0);
+        ~Sorter();
+
+        Sorter(const Sorter &) = delete;
+        Sorter &operator=(const Sorter &) = delete;
+
+        void add(const std::string_view &key, const std::string_view &value);
+        void finish();
+    };
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "pbt/format.hpp"
+#include "pbt/merger.hpp"
+#include "pbt/options.hpp"
+#include "pbt/reader.hpp"
+#include "pbt/writer.hpp"
+
+namespace tendb::pbt
+{
+    struct OutputFile
+    {
+        std::string path;
+        std::string first_key;
+        std::string last_key;
+        uint64_t num_items;
+    };
+
+    /**
+     * Writes sorted items to a sequence of trees, each bounded in size.
+     * A new file is started once the current one reaches max_file_size bytes of items or max_items items,
+     * but never between items with equal keys, so that every key is in exactly one file.
+     * Files are named path.0, path.1, and so on.
+     */
+    struct SplitWriter
+    {
+    private:
+        const std::string path;
+        const Options options;
+        const uint64_t max_file_size;
+        const uint64_t max_items;
+        const bool lexical; // Whether options.compare_fn is LexicalCompare, which is then called directly
+
+        std::unique_ptr<Writer> writer;
+        std::vector<OutputFile> files;
+        uint64_t last_item_offset; // Offset of the last item in the current file, whose key is copied when the file is finished
+
+        int compare(const std::string_view &a, const std::string_view &b) const;
+        bool is_full() const;
+        std::string_view last_key() const;
+        void add_item(const std::string_view &key, const std::string_view &value, bool tombstone);
+        void append_items(const KeyValueItem::Iterator &begin, const KeyValueItem::Iterator &end);
+        void finish_file();
+
+        template <typename Compare, typename Sink>
+        friend void merge_into(Merger<Compare> &merger, const MergeOptions &merge_options, const Compare &compare, Sink &sink);
+
+    public:
+        SplitWriter(const std::string &path, const Options &opts = Options(), uint64_t max_file_size = UINT64_MAX, uint64_t max_items = UINT64_MAX);
+
+        void add(const std::string_view &key, const std::string_view &value);
+        void add_tombstone(const std::string_view &key);
+        void merge(const Reader **readers, size_t num_readers, const MergeOptions &merge_options = MergeOptions());
+        template <typename Compare>
+        void merge(const Reader **readers, size_t num_readers, const MergeOptions &merge_options, const Compare &compare);
+        std::vector<OutputFile> finish();
+    };
+}
+
+template <typename Compare>
+void tendb::pbt::SplitWriter::merge(const Reader **readers, size_t num_readers, const MergeOptions &merge_options, const Compare &compare)
+{
+    // Merges into multiple files run on one thread, so merge_options.num_threads is not used
+    Merger<Compare> merger(readers, num_readers, compare);
+    merge_into(merger, merge_options, compare, *this);
+}
@@ -3,21 +3,63 @@
 #include <cstdint>
 #include <filesystem>
 #include <fstream>
+#include <memory>
 #include <string>
 
+#if defined(_WIN32)
+#include <vector>
+
 #include <boost/interprocess/file_mapping.hpp>
 #include <boost/interprocess/mapped_region.hpp>
+#endif
 
 namespace tendb::pbt
 {
-    struct Storage
+    /**
+     * Memory that holds the bytes of a tree, such as a mapped file or a buffer.
+     * Writable backends grow and shrink with set_size, read-only backends only expose their bytes.
+     */
+    struct StorageBackend
+    {
+        virtual ~StorageBackend() = default;
+
+        virtual uint64_t get_size() const = 0;
+        virtual void set_size(uint64_t size) = 0;
+        virtual bool is_read_only() const = 0;
+        virtual void set_read_only(bool ro) = 0;
+        virtual void *get_address() const = 0;
+
+        // Persisting and dropping ranges only applies to backends with a file, and does nothing otherwise
+        virtual void flush() const;
+        virtual void start_writeback(uint64_t offset, uint64_t size) const;
+        virtual void drop_pages(uint64_t offset, uint64_t size) const;
+    };
+
+    /**
+     * File-backed storage, mapped into memory.
+     * On POSIX systems, writable storage reserves a large range of virtual address space up front and maps the file into it.
+     * Growing the file then only extends the mapping in place, so the base address stays stable and pointers into the storage remain valid.
+     * Only when the file outgrows the reserved range is it remapped at a new address.
+     * On POSIX systems the file can also be given as a borrowed file descriptor, such as a memfd, which is then not closed.
+     */
+    struct FileBackend : StorageBackend
     {
     private:
         static constexpr uint64_t initial_file_size = 1024 * 1024; // 1 MB
 
         std::string path;
+#if defined(_WIN32)
         boost::interprocess::file_mapping *mapping;
         boost::interprocess::mapped_region *region;
+#else
+        static constexpr uint64_t reserved_address_space = 64ull * 1024 * 1024 * 1024; // 64 GB, virtual only
+
+        int fd;
+        bool owns_fd;           // Whether fd was opened from the path, rather than borrowed from the caller
+        char *address;          // Base address of the reserved range
+        uint64_t reserved_size; // Size of the reserved range
+        uint64_t mapped_size;   // Size of the file-backed part of the reserved range, from the base address
+#endif
         bool read_only;
         uint64_t file_size;
 
@@ -26,10 +68,103 @@ namespace tendb::pbt
         void map_file();
         void unmap_file();
         void set_file_size(uint64_t size);
+#if !defined(_WIN32)
+        void reserve_address_space(uint64_t size, uint64_t min_size);
+        void extend_mapping(uint64_t size);
+#endif
+
+    public:
+        FileBackend(const std::string &path, bool read_only);
+#if !defined(_WIN32)
+        FileBackend(int fd, bool read_only);
+#endif
+        ~FileBackend() override;
+
+        FileBackend(const FileBackend &) = delete;
+        FileBackend &operator=(const FileBackend &) = delete;
+
+        uint64_t get_size() const override;
+        void set_size(uint64_t size) override;
+        bool is_read_only() const override;
+        void set_read_only(bool ro) override;
+        void *get_address() const override;
+        void flush() const override;
+
+        // Start writing back a range of the file, without waiting for it to complete
+        void start_writeback(uint64_t offset, uint64_t size) const override;
+        // Write back a range of the file and drop its pages from memory and the page cache, where the platform supports it
+        void drop_pages(uint64_t offset, uint64_t size) const override;
+    };
+
+    /**
+     * Anonymous memory that grows like a file, for trees that are never written to disk.
+     * On POSIX systems it reserves address space up front like FileBackend, so growing keeps the base address stable.
+     */
+    struct MemoryBackend : StorageBackend
+    {
+    private:
+#if defined(_WIN32)
+        std::vector<char> buffer;
+#else
+        static constexpr uint64_t reserved_address_space = 64ull * 1024 * 1024 * 1024; // 64 GB, virtual only
+
+        char *address;
+        uint64_t reserved_size;  // Size of the reserved range
+        uint64_t committed_size; // Size of the accessible part of the reserved range, from the base address
+#endif
+        bool read_only;
+        uint64_t size;
+
+    public:
+        MemoryBackend();
+        ~MemoryBackend() override;
+
+        MemoryBackend(const MemoryBackend &) = delete;
+        MemoryBackend &operator=(const MemoryBackend &) = delete;
+
+        uint64_t get_size() const override;
+        void set_size(uint64_t size) override;
+        bool is_read_only() const override;
+        void set_read_only(bool ro) override;
+        void *get_address() const override;
+    };
+
+    /**
+     * Read-only bytes owned by the caller, such as a buffer received over the network, which are used without copying.
+     * The bytes must outlive the backend.
+     */
+    struct SpanBackend : StorageBackend
+    {
+    private:
+        const char *data;
+        uint64_t size;
+
+    public:
+        SpanBackend(const void *data, uint64_t size);
+
+        uint64_t get_size() const override;
+        void set_size(uint64_t size) override;
+        bool is_read_only() const override;
+        void set_read_only(bool ro) override;
+        void *get_address() const override;
+    };
+
+    /**
+     * Storage of a tree, on top of a backend.
+     * The base address and size are kept here, so that the frequent lookups of items and nodes do not go through a virtual call.
+     */
+    struct Storage
+    {
+    private:
+        std::unique_ptr<StorageBackend> backend;
+        char *address;
+        uint64_t size;
+
+        void update();
 
     public:
-        Storage(const std::string &path, bool read_only);
-        ~Storage();
+        Storage(const std::string &path, bool read_only); // Storage on a FileBackend
+        Storage(std::unique_ptr<StorageBackend> backend);
 
         Storage(const Storage &) = delete;
         Storage &operator=(const Storage &) = delete;
@@ -41,5 +176,7 @@ namespace tendb::pbt
         void set_read_only(bool ro);
         void *get_address() const;
         void flush() const;
+        void start_writeback(uint64_t offset, uint64_t size) const;
+        void drop_pages(uint64_t offset, uint64_t size) const;
     };
 }
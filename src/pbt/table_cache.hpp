@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "pbt/options.hpp"
+#include "pbt/reader.hpp"
+
+namespace tendb::pbt
+{
+    struct TableInfo
+    {
+        std::string path;
+        std::string first_key;
+        std::string last_key;
+        uint64_t num_items;
+    };
+
+    /**
+     * Bounded pool of open readers for many tree files.
+     * Readers are opened on first use and the least recently used one is closed when more than capacity are open.
+     * Handles to readers are shared, so a reader that is evicted stays open until its last handle (and the iterators from it) are gone.
+     * The key range and item count of every known file stay in memory, so files can be pruned without opening them.
+     * All methods are safe to call from multiple threads.
+     */
+    struct TableCache
+    {
+    private:
+        struct Entry
+        {
+            TableInfo info;
+            std::shared_ptr<const Reader> reader;  // Open reader, or nullptr when evicted
+            std::list<std::string>::iterator lru;  // Position in lru, valid while the reader is open
+        };
+
+        const size_t capacity;
+        const Options options;
+        const bool lexical; // Whether options.compare_fn is LexicalCompare, which is then called directly
+
+        mutable std::mutex mutex;
+        std::unordered_map<std::string, Entry> entries;
+        std::list<std::string> lru; // Paths of the open readers, most recently used first
+
+        int compare(const std::string_view &a, const std::string_view &b) const;
+        static TableInfo read_info(const std::string &path, const Reader &reader);
+        void insert_reader(Entry &entry, const std::shared_ptr<const Reader> &reader);
+
+    public:
+        TableCache(size_t capacity, const Options &opts = Options());
+
+        TableCache(const TableCache &) = delete;
+        TableCache &operator=(const TableCache &) = delete;
+
+        void add(const std::string &path);  // Reads the metadata of the file, which leaves its reader open
+        void add(const TableInfo &info);    // Metadata that is already known, such as from a SplitWriter, without opening the file
+        void remove(const std::string &path);
+
+        std::shared_ptr<const Reader> get(const std::string &path);
+        bool get_info(const std::string &path, TableInfo &info) const;
+        std::vector<TableInfo> find(const std::string_view &first_key, const std::string_view &last_key) const; // Files that may hold keys in the range
+
+        size_t get_num_files() const;
+        size_t get_num_open() const; // Readers held by the cache, not counting evicted readers that still have handles
+    };
+}
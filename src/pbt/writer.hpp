@@ -1,11 +1,21 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
 #include <string_view>
+#include <thread>
+#include <vector>
 
 #include "pbt/appender.hpp"
 #include "pbt/format.hpp"
+#include "pbt/index_builder.hpp"
+#include "pbt/merger.hpp"
 #include "pbt/options.hpp"
+#include "pbt/parallel_index_builder.hpp"
+#include "pbt/reader.hpp"
 #include "pbt/storage.hpp"
 
 namespace tendb::pbt
@@ -13,20 +23,222 @@ namespace tendb::pbt
     struct Writer
     {
     private:
+        // Items and bytes that a partition of a parallel merge writes
+        struct PartitionSize
+        {
+            uint64_t num_items = 0;
+            uint64_t size = 0;
+        };
+
+        // Items of one partition of a parallel merge whose size is only known once it is merged, which are copied into its region afterwards
+        struct Segment
+        {
+            const std::string path;
+            std::unique_ptr<Storage> storage;
+            std::unique_ptr<Appender> appender;
+            uint64_t num_items;
+
+            Segment(const std::string &path);
+            ~Segment();
+
+            void add_item(const std::string_view &key, const std::string_view &value, bool tombstone);
+            void append_items(const KeyValueItem::Iterator &begin, const KeyValueItem::Iterator &end);
+        };
+
+        // Writes the items of one partition of a parallel merge straight into its own region of the output
+        // Partitions record their leaf nodes in their own range of the index, when the index is built in parallel
+        // Writes past the region or the reserved number of items throw, rather than overwrite the next partition
+        struct Partition
+        {
+            Storage &storage;
+            uint64_t offset; // Offset of the next item
+            uint64_t end_offset;
+            uint64_t num_items;
+            uint64_t max_items;
+            ParallelIndexBuilder *index;
+            ParallelIndexBuilder::Range range;
+
+            void add_item(const std::string_view &key, const std::string_view &value, bool tombstone);
+            void append_items(const KeyValueItem::Iterator &begin, const KeyValueItem::Iterator &end);
+        };
+
+        const std::string path;
         Storage storage;
         const Options options;
         Appender appender;
+        std::unique_ptr<IndexBuilder> index;                 // Used when the index is built while items are added
+        std::unique_ptr<ParallelIndexBuilder> parallel_index; // Used when the index is built in finish()
         uint64_t begin_key_value_items_offset;
         uint64_t num_items;
 
         Header *get_header() const;
+        void start();
+        void add_item(const std::string_view &key, const std::string_view &value, bool tombstone);
+        void index_item(uint64_t item_offset, uint64_t key_size);
+        void append_items(const KeyValueItem::Iterator &begin, const KeyValueItem::Iterator &end);
+        void write_partitions(std::vector<Partition> &partitions, const std::vector<PartitionSize> &sizes, const std::function<void(size_t partition)> &merge_partition, size_t num_threads);
+        template <typename Compare>
+        void merge_partitioned(const Reader **readers, size_t num_readers, const MergeOptions &merge_options, const Compare &compare, size_t num_threads);
+        static void run_in_parallel(size_t num_tasks, size_t num_threads, const std::function<void(size_t task)> &fn);
+
+        template <typename Compare, typename Sink>
+        friend void merge_into(Merger<Compare> &merger, const MergeOptions &merge_options, const Compare &compare, Sink &sink);
+        friend struct SplitWriter;
 
     public:
         Writer(const std::string &path, const Options &opts = Options());
+        Writer(std::unique_ptr<StorageBackend> backend, const Options &opts = Options()); // Temporary data is kept in memory as well
 
         const Options &get_options();
+        const Storage &get_storage() const; // Bytes of the tree, which are complete after finish()
+        uint64_t get_num_items() const;
+        uint64_t get_size() const; // Bytes written so far, excluding the index
         void add(const std::string_view &key, const std::string_view &value);
+        void add_tombstone(const std::string_view &key);
         void merge(const Reader **readers, size_t num_readers);
+        void merge(const Reader **readers, size_t num_readers, const MergeOptions &merge_options);
+        template <typename Compare>
+        void merge(const Reader **readers, size_t num_readers, const Compare &compare);
+        template <typename Compare>
+        void merge(const Reader **readers, size_t num_readers, const MergeOptions &merge_options, const Compare &compare);
         void finish();
     };
 }
+
+template <typename Compare>
+void tendb::pbt::Writer::merge(const Reader **readers, size_t num_readers, const Compare &compare)
+{
+    merge(readers, num_readers, MergeOptions(), compare);
+}
+
+template <typename Compare>
+void tendb::pbt::Writer::merge(const Reader **readers, size_t num_readers, const MergeOptions &merge_options, const Compare &compare)
+{
+    size_t num_threads = merge_options.num_threads > 0 ? merge_options.num_threads : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    if (num_threads > 1)
+    {
+        merge_partitioned(readers, num_readers, merge_options, compare, num_threads);
+        return;
+    }
+
+    Merger<Compare> merger(readers, num_readers, compare);
+    merge_into(merger, merge_options, compare, *this);
+}
+
+template <typename Compare>
+void tendb::pbt::Writer::merge_partitioned(const Reader **readers, size_t num_readers, const MergeOptions &merge_options, const Compare &compare, size_t num_threads)
+{
+    // Partitions smaller than this are not worth a thread
+    constexpr uint64_t min_partition_items = 4096;
+
+    uint64_t total_items = 0;
+    for (size_t i = 0; i < num_readers; ++i)
+    {
+        total_items += readers[i]->get_header()->num_items;
+    }
+    num_threads = std::min<size_t>(num_threads, total_items / min_partition_items);
+
+    // Sample keys from the upper levels of every reader, weighted by the number of items below them
+    std::vector<KeySample> samples;
+    for (size_t i = 0; num_threads > 1 && i < num_readers; ++i)
+    {
+        std::vector<KeySample> reader_samples = readers[i]->sample_keys(16 * num_threads);
+        samples.insert(samples.end(), reader_samples.begin(), reader_samples.end());
+    }
+
+    auto sample_less = [&](const KeySample &a, const KeySample &b)
+    {
+        return compare(a.key, b.key) < 0;
+    };
+    std::sort(samples.begin(), samples.end(), sample_less);
+
+    // Split at evenly spaced item counts
+    // Every split key is a lower bound in every reader, so all items with equal keys end up in the same partition
+    std::vector<std::string_view> split_keys;
+    uint64_t num_sampled_items = 0;
+    size_t next_split = 1;
+    for (const auto &sample : samples)
+    {
+        while (next_split < num_threads && num_sampled_items >= next_split * total_items / num_threads)
+        {
+            if (num_sampled_items > 0 && (split_keys.empty() || compare(split_keys.back(), sample.key) != 0))
+            {
+                split_keys.push_back(sample.key);
+            }
+            ++next_split;
+        }
+        num_sampled_items += sample.num_items;
+    }
+
+    if (split_keys.empty())
+    {
+        Merger<Compare> merger(readers, num_readers, compare);
+        merge_into(merger, merge_options, compare, *this);
+        return;
+    }
+
+    // ranges[p][i] is the range of reader i that belongs to partition p
+    size_t num_partitions = split_keys.size() + 1;
+    std::vector<std::vector<ItemRange>> ranges(num_partitions);
+    for (size_t i = 0; i < num_readers; ++i)
+    {
+        uint64_t start = 0;
+        KeyValueItem::Iterator start_itr = readers[i]->begin();
+        for (size_t p = 0; p < num_partitions; ++p)
+        {
+            uint64_t end = p + 1 < num_partitions ? readers[i]->rank(split_keys[p], compare) : readers[i]->get_header()->num_items;
+            KeyValueItem::Iterator end_itr = p + 1 < num_partitions ? readers[i]->seek_at(end) : readers[i]->end();
+            ranges[p].push_back(ItemRange{start, end, start_itr, end_itr});
+            start = end;
+            start_itr = end_itr;
+        }
+    }
+
+    // Partitions are sized up front, so that each is written into its own region of the output
+    // Without deduplication and filtering, every item is written as is, so the sizes follow from the ranges of the readers
+    // Otherwise every partition is merged once into a segment of its own, which is copied into its region afterwards,
+    // so that the filter is called once per item and the readers are read once
+    std::vector<PartitionSize> sizes(num_partitions);
+    std::vector<std::unique_ptr<Segment>> segments;
+    if (!merge_options.deduplicate && !merge_options.filter_fn)
+    {
+        for (size_t p = 0; p < num_partitions; ++p)
+        {
+            for (const auto &range : ranges[p])
+            {
+                sizes[p].num_items += range.item_end - range.item_start;
+                sizes[p].size += range.end.get_offset() - range.begin.get_offset();
+            }
+        }
+    }
+    else
+    {
+        for (size_t p = 0; p < num_partitions; ++p)
+        {
+            segments.push_back(std::make_unique<Segment>(path.empty() ? path : path + ".part" + std::to_string(p)));
+        }
+        auto merge_segment = [&](size_t p)
+        {
+            Merger<Compare> merger(readers, ranges[p].data(), num_readers, compare);
+            merge_into(merger, merge_options, compare, *segments[p]);
+            sizes[p] = PartitionSize{segments[p]->num_items, segments[p]->appender->get_offset()};
+        };
+        run_in_parallel(num_partitions, num_threads, merge_segment);
+    }
+
+    std::vector<Partition> partitions;
+    auto write_partition = [&](size_t p)
+    {
+        if (!segments.empty())
+        {
+            const Storage &segment_storage = *segments[p]->storage;
+            partitions[p].append_items(KeyValueItem::Iterator(segment_storage, 0), KeyValueItem::Iterator(segment_storage, sizes[p].size));
+            segments[p].reset();
+            return;
+        }
+
+        Merger<Compare> merger(readers, ranges[p].data(), num_readers, compare);
+        merge_into(merger, merge_options, compare, partitions[p]);
+    };
+    write_partitions(partitions, sizes, write_partition, num_threads);
+}
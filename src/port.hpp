@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+
 #if defined(_WIN32)
 
 #define NOMINMAX
@@ -7,17 +9,17 @@
 
 namespace tendb::port
 {
-    int physical_core_id()
+    inline int physical_core_id()
     {
         return GetCurrentProcessorNumber();
     }
 
-    uint32_t get_current_process_id()
+    inline uint32_t get_current_process_id()
     {
         return GetCurrentProcessId();
     }
 
-    uint32_t get_current_thread_id()
+    inline uint32_t get_current_thread_id()
     {
         return GetCurrentThreadId();
     }
@@ -25,9 +27,16 @@ namespace tendb::port
 
 #else
 
+#include <sched.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
 namespace tendb::port
 {
-    int physical_core_id()
+    inline int physical_core_id()
     {
 #if defined(__x86_64__) && (__GNUC__ > 2 || (__GNUC__ == 2 && __GNUC_MINOR__ >= 22))
         return sched_getcpu();
@@ -43,12 +52,12 @@ namespace tendb::port
 #endif
     }
 
-    uint32_t get_current_process_id()
+    inline uint32_t get_current_process_id()
     {
         return static_cast<uint32_t>(getpid());
     }
 
-    uint32_t get_current_thread_id()
+    inline uint32_t get_current_thread_id()
     {
         return static_cast<uint32_t>(gettid());
     }
@@ -1,33 +1,54 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
 #include <deque>
 #include <functional>
 #include <memory>
 #include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "core_local.hpp"
 
+// Profiling zones, which are compiled out unless a profiler provides ZoneScoped
+#if !defined(ZoneScoped)
+#define ZoneScoped
+#endif
+
 namespace tendb::skip_list
 {
     constexpr static size_t ALIGNMENT = alignof(std::max_align_t);
     static thread_local size_t cpu_id = core_local::access_index();
 
+    /**
+     * Allocator for small objects, which carves them from blocks of memory.
+     * Freed memory is kept in a free list per size class, and reused by later allocations of the same size class.
+     * Blocks are only returned to the system when the allocator is destroyed.
+     */
     struct BlockAllocator
     {
     private:
         constexpr static size_t BLOCK_SIZE = 4096;
-        constexpr static size_t LARGE_ALLOCATION_THRESHOLD = BLOCK_SIZE / 4;
+
+        struct FreeObject
+        {
+            FreeObject *next;
+        };
 
         std::deque<std::unique_ptr<char[]>> blocks;
         char *current_begin = nullptr;
         char *current_end = nullptr;
+        std::array<FreeObject *, BLOCK_SIZE / 4 / ALIGNMENT> free_lists{}; // Indexed by the aligned size divided by ALIGNMENT, minus one
 
-        bool is_large_allocation(size_t requested_size) const
+        static size_t aligned_size(size_t requested_size)
         {
-            return requested_size > LARGE_ALLOCATION_THRESHOLD;
+            return requested_size + (-requested_size & (ALIGNMENT - 1)); // add padding to align to ALIGNMENT
         }
 
         char *new_block(size_t size)
@@ -41,16 +62,27 @@ namespace tendb::skip_list
             return block;
         }
 
-        char *allocate_small(size_t requested_size)
+    public:
+        constexpr static size_t LARGE_ALLOCATION_THRESHOLD = BLOCK_SIZE / 4;
+
+        char *allocate(size_t requested_size)
         {
             ZoneScoped;
 
             assert(requested_size > 0 && "Allocation size must be greater than zero");
-            assert(requested_size <= BLOCK_SIZE && "Allocation size exceeds block size");
+            assert(requested_size <= LARGE_ALLOCATION_THRESHOLD && "Allocation size exceeds the small allocation size");
 
-            requested_size += -requested_size & (ALIGNMENT - 1); // add padding to align to ALIGNMENT
-            size_t current_size = current_end - current_begin;
+            requested_size = aligned_size(requested_size);
 
+            FreeObject *&free_list = free_lists[requested_size / ALIGNMENT - 1];
+            if (free_list != nullptr)
+            {
+                FreeObject *object = free_list;
+                free_list = object->next;
+                return reinterpret_cast<char *>(object);
+            }
+
+            size_t current_size = current_end - current_begin;
             if (requested_size > current_size)
             {
                 char *block = new_block(BLOCK_SIZE);
@@ -64,44 +96,67 @@ namespace tendb::skip_list
             return address;
         }
 
-    public:
-        char *allocate(size_t requested_size)
+        /**
+         * Return memory to the free list of its size class.
+         * The memory may come from another BlockAllocator, as long as that one lives at least as long as this one.
+         */
+        void deallocate(char *address, size_t requested_size)
         {
             ZoneScoped;
 
-            assert(requested_size > 0 && "Allocation size must be greater than zero");
+            assert(requested_size > 0 && requested_size <= LARGE_ALLOCATION_THRESHOLD && "Deallocation size does not match a small allocation");
 
-            if (is_large_allocation(requested_size))
-            {
-                return new_block(requested_size);
-            }
-            else
-            {
-                return allocate_small(requested_size);
-            }
+            FreeObject *&free_list = free_lists[aligned_size(requested_size) / ALIGNMENT - 1];
+            free_list = new (address) FreeObject{free_list};
+        }
+
+        size_t get_memory_usage() const
+        {
+            return blocks.size() * BLOCK_SIZE;
         }
     };
 
+    /**
+     * Allocator with one shard per core, so that threads on different cores allocate without contention.
+     *
+     * Memory that concurrent readers may still access is retired rather than freed, with epoch-based reclamation.
+     * Readers pin the current epoch for as long as they access shared objects. The epoch advances once no reader is
+     * pinned to the epoch before it, so memory retired in an epoch is no longer reachable by any reader two epochs later,
+     * and is then freed to the shard of the core that retired it, where the next allocations of that size reuse it.
+     * Pins are counted per shard, so pinning only touches memory of the current core.
+     */
     struct CoreLocalShardAllocator
     {
     private:
-        constexpr static size_t BLOCK_SIZE = 4096;
+        constexpr static size_t NUM_EPOCHS = 3;         // Epochs whose retired memory can still be in use: the current one and the two before it
+        constexpr static size_t ADVANCE_INTERVAL = 64;  // Retirements in a shard between attempts to advance the epoch
 
-        struct Shard
+        struct Retired
+        {
+            char *address;
+            size_t size;
+        };
+
+        struct alignas(64) Shard
         {
             BlockAllocator allocator;
             std::mutex mutex;
+            std::array<std::atomic<uint64_t>, NUM_EPOCHS> pins{};  // Readers pinned to each epoch, indexed by the epoch modulo NUM_EPOCHS
+            std::array<std::vector<Retired>, NUM_EPOCHS> retired; // Memory retired in each epoch, indexed like pins
+            std::array<uint64_t, NUM_EPOCHS> retired_epochs{};    // Epoch of the memory in each retired list
+            size_t num_retired_since_advance = 0;
         };
 
         core_local::CoreLocalArray<Shard> shards;
+        std::atomic<uint64_t> epoch{NUM_EPOCHS}; // Starts high enough that the retired lists of all shards are initially for older epochs
 
-    public:
-        char *allocate(size_t requested_size)
-        {
-            ZoneScoped;
-
-            assert(requested_size > 0 && "Allocation size must be greater than zero");
+        // Large allocations are rare, and freed memory may come from any shard, so they share one map
+        std::mutex large_mutex;
+        std::unordered_map<char *, std::unique_ptr<char[]>> large_blocks;
+        size_t large_blocks_size = 0;
 
+        Shard *lock_shard()
+        {
             Shard *shard = shards.access_at_core(cpu_id);
 
             if (!shard->mutex.try_lock())
@@ -110,10 +165,197 @@ namespace tendb::skip_list
                 shard = shards.access_at_core(cpu_id);
                 shard->mutex.lock();
             }
+            return shard;
+        }
 
+        void free(Shard *shard, char *address, size_t size)
+        {
+            if (size > BlockAllocator::LARGE_ALLOCATION_THRESHOLD)
+            {
+                std::lock_guard<std::mutex> lock(large_mutex);
+                large_blocks.erase(address);
+                large_blocks_size -= size;
+            }
+            else
+            {
+                shard->allocator.deallocate(address, size);
+            }
+        }
+
+        /**
+         * Free the memory of a shard that was retired at least two epochs before the current one.
+         * Called with the shard locked.
+         */
+        void reclaim(Shard *shard, uint64_t current_epoch)
+        {
+            for (size_t i = 0; i < NUM_EPOCHS; ++i)
+            {
+                if (shard->retired_epochs[i] + 2 <= current_epoch && !shard->retired[i].empty())
+                {
+                    for (const auto &retired : shard->retired[i])
+                    {
+                        free(shard, retired.address, retired.size);
+                    }
+                    shard->retired[i].clear();
+                }
+            }
+        }
+
+        /**
+         * Advance the epoch if no reader is pinned to the epoch before the current one.
+         */
+        uint64_t try_advance()
+        {
+            uint64_t current_epoch = epoch.load(std::memory_order_seq_cst);
+            size_t previous_index = (current_epoch - 1) % NUM_EPOCHS;
+            for (size_t i = 0; i < shards.get_size(); ++i)
+            {
+                if (shards.access_at_core(i)->pins[previous_index].load(std::memory_order_seq_cst) != 0)
+                {
+                    return current_epoch;
+                }
+            }
+
+            // On failure, another thread advanced the epoch, which is just as good
+            epoch.compare_exchange_strong(current_epoch, current_epoch + 1, std::memory_order_seq_cst);
+            return epoch.load(std::memory_order_seq_cst);
+        }
+
+    public:
+        /**
+         * Pin of a reader to an epoch, during which memory that the reader can reach is not freed.
+         */
+        struct Guard
+        {
+        private:
+            std::atomic<uint64_t> *pin = nullptr;
+
+        public:
+            Guard() = default;
+            Guard(std::atomic<uint64_t> *pin) : pin(pin) {}
+
+            Guard(const Guard &) = delete;
+            Guard &operator=(const Guard &) = delete;
+
+            Guard(Guard &&other) noexcept : pin(std::exchange(other.pin, nullptr)) {}
+
+            Guard &operator=(Guard &&other) noexcept
+            {
+                if (this != &other)
+                {
+                    release();
+                    pin = std::exchange(other.pin, nullptr);
+                }
+                return *this;
+            }
+
+            ~Guard()
+            {
+                release();
+            }
+
+            void release()
+            {
+                if (pin != nullptr)
+                {
+                    pin->fetch_sub(1, std::memory_order_release);
+                    pin = nullptr;
+                }
+            }
+        };
+
+        char *allocate(size_t requested_size)
+        {
+            ZoneScoped;
+
+            assert(requested_size > 0 && "Allocation size must be greater than zero");
+
+            if (requested_size > BlockAllocator::LARGE_ALLOCATION_THRESHOLD)
+            {
+                char *block = new char[requested_size];
+                std::lock_guard<std::mutex> lock(large_mutex);
+                large_blocks.emplace(block, std::unique_ptr<char[]>(block));
+                large_blocks_size += requested_size;
+                return block;
+            }
+
+            Shard *shard = lock_shard();
             char *address = shard->allocator.allocate(requested_size);
             shard->mutex.unlock();
             return address;
         }
+
+        /**
+         * Free memory right away, which is only safe if no other thread can reach it, such as memory that was never shared.
+         */
+        void deallocate(char *address, size_t requested_size)
+        {
+            ZoneScoped;
+
+            Shard *shard = lock_shard();
+            free(shard, address, requested_size);
+            shard->mutex.unlock();
+        }
+
+        /**
+         * Pin the current epoch, so that memory that is reachable now is not freed until the guard is released.
+         */
+        Guard pin()
+        {
+            Shard *shard = shards.access_at_core(cpu_id);
+            while (true)
+            {
+                uint64_t current_epoch = epoch.load(std::memory_order_seq_cst);
+                std::atomic<uint64_t> *pin = &shard->pins[current_epoch % NUM_EPOCHS];
+                pin->fetch_add(1, std::memory_order_seq_cst);
+
+                // If the epoch advanced in the meantime, the pin may have been missed by the advance, so pin the new epoch instead
+                if (epoch.load(std::memory_order_seq_cst) == current_epoch)
+                {
+                    return Guard(pin);
+                }
+                pin->fetch_sub(1, std::memory_order_release);
+            }
+        }
+
+        /**
+         * Free memory once no reader that is pinned now can access it anymore.
+         * The memory must already be unreachable for readers that pin from now on.
+         */
+        void retire(char *address, size_t requested_size)
+        {
+            ZoneScoped;
+
+            Shard *shard = lock_shard();
+            uint64_t current_epoch = epoch.load(std::memory_order_seq_cst);
+            if (++shard->num_retired_since_advance >= ADVANCE_INTERVAL)
+            {
+                shard->num_retired_since_advance = 0;
+                current_epoch = try_advance();
+            }
+            reclaim(shard, current_epoch);
+
+            size_t index = current_epoch % NUM_EPOCHS;
+            shard->retired_epochs[index] = current_epoch;
+            shard->retired[index].push_back(Retired{address, requested_size});
+            shard->mutex.unlock();
+        }
+
+        /**
+         * Bytes of memory held by the allocator, including free and retired memory.
+         */
+        size_t get_memory_usage()
+        {
+            size_t usage = 0;
+            for (size_t i = 0; i < shards.get_size(); ++i)
+            {
+                Shard *shard = shards.access_at_core(i);
+                std::lock_guard<std::mutex> lock(shard->mutex);
+                usage += shard->allocator.get_memory_usage();
+            }
+
+            std::lock_guard<std::mutex> lock(large_mutex);
+            return usage + large_blocks_size;
+        }
     };
 }
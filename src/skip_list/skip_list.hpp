@@ -3,12 +3,18 @@
 #include <array>
 #include <atomic>
 #include <cassert>
+#include <cstdint>
 #include <cstring>
 #include <immintrin.h>
 #include <iostream>
+#include <memory>
 #include <optional>
 #include <random>
 #include <string_view>
+#include <set>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "skip_list/allocation.hpp"
 
@@ -18,8 +24,42 @@ namespace tendb::skip_list
     static thread_local std::mt19937_64 rng{std::random_device{}()}; // Initialize thread-local RNG with a random seed
     static thread_local std::uniform_real_distribution<double> dist{0.0, 1.0};
 
+    struct SkipList;
+
+    /**
+     * Point in the history of a skip list.
+     * Reads at a snapshot see exactly the writes with a sequence number up to and including the snapshot's.
+     * While a snapshot exists, the skip list keeps the versions that it sees. It must not outlive the skip list.
+     */
+    struct Snapshot
+    {
+    private:
+        SkipList *owner;
+        uint64_t sequence;
+
+        Snapshot(SkipList *owner, uint64_t sequence) : owner(owner), sequence(sequence) {}
+
+        friend struct SkipList;
+
+    public:
+        static constexpr uint64_t LATEST = UINT64_MAX; // Sequence number of reads that see the newest data of every key
+
+        Snapshot(const Snapshot &) = delete;
+        Snapshot &operator=(const Snapshot &) = delete;
+        Snapshot(Snapshot &&other) noexcept : owner(std::exchange(other.owner, nullptr)), sequence(other.sequence) {}
+        Snapshot &operator=(Snapshot &&other) = delete;
+        ~Snapshot();
+
+        uint64_t get_sequence() const
+        {
+            return sequence;
+        }
+    };
+
     /**
      * Data structure to hold key-value pairs in the skip list.
+     * Every write creates new data with the next sequence number. The data of a key forms a chain of versions,
+     * from the newest to the oldest, so that readers at an older snapshot can still find the version they see.
      */
     struct Data
     {
@@ -29,8 +69,10 @@ namespace tendb::skip_list
         size_t key_size;
         size_t key_size_padded;
         size_t value_size;
-        size_t flags;   // Flags for the data, currently only used for deletion
-        char buffer[1]; // Placeholder for the key and value data at the end of the structure, to be allocated by the caller of the constructor
+        size_t flags;                 // Flags for the data, currently only used for deletion
+        uint64_t sequence;            // Sequence number of the write that created the data
+        std::atomic<Data *> previous; // Older version of the same key, with a lower sequence number, or nullptr
+        char buffer[1];               // Placeholder for the key and value data at the end of the structure, to be allocated by the caller of the constructor
 
         // Disallow copy and move operations
         Data(const Data &) = delete;
@@ -44,14 +86,21 @@ namespace tendb::skip_list
          * The caller must ensure that the bytes allocated for this object are sufficient to hold the key and value.
          * To get the size needed for the Data structure, use the static Data::size method.
          */
-        Data(std::string_view key, std::string_view value)
-            : key_size(key.size()), value_size(value.size()), flags(0)
+        Data(std::string_view key, std::string_view value, bool deleted = false, uint64_t sequence = 0)
+            : key_size(key.size()), value_size(value.size()), flags(deleted ? FLAG_DELETED : 0), sequence(sequence), previous(nullptr)
         {
             size_t padding = -key.size() & (32 - 1);
             key_size_padded = key.size() + padding;
-            std::memcpy(buffer, key.data(), key.size());
+            // Empty views may have a null data pointer, which memcpy does not accept even for zero bytes
+            if (!key.empty())
+            {
+                std::memcpy(buffer, key.data(), key.size());
+            }
             std::memset(buffer + key.size(), 0, padding);
-            std::memcpy(buffer + key_size_padded, value.data(), value.size());
+            if (!value.empty())
+            {
+                std::memcpy(buffer + key_size_padded, value.data(), value.size());
+            }
         }
 
         /**
@@ -77,6 +126,7 @@ namespace tendb::skip_list
         /**
          * Check if the data is marked as deleted.
          * When the data of a node is marked as deleted, it is not considered part of the skip list anymore.
+         * The data is then a tombstone, which records the deletion for readers that combine the skip list with older data.
          */
         bool is_deleted() const
         {
@@ -90,22 +140,89 @@ namespace tendb::skip_list
         {
             flags |= FLAG_DELETED;
         }
+
+        uint64_t get_sequence() const
+        {
+            return sequence;
+        }
+
+        /**
+         * Number of bytes that were allocated for the data, as computed by Data::size.
+         */
+        size_t allocation_size() const
+        {
+            return sizeof(Data) - 1 + key_size_padded + value_size;
+        }
+
+        /**
+         * Get the next older version of the key, or nullptr if this is the oldest.
+         */
+        const Data *get_previous() const
+        {
+            return previous.load(std::memory_order_acquire);
+        }
+
+        friend struct SkipListNode;
+        friend struct SkipList;
     };
 
     /**
      * Node structure for the skip list.
-     * Each node contains a pointer to the data, a pointer to the next node at the same level, and a pointer to the node below it (if any).
+     * Each node is the tower of one key: a pointer to the data, and the next node at each level that the node is part of,
+     * in one allocation whose size depends on the height of the tower. The first bytes of the key are inlined in the node,
+     * so that most comparisons during a search do not have to load the data.
+     *
+     * Nodes are removed from the skip list in two steps, as in Harris' lock-free linked list. First the node is marked as removed,
+     * by setting the lowest bit of its next pointers, after which no node can be linked after it anymore. Then it is unlinked
+     * from each level, by whichever thread finds it first. The lowest bit of the data pointer freezes the data of a node
+     * that is being removed, so that no new version is added to it.
      */
     struct alignas(alignof(std::max_align_t)) SkipListNode
     {
     private:
-        Data *data;                       // Does not need to be atomic, because concurrent operations are allowed to race to set the data pointer
-        std::atomic<SkipListNode *> next; // Wrapped in atomic for lock-free updates
-        SkipListNode *down;               // Once part of the skip list, the down pointer is never changed, so it does not need to be atomic either
+        constexpr static uintptr_t MARK = 0x1;         // Lowest bit of a pointer, which is free as nodes and data are aligned
+        constexpr static uint8_t FLAG_PRUNING = 0x1;   // A write is pruning the old versions of the data
+        constexpr static uint8_t FLAG_LINKED = 0x2;    // The node is linked at all levels of its tower
+
+        std::atomic<Data *> data;            // Newest version of the data, linked to the older versions, and marked once frozen
+        uint64_t key_prefix;                 // First bytes of the key, as computed by SkipListNode::prefix
+        uint8_t height;                      // Number of levels of the tower
+        std::atomic<uint8_t> flags;          // Fits in the padding of the node
+        std::atomic<SkipListNode *> next[1]; // Next node at each level, wrapped in atomic for lock-free updates, and marked once the node is removed
+                                             // Placeholder for the levels above the bottom, to be allocated by the caller of the constructor
+
+        template <typename T>
+        static T *with_mark(T *pointer)
+        {
+            return reinterpret_cast<T *>(reinterpret_cast<uintptr_t>(pointer) | MARK);
+        }
+
+        template <typename T>
+        static T *without_mark(T *pointer)
+        {
+            return reinterpret_cast<T *>(reinterpret_cast<uintptr_t>(pointer) & ~MARK);
+        }
+
+        template <typename T>
+        static bool has_mark(T *pointer)
+        {
+            return (reinterpret_cast<uintptr_t>(pointer) & MARK) != 0;
+        }
 
     public:
-        SkipListNode(Data *data, SkipListNode *next, SkipListNode *down)
-            : data(data), next(next), down(down) {}
+        /**
+         * Constructor to initialize a node with the data and the height of its tower, which is not linked at any level yet.
+         * The caller must ensure that the bytes allocated for this object are sufficient for the height, as computed by SkipListNode::size.
+         * The head of the skip list is a node without data.
+         */
+        SkipListNode(Data *data, size_t height)
+            : data(data), key_prefix(data != nullptr ? prefix(data->key()) : 0), height(static_cast<uint8_t>(height)), flags(0)
+        {
+            for (size_t i = 0; i < height; ++i)
+            {
+                new (&next[i]) std::atomic<SkipListNode *>(nullptr);
+            }
+        }
 
         // Disallow copy and move operations
         SkipListNode(const SkipListNode &) = delete;
@@ -114,56 +231,212 @@ namespace tendb::skip_list
         SkipListNode &operator=(SkipListNode &&) = delete;
 
         /**
-         * Set the next pointer of this node to a new node.
+         * Static method to calculate the size needed for a node with a tower of the given height.
+         */
+        static size_t size(size_t height)
+        {
+            return sizeof(SkipListNode) + (height - 1) * sizeof(std::atomic<SkipListNode *>);
+        }
+
+        /**
+         * Static method to calculate the inlined prefix of a key: its first eight bytes in big-endian order, padded with zeros.
+         * Prefixes compare like the keys themselves, except that equal prefixes need a comparison of the full keys.
+         */
+        static uint64_t prefix(std::string_view key)
+        {
+            uint64_t result = 0;
+            for (size_t i = 0; i < sizeof(uint64_t); ++i)
+            {
+                result = (result << 8) | (i < key.size() ? static_cast<unsigned char>(key[i]) : 0);
+            }
+            return result;
+        }
+
+        /**
+         * Compare a key, with its prefix, to the key of this node, like std::string_view::compare.
+         */
+        int compare(std::string_view key, uint64_t key_prefix) const
+        {
+            if (key_prefix != this->key_prefix)
+            {
+                return key_prefix < this->key_prefix ? -1 : 1;
+            }
+            return key.compare(get_data()->key());
+        }
+
+        size_t get_height() const
+        {
+            return height;
+        }
+
+        uint64_t get_key_prefix() const
+        {
+            return key_prefix;
+        }
+
+        /**
+         * Set the next pointer of this node at a level to a new node.
          * This method uses compare-and-exchange to ensure that concurrent insertions can correctly set the next pointer without loss of data.
+         * Fails if the node is removed, as its next pointer is then marked.
          */
-        bool set_next(SkipListNode *new_next, SkipListNode *prev_expected)
+        bool set_next(size_t level, SkipListNode *new_next, SkipListNode *prev_expected)
         {
             assert(new_next != nullptr && "Next node cannot be null");
 
-            return next.compare_exchange_strong(prev_expected, new_next, std::memory_order_relaxed);
+            // Release, so that a thread that reads the new node also sees its data
+            return next[level].compare_exchange_strong(prev_expected, new_next, std::memory_order_release, std::memory_order_relaxed);
+        }
+
+        /**
+         * Unlink the next node at a level, which must be removed, by pointing to the node after it instead.
+         * Fails if this node is removed as well, or if another node was linked or unlinked after it in the meantime.
+         */
+        bool unlink_next(size_t level, SkipListNode *removed)
+        {
+            assert(removed->is_removed(level) && "Only removed nodes can be unlinked");
+
+            return next[level].compare_exchange_strong(removed, removed->get_next(level), std::memory_order_release, std::memory_order_relaxed);
         }
 
         /**
-         * Override the next pointer of this node without checking the previous value.
+         * Mark the node as removed at every level, from the top down, so that no node is linked after it anymore.
+         * A search that finds the node unmarked at a level therefore never finds it removed at a level above.
+         */
+        void mark_removed()
+        {
+            for (size_t level = height; level-- > 0;)
+            {
+                SkipListNode *current = next[level].load(std::memory_order_relaxed);
+                while (!has_mark(current) && !next[level].compare_exchange_weak(current, with_mark(current), std::memory_order_acq_rel, std::memory_order_relaxed))
+                {
+                }
+            }
+        }
+
+        bool is_removed(size_t level = 0) const
+        {
+            return has_mark(next[level].load(std::memory_order_acquire));
+        }
+
+        /**
+         * Override the next pointer of this node at a level without checking the previous value.
          * Use this method only when the node is guaranteed to not have any concurrent modifications.
          */
-        void override_next(SkipListNode *new_next)
+        void override_next(size_t level, SkipListNode *new_next)
         {
-            next.store(new_next, std::memory_order_relaxed);
+            next[level].store(new_next, std::memory_order_relaxed);
         }
 
-        void set_data(Data *data_ptr)
+        /**
+         * Add a version to the data of this node.
+         * Versions are kept ordered by sequence number, so a write that lost the race against a newer write to the same key
+         * is linked below it instead of replacing it.
+         * Fails if the data is frozen, as the node is being removed.
+         */
+        bool set_data(Data *data_ptr)
         {
             assert(data_ptr != nullptr && "Data pointer cannot be null");
-            assert(data->key() == data_ptr->key() && "Data key must match the existing data key");
+            assert(get_data()->key() == data_ptr->key() && "Data key must match the existing data key");
+
+            std::atomic<Data *> *link = &data;
+            Data *current = link->load(std::memory_order_acquire);
+            while (true)
+            {
+                if (has_mark(current))
+                {
+                    // A failed attempt may have linked the version to the versions of this node, which are retired with it,
+                    // so the version is detached before it goes into a new node
+                    data_ptr->previous.store(nullptr, std::memory_order_relaxed);
+                    return false;
+                }
+                while (current != nullptr && current->sequence > data_ptr->sequence)
+                {
+                    link = &current->previous;
+                    current = link->load(std::memory_order_acquire);
+                }
+
+                // Versions are only ever added, so a failed exchange just means another version was linked at the same place
+                // The exchange is sequentially consistent, as it is ordered against mark_linked
+                data_ptr->previous.store(current, std::memory_order_relaxed);
+                if (link->compare_exchange_weak(current, data_ptr, std::memory_order_seq_cst, std::memory_order_acquire))
+                {
+                    return true;
+                }
+            }
+        }
+
+        /**
+         * Freeze the data of the node if its newest version is the expected one, so that no newer version is added.
+         * Only one thread succeeds in freezing the data, and becomes responsible for removing the node.
+         */
+        bool freeze_data(Data *expected)
+        {
+            return data.compare_exchange_strong(expected, with_mark(expected), std::memory_order_acq_rel, std::memory_order_relaxed);
+        }
+
+        /**
+         * Take the exclusive right to prune the old versions of the data, or return false if another write has it.
+         */
+        bool try_lock_pruning()
+        {
+            return (flags.fetch_or(FLAG_PRUNING, std::memory_order_acquire) & FLAG_PRUNING) == 0;
+        }
+
+        void unlock_pruning()
+        {
+            flags.fetch_and(static_cast<uint8_t>(~FLAG_PRUNING), std::memory_order_release);
+        }
+
+        /**
+         * Mark the node as linked at all levels of its tower, after which the tower does not change until the node is removed.
+         * Returns the newest data after marking, so that either it includes a version added by set_data, or the write that
+         * added it sees the node as linked.
+         */
+        Data *mark_linked()
+        {
+            flags.fetch_or(FLAG_LINKED, std::memory_order_seq_cst);
+            return without_mark(data.load(std::memory_order_seq_cst));
+        }
 
-            data = data_ptr;
+        bool is_linked() const
+        {
+            return (flags.load(std::memory_order_seq_cst) & FLAG_LINKED) != 0;
         }
 
         /**
-         * Clear the next pointer of this node.
+         * Clear the next pointers of this node.
          *
          */
         void clear_next()
         {
-            // Since clearing the skip list is not a concurrent operation, we don't need to CAS the next pointer
-            next.store(nullptr, std::memory_order_relaxed);
+            // Since clearing the skip list is not a concurrent operation, we don't need to CAS the next pointers
+            for (size_t level = 0; level < height; ++level)
+            {
+                next[level].store(nullptr, std::memory_order_relaxed);
+            }
         }
 
-        SkipListNode *get_next() const
+        SkipListNode *get_next(size_t level = 0) const
         {
-            return next.load(std::memory_order_relaxed);
+            return without_mark(next[level].load(std::memory_order_acquire));
         }
 
-        SkipListNode *get_down() const
+        Data *get_data() const
         {
-            return down;
+            return without_mark(data.load(std::memory_order_acquire));
         }
 
-        Data *get_data() const
+        /**
+         * Get the newest version of the data with a sequence number up to the given one, or nullptr if there is none.
+         */
+        Data *get_data(uint64_t sequence) const
         {
-            return data;
+            Data *current = get_data();
+            while (current != nullptr && current->sequence > sequence)
+            {
+                current = current->previous.load(std::memory_order_acquire);
+            }
+            return current;
         }
     };
 
@@ -172,7 +445,18 @@ namespace tendb::skip_list
      * Inserting the same key multiple times will update the value, rather than creating duplicate entries.
      * Supports concurrent insertion, deletion and reading.
      * Creating and destroying (clearing) the skip list is not thread-safe.
-     * Memory allocated during the lifetime of the skip list is not freed until the skip list is destroyed.
+     * Versions of a key that are replaced by a newer version, and not seen by any snapshot, are retired and freed with
+     * epoch-based reclamation. Other memory allocated during the lifetime of the skip list is not freed until the skip list is destroyed.
+     * Data returned by get, get_data and seek stays valid only while the caller holds a guard from pin(), as the data of
+     * a key may be freed once it is replaced. Iterators hold a guard of their own.
+     *
+     * Deleted keys are removed from the skip list, so searches only pass live keys. Unless tombstones are kept, a delete
+     * unlinks the node of the key at every level, and retires it along with its data, once no snapshot sees an older version.
+     * A skip list that is written out to replace older data, like a memtable, keeps its tombstones instead.
+     *
+     * Every write gets the next sequence number, and adds a version to its key rather than overwriting the data in place.
+     * A snapshot is the highest sequence number up to which all writes are visible. Reads and iterators at a snapshot
+     * see the newest version of every key at that sequence number, so a scan is consistent while writes continue.
      */
     struct SkipList
     {
@@ -181,32 +465,48 @@ namespace tendb::skip_list
         constexpr static std::size_t MAX_LEVEL = MAX_HEIGHT - 1; // The maximum (top) level index, where level 0 is the bottom level (data level)
         constexpr static std::double_t BRANCH_PROBABILITY = 0.5; // The probability of branching to the next level when inserting a new node
 
-        // Heads of the skip list at each level
-        // The index corresponds to the level, with 0 being the bottom level
-        std::array<SkipListNode *, MAX_HEIGHT> heads;
+        // Head of the skip list, a node without data with a tower of the maximum height
+        // The level index starts at 0 for the bottom level
+        SkipListNode *head;
 
         // Allocator to manage memory for nodes and data
-        // Using the CoreLocalShardAllocator gives performant multi-threaded allocations
-        CoreLocalShardAllocator allocator;
+        // Using the CoreLocalShardAllocator gives performant multi-threaded allocations, and reclaims replaced data
+        mutable CoreLocalShardAllocator allocator;
+
+        constexpr static std::size_t COMPLETION_RING_SIZE = 4096; // Writes that can be linked ahead of the oldest unfinished write
+
+        // Writes take sequence numbers from last_sequence, and mark them in the completion ring once they are linked
+        // visible_sequence only advances over sequence numbers that are marked, so a snapshot never includes a write that is
+        // still being linked, and reads at the snapshot are repeatable
+        // Whichever write completes the sequence advances it, so writes do not wait for each other
+        std::atomic<uint64_t> last_sequence{0};
+        std::atomic<uint64_t> visible_sequence{0};
+        std::unique_ptr<std::atomic<uint64_t>[]> completed{new std::atomic<uint64_t>[COMPLETION_RING_SIZE]{}};
+
+        // Sequence numbers of the live snapshots, whose versions are kept when newer versions replace them
+        // Writes prune versions below the oldest snapshot, or below the visible sequence when there is none, and skip pruning
+        // while a snapshot is being taken, as the snapshot may not have read the visible sequence yet
+        std::mutex snapshot_mutex;
+        std::multiset<uint64_t> snapshots;
+        std::atomic<uint64_t> oldest_snapshot{Snapshot::LATEST};
+        std::atomic<uint32_t> registering_snapshots{0};
+
+        bool keep_tombstones; // Whether deleted keys stay in the skip list as tombstones, rather than being removed
+
+        friend struct Snapshot;
 
     public:
-        SkipList()
-        {
-            // Initialize the heads of the skip list
-            // All head nodes point down to the next level, except for the bottom level (level 0)
+        using Guard = CoreLocalShardAllocator::Guard;
 
-            for (std::size_t i = 0; i < MAX_HEIGHT; ++i)
-            {
-                char *memory = allocator.allocate(sizeof(SkipListNode));
-                if (i == 0)
-                {
-                    heads[i] = new (memory) SkipListNode{nullptr, nullptr, nullptr};
-                }
-                else
-                {
-                    heads[i] = new (memory) SkipListNode{nullptr, nullptr, heads[i - 1]};
-                }
-            }
+        /**
+         * Create an empty skip list.
+         * With keep_tombstones, deleted keys stay as tombstones, which iterators that include deleted keys visit.
+         */
+        explicit SkipList(bool keep_tombstones = false) : keep_tombstones(keep_tombstones)
+        {
+            // Initialize the head of the skip list, which is part of every level
+            char *memory = allocator.allocate(SkipListNode::size(MAX_HEIGHT));
+            head = new (memory) SkipListNode{nullptr, MAX_HEIGHT};
         }
 
         SkipList(const SkipList &) = delete;            // Disallow copy construction
@@ -220,8 +520,11 @@ namespace tendb::skip_list
         {
             if (this != &other)
             {
-                heads = std::move(other.heads);
-                other.heads.fill(nullptr);
+                head = std::exchange(other.head, nullptr);
+                last_sequence.store(other.last_sequence.load());
+                visible_sequence.store(other.visible_sequence.load());
+                completed = std::move(other.completed);
+                keep_tombstones = other.keep_tombstones;
             }
         }
 
@@ -233,8 +536,11 @@ namespace tendb::skip_list
         {
             if (this != &other)
             {
-                heads = std::move(other.heads);
-                other.heads.fill(nullptr);
+                head = std::exchange(other.head, nullptr);
+                last_sequence.store(other.last_sequence.load());
+                visible_sequence.store(other.visible_sequence.load());
+                completed = std::move(other.completed);
+                keep_tombstones = other.keep_tombstones;
             }
             return *this;
         }
@@ -244,8 +550,8 @@ namespace tendb::skip_list
          */
         ~SkipList()
         {
-            // Make the skip list unusable by clearing the heads
-            heads.fill(nullptr);
+            // Make the skip list unusable by clearing the head
+            head = nullptr;
         }
 
         /**
@@ -254,29 +560,22 @@ namespace tendb::skip_list
          */
         void clear()
         {
-            for (std::size_t i = 0; i < MAX_HEIGHT; ++i)
-            {
-                // Clear from the top level down to the bottom
-                // This ensures that we do not access deleted nodes
-                size_t level = MAX_LEVEL - i;
-
-                // Reset the head node at this level
-                heads[level]->clear_next();
-            }
+            // Reset the head node at every level
+            head->clear_next();
         }
 
         /**
          * Delete a key from the skip list.
-         * Iterators that are currently at the deleted key will still be able to read the data.
+         * The value is replaced by a tombstone, which is also inserted if the key does not exist yet.
+         * Unless the skip list keeps tombstones, the key is then removed, once no snapshot sees an older version of it.
+         * Iterators that are currently at the deleted key will see the tombstone.
          * Thread-safe: this method can be called concurrently with other thread-safe operations on the skip list.
          */
         void del(std::string_view key)
         {
             ZoneScoped;
 
-            const SkipListNode *current = find_node(key);
-            Data *data = current->get_data();
-            data->mark_deleted();
+            insert(key, std::string_view(), true);
         }
 
         /**
@@ -288,70 +587,7 @@ namespace tendb::skip_list
         {
             ZoneScoped;
 
-            // Allocate memory for the new data
-            char *memory = allocator.allocate(Data::size(key, value));
-            Data *data = new (memory) Data{key, value};
-
-            // Find the approximate path to insert the new node
-            std::array<SkipListNode *, MAX_HEIGHT> path_to_bottom = find_approximate_path(data->key());
-
-            // Insert the new node at each level from 0 to a random level
-            size_t level = random_level();
-            SkipListNode *down_node = nullptr;
-
-            for (size_t i = 0; i <= level; ++i)
-            {
-                // The path is built in reverse order (top to bottom), so we need to access it from the end (bottom)
-                size_t path_index = MAX_LEVEL - i;
-
-                SkipListNode *new_node;
-                bool succeeded = false;
-                while (!succeeded)
-                {
-                    SkipListNode *prev = path_to_bottom[path_index];
-                    SkipListNode *prev_next = prev->get_next();
-
-                    // Check that the new node's key is less than the next node's key
-                    // During concurrent inserts, another thread may have inserted a node with a key less than the current key
-                    if (prev_next != nullptr && key.compare(prev_next->get_data()->key()) >= 0)
-                    {
-                        // The next node's key is greater than or equal to the current key, so we cannot insert here
-                        // We need to find the correct position again, starting from the new previous node
-
-                        SkipListNode *current = prev_next;
-                        SkipListNode *next_node;
-                        while ((next_node = current->get_next()) != nullptr && key.compare(next_node->get_data()->key()) >= 0)
-                        {
-                            current = next_node;
-                        }
-                        path_to_bottom[path_index] = current;
-                    }
-                    else
-                    {
-                        // We found a valid position to insert the new node
-
-                        // First check if the key already exists
-                        if (i == 0 && prev->get_data() != nullptr && key.compare(prev->get_data()->key()) == 0)
-                        {
-                            // Key already exists, update the value
-                            prev->set_data(data);
-
-                            // No need to propagate up, just return
-                            return;
-                        }
-
-                        char *memory = allocator.allocate(sizeof(SkipListNode));
-                        new_node = new (memory) SkipListNode{data, nullptr, down_node};
-
-                        // Try to set the next pointer of the previous node
-                        new_node->override_next(prev_next);
-                        succeeded = path_to_bottom[path_index]->set_next(new_node, prev_next);
-                    }
-                }
-
-                // Before we move up to the next level, set the down pointer of the new node
-                down_node = new_node;
-            }
+            insert(key, value, false);
         }
 
         /**
@@ -359,17 +595,51 @@ namespace tendb::skip_list
          */
         bool is_empty() const
         {
-            return heads[0] == nullptr || heads[0]->get_next() == nullptr;
+            return head == nullptr || head->get_next() == nullptr;
+        }
+
+        /**
+         * Pin the memory of the skip list, so that data that is reachable now is not freed while the guard is held.
+         * Thread-safe: this method can be called concurrently with other thread-safe operations on the skip list.
+         */
+        Guard pin() const
+        {
+            return allocator.pin();
+        }
+
+        /**
+         * Take a snapshot of the skip list, which includes all writes that have completed.
+         * Thread-safe: this method can be called concurrently with other thread-safe operations on the skip list.
+         */
+        Snapshot snapshot()
+        {
+            // Announce the snapshot before reading the visible sequence, so that concurrent writes do not prune versions it sees
+            registering_snapshots.fetch_add(1, std::memory_order_seq_cst);
+            uint64_t sequence = visible_sequence.load(std::memory_order_seq_cst);
+            {
+                std::lock_guard<std::mutex> lock(snapshot_mutex);
+                snapshots.insert(sequence);
+                oldest_snapshot.store(*snapshots.begin(), std::memory_order_seq_cst);
+            }
+            registering_snapshots.fetch_sub(1, std::memory_order_seq_cst);
+            return Snapshot(this, sequence);
         }
 
         /**
          * Iterator for the skip list.
+         * The iterator pins the memory of the skip list, so the data it returns stays valid until it is destroyed.
          */
         struct Iterator
         {
             const SkipListNode *current;
+            bool include_deleted; // Whether tombstones are visited, rather than skipped
+            uint64_t sequence;    // Sequence number of the snapshot that the iterator reads at
 
-            Iterator(const SkipListNode *node) : current(node) {}
+            Iterator(const SkipListNode *node, bool include_deleted = false, uint64_t sequence = Snapshot::LATEST, Guard guard = Guard())
+                : current(node), include_deleted(include_deleted), sequence(sequence), guard(std::move(guard))
+            {
+                skip_deleted();
+            }
 
             bool operator!=(const Iterator &other) const
             {
@@ -383,7 +653,7 @@ namespace tendb::skip_list
 
             /**
              * Increment the iterator to the next valid node.
-             * This skips over deleted nodes.
+             * This skips over deleted nodes, unless the iterator includes them, and nodes that were inserted after the snapshot.
              * If the current node is deleted after incrementing, the deleted data will remain accessible.
              * Thread-safe: this method can be called concurrently with other thread-safe operations on the skip list.
              */
@@ -393,32 +663,58 @@ namespace tendb::skip_list
                 {
                     current = current->get_next();
                 }
-                while (current != nullptr && current->get_data()->is_deleted())
-                {
-                    current = current->get_next();
-                }
+                skip_deleted();
 
                 return *this;
             }
 
             Data *operator*() const
             {
-                return current->get_data();
+                return current->get_data(sequence);
             }
 
             Data *operator->() const
             {
-                return current->get_data();
+                return current->get_data(sequence);
+            }
+
+        private:
+            Guard guard;
+
+            void skip_deleted()
+            {
+                while (current != nullptr)
+                {
+                    const Data *data = current->get_data(sequence);
+                    if (data != nullptr && (include_deleted || !data->is_deleted()))
+                    {
+                        break;
+                    }
+                    current = current->get_next();
+                }
             }
         };
 
         /**
          * Return an iterator to the beginning of the skip list.
+         * With include_deleted, the iterator also visits tombstones, for example to write them out along with the values.
+         * Thread-safe: this method can be called concurrently with other thread-safe operations on the skip list.
+         */
+        Iterator begin(bool include_deleted = false) const
+        {
+            Guard guard = pin();
+            return Iterator(head->get_next(), include_deleted, Snapshot::LATEST, std::move(guard));
+        }
+
+        /**
+         * Return an iterator to the beginning of the skip list, which reads the skip list as of the snapshot.
+         * The snapshot must outlive the iterator.
          * Thread-safe: this method can be called concurrently with other thread-safe operations on the skip list.
          */
-        Iterator begin() const
+        Iterator begin(const Snapshot &snapshot, bool include_deleted = false) const
         {
-            return Iterator(heads[0]->get_next());
+            Guard guard = pin();
+            return Iterator(head->get_next(), include_deleted, snapshot.sequence, std::move(guard));
         }
 
         /**
@@ -437,36 +733,433 @@ namespace tendb::skip_list
          * Thread-safe: this method can be called concurrently with other thread-safe operations on the skip list.
          */
         Iterator seek(std::string_view key) const
+        {
+            return seek_at(key, Snapshot::LATEST);
+        }
+
+        /**
+         * Seek for a key in the skip list as of the snapshot.
+         * Thread-safe: this method can be called concurrently with other thread-safe operations on the skip list.
+         */
+        Iterator seek(std::string_view key, const Snapshot &snapshot) const
+        {
+            return seek_at(key, snapshot.sequence);
+        }
+
+        /**
+         * Get the value associated with a key in the skip list.
+         * The value is only guaranteed to stay valid while the caller holds a guard from pin().
+         * Thread-safe: this method can be called concurrently with other thread-safe operations on the skip list.
+         */
+        std::optional<std::string_view> get(std::string_view key) const
+        {
+            return get_at(key, Snapshot::LATEST);
+        }
+
+        /**
+         * Get the value associated with a key in the skip list as of the snapshot.
+         * The value stays valid while the snapshot exists.
+         * Thread-safe: this method can be called concurrently with other thread-safe operations on the skip list.
+         */
+        std::optional<std::string_view> get(std::string_view key, const Snapshot &snapshot) const
+        {
+            return get_at(key, snapshot.sequence);
+        }
+
+        /**
+         * Get the data of a key in the skip list, which is a tombstone if the key is deleted but not removed yet.
+         * Returns nullptr if the key was never inserted, or is removed.
+         * The data is only guaranteed to stay valid while the caller holds a guard from pin().
+         * Thread-safe: this method can be called concurrently with other thread-safe operations on the skip list.
+         */
+        const Data *get_data(std::string_view key) const
+        {
+            return get_data_at(key, Snapshot::LATEST);
+        }
+
+        /**
+         * Get the data of a key in the skip list as of the snapshot.
+         * Returns nullptr if the key was not inserted before the snapshot, or is removed.
+         * Thread-safe: this method can be called concurrently with other thread-safe operations on the skip list.
+         */
+        const Data *get_data(std::string_view key, const Snapshot &snapshot) const
+        {
+            return get_data_at(key, snapshot.sequence);
+        }
+
+        /**
+         * Bytes of memory held by the skip list, including memory that is free for reuse.
+         */
+        size_t get_memory_usage() const
+        {
+            return allocator.get_memory_usage();
+        }
+
+    private:
+        /**
+         * Insert a key with a value or a tombstone into the skip list, replacing the data of the key if it already exists.
+         */
+        void insert(std::string_view key, std::string_view value, bool deleted)
         {
             ZoneScoped;
 
-            const SkipListNode *current = find_node(key);
-            Data *data = current->get_data();
-            if (data != nullptr && !data->is_deleted() && key.compare(data->key()) == 0)
+            // Versions that the search passes may be retired by concurrent writes to the same keys
+            Guard guard = pin();
+
+            // Allocate memory for the new data
+            char *memory = allocator.allocate(Data::size(key, value));
+            Data *data = new (memory) Data{key, value, deleted};
+
+            // Find the approximate path to insert the new node
+            uint64_t key_prefix = SkipListNode::prefix(key);
+            std::array<SkipListNode *, MAX_HEIGHT> path = find_approximate_path(key, key_prefix);
+
+            // Insert the new node at each level from 0 to a random level
+            size_t height = random_level() + 1;
+
+            // Take the sequence number right before linking the data, and publish it even if linking fails,
+            // as later writes wait for it to be published
+            data->sequence = last_sequence.fetch_add(1, std::memory_order_relaxed) + 1;
+            SkipListNode *node;
+            bool is_new;
+            try
+            {
+                node = link_node(path[0], data, key_prefix, height, is_new);
+            }
+            catch (...)
             {
-                return Iterator(current);
+                publish(data->sequence);
+                throw;
             }
+            publish(data->sequence);
 
-            return end();
+            if (!is_new)
+            {
+                // Key already exists, so the node is already linked at all of its levels, and the new version may replace old ones
+                prune(node);
+                if (deleted)
+                {
+                    remove(node);
+                }
+                return;
+            }
+
+            // The upper levels only speed up searches, so they are linked after the write is visible
+            for (size_t level = 1; level < height; ++level)
+            {
+                link_level(path[level], node, level);
+            }
+
+            // A node is only removed once its tower is complete, so a delete that arrived in the meantime is finished here
+            if (node->mark_linked()->is_deleted())
+            {
+                remove(node);
+            }
         }
 
         /**
-         * Get the value associated with a key in the skip list.
-         * Thread-safe: this method can be called concurrently with other thread-safe operations on the skip list.
+         * Remove a node whose newest version is a tombstone from every level, and retire it along with its data.
+         * Nothing is removed if the skip list keeps tombstones, if the tower of the node is still being linked, or if a
+         * snapshot sees an older version of the key; the tombstone then stays until a later write to the key.
          */
-        std::optional<std::string_view> get(std::string_view key) const
+        void remove(SkipListNode *node)
         {
             ZoneScoped;
 
-            auto it = seek(key);
-            if (it != end())
+            if (keep_tombstones || !node->is_linked())
+            {
+                return;
+            }
+
+            Data *data = node->get_data();
+            if (!data->is_deleted())
+            {
+                return;
+            }
+
+            // Once the tombstone is visible, every older write to the key is linked, so none can be added below the tombstone
+            while (visible_sequence.load(std::memory_order_seq_cst) < data->sequence)
             {
-                return it->value();
+                std::this_thread::yield();
+            }
+            if (registering_snapshots.load(std::memory_order_seq_cst) != 0 || oldest_snapshot.load(std::memory_order_seq_cst) < data->sequence)
+            {
+                return;
+            }
+
+            // Only the write that freezes the data removes the node; writes to the key now link a new node after it instead
+            if (!node->freeze_data(data))
+            {
+                return;
+            }
+
+            // Once the search has passed the key, no level links to the node anymore
+            node->mark_removed();
+            unlink_removed(data->key(), node->get_key_prefix());
+
+            // A write may still be pruning old versions of the data, so wait for it to finish
+            while (!node->try_lock_pruning())
+            {
+                std::this_thread::yield();
+            }
+            for (Data *version = data; version != nullptr;)
+            {
+                Data *older = version->previous.load(std::memory_order_acquire);
+                allocator.retire(reinterpret_cast<char *>(version), version->allocation_size());
+                version = older;
+            }
+            allocator.retire(reinterpret_cast<char *>(node), SkipListNode::size(node->get_height()));
+        }
+
+        /**
+         * Retire the versions of a node that no reader needs anymore.
+         * Readers at the latest data see the newest visible version or a newer one, and readers at a snapshot see the newest
+         * version up to the snapshot, so every other version below the newest visible one is unlinked and retired.
+         * Writes only link versions above the newest visible one, so the versions below it are only changed by pruning.
+         */
+        void prune(SkipListNode *node)
+        {
+            ZoneScoped;
+
+            uint64_t horizon = visible_sequence.load(std::memory_order_seq_cst);
+            if (registering_snapshots.load(std::memory_order_seq_cst) != 0)
+            {
+                return;
+            }
+
+            // Another write is already pruning the node, and the versions it leaves behind are pruned by later writes
+            if (!node->try_lock_pruning())
+            {
+                return;
+            }
+
+            Data *detached = nullptr;         // Chain of versions that are all unlinked, down to the oldest
+            std::vector<Data *> unlinked;     // Single versions that are unlinked from between kept versions
+            Data *kept = node->get_data(horizon);
+            if (kept != nullptr && oldest_snapshot.load(std::memory_order_seq_cst) >= kept->sequence)
+            {
+                // No snapshot sees an older version
+                detached = kept->previous.load(std::memory_order_acquire);
+                kept->previous.store(nullptr, std::memory_order_release);
+            }
+            else if (kept != nullptr)
+            {
+                std::lock_guard<std::mutex> lock(snapshot_mutex);
+
+                // A version is kept if a snapshot falls between its sequence number and the sequence number of the version above it
+                uint64_t above = kept->sequence;
+                Data *current = kept->previous.load(std::memory_order_acquire);
+                while (current != nullptr)
+                {
+                    Data *older = current->previous.load(std::memory_order_acquire);
+                    auto snapshot = snapshots.lower_bound(current->sequence);
+                    if (snapshot != snapshots.end() && *snapshot < above)
+                    {
+                        kept->previous.store(current, std::memory_order_release);
+                        kept = current;
+                    }
+                    else
+                    {
+                        unlinked.push_back(current);
+                    }
+                    above = current->sequence;
+                    current = older;
+                }
+                kept->previous.store(nullptr, std::memory_order_release);
+            }
+            node->unlock_pruning();
+
+            // Readers that already reached an unlinked version can still follow it to older versions until they unpin
+            while (detached != nullptr)
+            {
+                Data *older = detached->previous.load(std::memory_order_acquire);
+                allocator.retire(reinterpret_cast<char *>(detached), detached->allocation_size());
+                detached = older;
+            }
+            for (Data *old : unlinked)
+            {
+                allocator.retire(reinterpret_cast<char *>(old), old->allocation_size());
+            }
+        }
+
+        /**
+         * Forget a snapshot, so that the versions only it sees can be pruned.
+         */
+        void release_snapshot(uint64_t sequence)
+        {
+            std::lock_guard<std::mutex> lock(snapshot_mutex);
+            snapshots.erase(snapshots.find(sequence));
+            oldest_snapshot.store(snapshots.empty() ? Snapshot::LATEST : *snapshots.begin(), std::memory_order_seq_cst);
+        }
+
+        Iterator seek_at(std::string_view key, uint64_t sequence) const
+        {
+            ZoneScoped;
+
+            Guard guard = pin();
+            const SkipListNode *node = find_node(key);
+            const Data *data = node->get_data(sequence);
+            if (data != nullptr && key.compare(data->key()) == 0 && !data->is_deleted())
+            {
+                return Iterator(node, false, sequence, std::move(guard));
+            }
+
+            return end();
+        }
+
+        std::optional<std::string_view> get_at(std::string_view key, uint64_t sequence) const
+        {
+            ZoneScoped;
+
+            const Data *data = get_data_at(key, sequence);
+            if (data != nullptr && !data->is_deleted())
+            {
+                return data->value();
             }
             return std::nullopt;
         }
 
-    private:
+        const Data *get_data_at(std::string_view key, uint64_t sequence) const
+        {
+            ZoneScoped;
+
+            // The guard only covers the search, as the versions passed on the way may be retired meanwhile
+            Guard guard = pin();
+            const SkipListNode *node = find_node(key);
+            const Data *data = node->get_data(sequence);
+            if (data != nullptr && key.compare(data->key()) == 0)
+            {
+                return data;
+            }
+            return nullptr;
+        }
+
+        /**
+         * Link a new node with the data into the bottom level, after the given node or after the nodes that were inserted after it in the meantime.
+         * If the key already exists, the data is added as a new version of the existing node, which is returned with is_new set to false.
+         * If that node is being removed, the new node is linked after it instead.
+         */
+        SkipListNode *link_node(SkipListNode *prev, Data *data, uint64_t key_prefix, size_t height, bool &is_new)
+        {
+            std::string_view key = data->key();
+            SkipListNode *new_node = nullptr;
+            is_new = true;
+            while (true)
+            {
+                // Nodes cannot be linked after a removed node, so the position is searched again, which unlinks the removed node
+                if (prev->is_removed())
+                {
+                    prev = find_approximate_path(key, key_prefix)[0];
+                    continue;
+                }
+
+                SkipListNode *prev_next = prev->get_next();
+
+                // Check that the new node's key is less than the next node's key
+                // During concurrent inserts, another thread may have inserted a node with a key less than the current key
+                if (prev_next != nullptr && prev_next->compare(key, key_prefix) >= 0)
+                {
+                    // The next node's key is less than or equal to the current key, so we cannot insert here
+                    // We need to find the correct position again, starting from the new previous node
+                    SkipListNode *next_node;
+                    prev = prev_next;
+                    while ((next_node = prev->get_next()) != nullptr && next_node->compare(key, key_prefix) >= 0)
+                    {
+                        prev = next_node;
+                    }
+                    continue;
+                }
+
+                // We found a valid position to insert the new node
+                // First check if the key already exists
+                if (prev != head && prev->compare(key, key_prefix) == 0 && prev->set_data(data))
+                {
+                    if (new_node != nullptr)
+                    {
+                        // Another write linked a node for the key after a removed one, so the node made for it is not needed
+                        allocator.deallocate(reinterpret_cast<char *>(new_node), SkipListNode::size(height));
+                    }
+                    is_new = false;
+                    return prev;
+                }
+
+                if (new_node == nullptr)
+                {
+                    char *memory = allocator.allocate(SkipListNode::size(height));
+                    new_node = new (memory) SkipListNode{data, height};
+                }
+
+                // Try to set the next pointer of the previous node
+                new_node->override_next(0, prev_next);
+                if (prev->set_next(0, new_node, prev_next))
+                {
+                    return new_node;
+                }
+            }
+        }
+
+        /**
+         * Link a node that is already linked at the bottom level into a level above, after the given node or after the nodes
+         * that were inserted after it in the meantime.
+         */
+        void link_level(SkipListNode *prev, SkipListNode *node, size_t level)
+        {
+            std::string_view key = node->get_data()->key();
+            uint64_t key_prefix = node->get_key_prefix();
+            while (true)
+            {
+                if (prev->is_removed(level))
+                {
+                    prev = find_approximate_path(key, key_prefix)[level];
+                    continue;
+                }
+
+                SkipListNode *prev_next = prev->get_next(level);
+                if (prev_next != nullptr && prev_next->compare(key, key_prefix) >= 0)
+                {
+                    SkipListNode *next_node;
+                    prev = prev_next;
+                    while ((next_node = prev->get_next(level)) != nullptr && next_node->compare(key, key_prefix) >= 0)
+                    {
+                        prev = next_node;
+                    }
+                    continue;
+                }
+
+                node->override_next(level, prev_next);
+                if (prev->set_next(level, node, prev_next))
+                {
+                    return;
+                }
+            }
+        }
+
+        /**
+         * Mark a write as linked, and make it visible to snapshots once all writes with lower sequence numbers are linked.
+         */
+        void publish(uint64_t sequence)
+        {
+            // The slot is reused after COMPLETION_RING_SIZE writes, so a write far ahead waits until the slot's old write is visible
+            // The writes before it already have their sequence numbers and are only linking their data, which does not block
+            while (sequence - visible_sequence.load(std::memory_order_acquire) > COMPLETION_RING_SIZE)
+            {
+                std::this_thread::yield();
+            }
+
+            // Sequentially consistent, so that of two writes that finish at the same time, at least one sees the other's mark
+            completed[sequence % COMPLETION_RING_SIZE].store(sequence, std::memory_order_seq_cst);
+
+            uint64_t visible = visible_sequence.load(std::memory_order_seq_cst);
+            while (completed[(visible + 1) % COMPLETION_RING_SIZE].load(std::memory_order_seq_cst) == visible + 1)
+            {
+                // On failure, another write advanced the sequence, and visible is reloaded to continue from there
+                if (visible_sequence.compare_exchange_weak(visible, visible + 1, std::memory_order_seq_cst))
+                {
+                    ++visible;
+                }
+            }
+        }
+
         /**
          * Generate a random level for the new node.
          */
@@ -487,22 +1180,18 @@ namespace tendb::skip_list
         {
             ZoneScoped;
 
-            // Traverse the skip list from the top level down to the bottom
-            const SkipListNode *current = heads[MAX_LEVEL];
-            for (size_t i = 0; i < MAX_HEIGHT; i++)
+            // Traverse the skip list from the top level down to the bottom, where every level continues from the same node
+            uint64_t key_prefix = SkipListNode::prefix(key);
+            const SkipListNode *current = head;
+            for (size_t level = MAX_HEIGHT; level-- > 0;)
             {
                 const SkipListNode *next_node;
 
-                // Move right in the current level until we find a node with a key greater than or equal to the target key
-                while ((next_node = current->get_next()) != nullptr && key.compare(next_node->get_data()->key()) >= 0)
+                // Move right in the current level until we find a node with a key greater than the target key
+                while ((next_node = current->get_next(level)) != nullptr && next_node->compare(key, key_prefix) >= 0)
                 {
                     current = next_node;
                 }
-
-                if (i < MAX_LEVEL)
-                {
-                    current = current->get_down();
-                }
             }
 
             return current;
@@ -510,46 +1199,115 @@ namespace tendb::skip_list
 
         /**
          * Find the approximate path to a node with the given key in the skip list.
-         * The path is an array of nodes at each level, starting from the top level down to the bottom.
-         * At each level of the path, the node is the last node that has a key less than the target key.
+         * The path is an array of nodes at each level, indexed by the level.
+         * At each level of the path, the node is the last node that has a key less than or equal to the target key.
          * The path is considered "approximate", because during concurrent inserts, the actual path may change.
+         * Removed nodes that the search passes are unlinked.
+         */
+        std::array<SkipListNode *, MAX_HEIGHT> find_approximate_path(std::string_view key, uint64_t key_prefix)
+        {
+            return find_path(key, key_prefix, true);
+        }
+
+        /**
+         * Find the path to the nodes with the given key, where at each level the node is the last node with a key less than the target key.
          */
-        std::array<SkipListNode *, MAX_HEIGHT> find_approximate_path(std::string_view key) const
+        std::array<SkipListNode *, MAX_HEIGHT> find_path_before(std::string_view key, uint64_t key_prefix)
+        {
+            return find_path(key, key_prefix, false);
+        }
+
+        std::array<SkipListNode *, MAX_HEIGHT> find_path(std::string_view key, uint64_t key_prefix, bool inclusive)
         {
             ZoneScoped;
 
-            // Find the approximate position to insert the new nodes at each level
+            // Find the approximate position to insert the new node at each level
             // The actual position can change due to concurrent inserts, which we will handle later
-            std::array<SkipListNode *, MAX_HEIGHT> path_to_bottom;
-            SkipListNode *current = heads[MAX_LEVEL];
-            SkipListNode *next_node;
-            for (size_t i = 0; i < MAX_HEIGHT; i++)
+            std::array<SkipListNode *, MAX_HEIGHT> path;
+            bool done = false;
+            while (!done)
             {
-                ZoneScoped;
-
-                while (key_is_after_node(key, next_node = current->get_next()))
+                // The search starts over if it finds itself on a removed node
+                SkipListNode *current = head;
+                done = true;
+                for (size_t level = MAX_HEIGHT; level-- > 0;)
                 {
-                    current = next_node;
+                    ZoneScoped;
+
+                    current = move_right(current, key, key_prefix, level, inclusive);
+                    if (current == nullptr)
+                    {
+                        done = false;
+                        break;
+                    }
+                    path[level] = current;
                 }
-                path_to_bottom[i] = current;
-                current = current->get_down();
             }
-            return path_to_bottom;
+            return path;
         }
 
-        static bool key_is_after_node(std::string_view key, const SkipListNode *node)
+        /**
+         * Unlink the removed nodes with the given key from every level.
+         * Once this returns, no level links to a node with the key that was marked as removed before the call.
+         */
+        void unlink_removed(std::string_view key, uint64_t key_prefix)
         {
             ZoneScoped;
 
-            if (node == nullptr)
+            bool done = false;
+            while (!done)
             {
-                return false;
+                // Start before the key at every level, so that all nodes with the key are passed
+                std::array<SkipListNode *, MAX_HEIGHT> path = find_path_before(key, key_prefix);
+                done = true;
+                for (size_t level = 0; level < MAX_HEIGHT && done; level++)
+                {
+                    done = move_right(path[level], key, key_prefix, level, true) != nullptr;
+                }
             }
+        }
 
-            return key.compare(node->get_data()->key()) >= 0;
+        /**
+         * Move right from a node at a level while the key is after the next node, or equal to it with inclusive, and unlink
+         * the removed nodes on the way.
+         * Returns nullptr if the node itself turns out to be removed, as removed nodes cannot be unlinked from it, and the
+         * search has to start over.
+         */
+        SkipListNode *move_right(SkipListNode *current, std::string_view key, uint64_t key_prefix, size_t level, bool inclusive)
+        {
+            while (true)
+            {
+                SkipListNode *next_node = current->get_next(level);
+                if (next_node == nullptr)
+                {
+                    return current;
+                }
 
-            // const std::string_view node_key = node->get_data()->key();
-            // return *(key.data()) >= *(node_key.data()) && key.compare(node_key) >= 0;
+                if (next_node->is_removed(level))
+                {
+                    // On failure, either another node was linked or unlinked after the current one, or the current node was removed
+                    if (!current->unlink_next(level, next_node) && current->is_removed(level))
+                    {
+                        return nullptr;
+                    }
+                    continue;
+                }
+
+                int comparison = next_node->compare(key, key_prefix);
+                if (comparison < 0 || (comparison == 0 && !inclusive))
+                {
+                    return current;
+                }
+                current = next_node;
+            }
         }
     };
+
+    inline Snapshot::~Snapshot()
+    {
+        if (owner != nullptr)
+        {
+            owner->release_snapshot(sequence);
+        }
+    }
 }
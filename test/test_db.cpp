@@ -0,0 +1,704 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "db/db.hpp"
+#include "db/flush.hpp"
+#include "db/write_ahead_log.hpp"
+#include "pbt/reader.hpp"
+#include "pbt/writer.hpp"
+#include "skip_list/skip_list.hpp"
+
+constexpr static size_t TEST_NUM_KEYS = 1000;
+constexpr static size_t BENCHMARK_NUM_KEYS = 100000;
+
+std::vector<std::string> generate_keys_sequence(uint64_t count)
+{
+    std::vector<std::string> keys;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        keys.push_back("key_" + std::to_string(i));
+    }
+    std::sort(keys.begin(), keys.end());
+    return keys;
+}
+
+tendb::DBOptions small_options()
+{
+    // A small memtable, so that tests go through many flushes and compactions
+    tendb::DBOptions options;
+    options.memtable_size = 4096;
+    options.compaction_trigger = 3;
+    options.sync = false;
+    return options;
+}
+
+void check_db(tendb::DB &db, const std::vector<std::string> &keys, const std::map<std::string, std::string> &expected)
+{
+    for (const auto &key : keys)
+    {
+        std::optional<std::string> value = db.get(key);
+        auto itr = expected.find(key);
+        if (itr == expected.end() ? value.has_value() : value != itr->second)
+        {
+            std::cerr << "DB mismatch for key: " << key << std::endl;
+            exit(1);
+        }
+    }
+}
+
+void test_put_get_del()
+{
+    std::string directory = "test_db";
+    std::filesystem::remove_all(directory);
+
+    std::vector<std::string> keys = generate_keys_sequence(TEST_NUM_KEYS);
+    std::map<std::string, std::string> expected;
+    std::mt19937 g(0xC0FFEE);
+    {
+        tendb::DB db(directory, small_options());
+
+        // Overwrite and delete keys in random order, so that versions of a key end up in different runs
+        for (size_t round = 0; round < 3; ++round)
+        {
+            std::vector<std::string> shuffled = keys;
+            std::shuffle(shuffled.begin(), shuffled.end(), g);
+            for (size_t i = 0; i < shuffled.size(); ++i)
+            {
+                if ((i + round) % 5 == 0)
+                {
+                    db.del(shuffled[i]);
+                    expected.erase(shuffled[i]);
+                }
+                else
+                {
+                    std::string value = "value_" + std::to_string(round) + "_" + shuffled[i];
+                    db.put(shuffled[i], value);
+                    expected[shuffled[i]] = value;
+                }
+            }
+            check_db(db, keys, expected);
+        }
+
+        db.flush();
+        check_db(db, keys, expected);
+        db.compact();
+        if (db.get_num_runs() != 1)
+        {
+            std::cerr << "DB has " << db.get_num_runs() << " runs after a full compaction" << std::endl;
+            exit(1);
+        }
+        check_db(db, keys, expected);
+
+        // Deleting every key leaves nothing after a full compaction
+        for (const auto &key : keys)
+        {
+            db.del(key);
+        }
+        db.flush();
+        db.compact();
+        if (db.get_num_runs() != 0)
+        {
+            std::cerr << "DB keeps runs without items after a full compaction" << std::endl;
+            exit(1);
+        }
+        check_db(db, keys, {});
+    }
+
+    std::filesystem::remove_all(directory);
+    std::cout << "test_put_get_del done" << std::endl;
+}
+
+void test_compaction_tiers()
+{
+    std::string directory = "test_db";
+    std::filesystem::remove_all(directory);
+
+    std::vector<std::string> keys = generate_keys_sequence(TEST_NUM_KEYS);
+    std::map<std::string, std::string> expected;
+    {
+        tendb::DB db(directory, small_options());
+        for (const auto &key : keys)
+        {
+            db.put(key, key);
+            expected[key] = key;
+        }
+        db.flush();
+        db.compact();
+
+        // Small runs on top of a large one are compacted among themselves, and the large run is left alone
+        for (size_t i = 0; i < 3; ++i)
+        {
+            db.put(keys[i], "small_" + keys[i]);
+            expected[keys[i]] = "small_" + keys[i];
+            db.flush();
+        }
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (db.get_num_runs() > 2 && std::chrono::steady_clock::now() < deadline)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (db.get_num_runs() != 2)
+        {
+            std::cerr << "DB has " << db.get_num_runs() << " runs instead of the large run and the compacted small runs" << std::endl;
+            exit(1);
+        }
+        check_db(db, keys, expected);
+    }
+
+    std::filesystem::remove_all(directory);
+    std::cout << "test_compaction_tiers done" << std::endl;
+}
+
+void test_background_error()
+{
+    std::string directory = "test_db";
+    std::filesystem::remove_all(directory);
+
+    std::vector<std::string> keys = generate_keys_sequence(TEST_NUM_KEYS);
+    std::map<std::string, std::string> expected;
+    {
+        tendb::DB db(directory, small_options());
+        db.put(keys[0], keys[0]);
+        expected[keys[0]] = keys[0];
+
+        // A directory in place of the run of the first memtable makes its flush fail
+        std::filesystem::path obstacle = std::filesystem::path(directory) / "1.pbt";
+        std::filesystem::create_directory(obstacle);
+        try
+        {
+            db.flush();
+            std::cerr << "DB flush did not report its error" << std::endl;
+            exit(1);
+        }
+        catch (const std::runtime_error &)
+        {
+        }
+
+        // The store keeps taking writes, and the flush succeeds once the cause is gone
+        db.put(keys[1], keys[1]);
+        expected[keys[1]] = keys[1];
+        std::filesystem::remove(obstacle);
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (true)
+        {
+            try
+            {
+                db.flush();
+                break;
+            }
+            catch (const std::runtime_error &)
+            {
+                if (std::chrono::steady_clock::now() > deadline)
+                {
+                    std::cerr << "DB flush was not retried after it failed" << std::endl;
+                    exit(1);
+                }
+            }
+        }
+        if (db.get_num_runs() != 2)
+        {
+            std::cerr << "DB has " << db.get_num_runs() << " runs after the flushes were retried" << std::endl;
+            exit(1);
+        }
+        check_db(db, keys, expected);
+    }
+    {
+        tendb::DB db(directory, small_options());
+        check_db(db, keys, expected);
+    }
+
+    std::filesystem::remove_all(directory);
+    std::cout << "test_background_error done" << std::endl;
+}
+
+void test_reopen()
+{
+    std::string directory = "test_db";
+    std::filesystem::remove_all(directory);
+
+    std::vector<std::string> keys = generate_keys_sequence(TEST_NUM_KEYS);
+    std::map<std::string, std::string> expected;
+    {
+        tendb::DB db(directory, small_options());
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            if (i % 3 == 0)
+            {
+                db.del(keys[i]);
+            }
+            else
+            {
+                db.put(keys[i], keys[i]);
+                expected[keys[i]] = keys[i];
+            }
+        }
+    }
+
+    // A file left behind by an interrupted flush is removed when opening
+    std::string leftover = (std::filesystem::path(directory) / "999999.pbt").string();
+    std::ofstream(leftover) << "incomplete";
+
+    {
+        tendb::DB db(directory, small_options());
+        check_db(db, keys, expected);
+        if (std::filesystem::exists(leftover))
+        {
+            std::cerr << "DB did not remove a file missing from the manifest" << std::endl;
+            exit(1);
+        }
+
+        db.put(keys[0], "reopened");
+        expected[keys[0]] = "reopened";
+    }
+    {
+        tendb::DB db(directory, small_options());
+        check_db(db, keys, expected);
+    }
+
+    // Without the manifest, the runs cannot be told apart from garbage, so the store refuses to open rather than remove them
+    std::filesystem::remove(std::filesystem::path(directory) / "MANIFEST");
+    try
+    {
+        tendb::DB db(directory, small_options());
+        std::cerr << "DB opened without its manifest" << std::endl;
+        exit(1);
+    }
+    catch (const std::runtime_error &)
+    {
+    }
+    bool has_runs = false;
+    for (const auto &entry : std::filesystem::directory_iterator(directory))
+    {
+        has_runs |= entry.path().extension() == ".pbt";
+    }
+    if (!has_runs)
+    {
+        std::cerr << "DB removed runs without its manifest" << std::endl;
+        exit(1);
+    }
+
+    std::filesystem::remove_all(directory);
+    std::cout << "test_reopen done" << std::endl;
+}
+
+void test_concurrent()
+{
+    constexpr size_t num_threads = 4;
+
+    std::string directory = "test_db";
+    std::filesystem::remove_all(directory);
+
+    std::vector<std::string> keys = generate_keys_sequence(num_threads * TEST_NUM_KEYS);
+    {
+        tendb::DB db(directory, small_options());
+
+        // Every thread writes its own keys and reads back what it wrote, while the others write theirs
+        auto worker = [&](size_t t)
+        {
+            for (size_t i = t; i < keys.size(); i += num_threads)
+            {
+                db.put(keys[i], keys[i]);
+                std::optional<std::string> value = db.get(keys[i]);
+                if (value != keys[i])
+                {
+                    std::cerr << "DB lost a concurrent write for key: " << keys[i] << std::endl;
+                    exit(1);
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < num_threads; ++t)
+        {
+            threads.emplace_back(worker, t);
+        }
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+
+        std::map<std::string, std::string> expected;
+        for (const auto &key : keys)
+        {
+            expected[key] = key;
+        }
+        check_db(db, keys, expected);
+    }
+
+    std::filesystem::remove_all(directory);
+    std::cout << "test_concurrent done" << std::endl;
+}
+
+void test_flush_skip_list()
+{
+    std::vector<std::string> keys = generate_keys_sequence(TEST_NUM_KEYS);
+
+    // Every third key is deleted, half of them after a put and half without ever being put
+    tendb::skip_list::SkipList table(true);
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        if (i % 3 != 0 || i % 2 == 0)
+        {
+            table.put(keys[i], keys[i]);
+        }
+        if (i % 3 == 0)
+        {
+            table.del(keys[i]);
+        }
+    }
+
+    // Writes go to a newer table while the frozen one is flushed
+    tendb::skip_list::SkipList newer_table(true);
+    auto write_newer = [&]()
+    {
+        for (const auto &key : keys)
+        {
+            newer_table.put(key, "newer");
+        }
+    };
+    std::thread writer_thread(write_newer);
+
+    std::string path = "test.pbt";
+    tendb::pbt::Writer writer(path);
+    uint64_t num_items = tendb::flush_skip_list(table, writer);
+    writer_thread.join();
+
+    tendb::pbt::Reader reader(path);
+    if (num_items != keys.size() || reader.get_header()->num_items != keys.size())
+    {
+        std::cerr << "Flushed " << num_items << " items instead of " << keys.size() << std::endl;
+        exit(1);
+    }
+    size_t i = 0;
+    for (auto itr = reader.begin(); itr != reader.end(); ++itr, ++i)
+    {
+        const tendb::pbt::KeyValueItem *item = *itr;
+        if (item->key() != keys[i] || item->is_tombstone() != (i % 3 == 0) || (!item->is_tombstone() && item->value() != keys[i]))
+        {
+            std::cerr << "Flushed item mismatch for key: " << keys[i] << std::endl;
+            exit(1);
+        }
+    }
+
+    std::filesystem::remove(path);
+    std::cout << "test_flush_skip_list done" << std::endl;
+}
+
+void test_write_ahead_log()
+{
+    constexpr size_t num_threads = 4;
+
+    std::string path = "test.log";
+    std::filesystem::remove(path);
+
+    std::vector<std::string> keys = generate_keys_sequence(num_threads * TEST_NUM_KEYS);
+    {
+        tendb::WriteAheadLog log(path);
+
+        // Concurrent writers share groups; every key is written, then the odd ones are deleted
+        auto worker = [&](size_t t)
+        {
+            for (size_t i = t; i < keys.size(); i += num_threads)
+            {
+                log.add(keys[i], keys[i]);
+                if (i % 2 == 1)
+                {
+                    log.add(keys[i], std::string_view(), true);
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < num_threads; ++t)
+        {
+            threads.emplace_back(worker, t);
+        }
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+        if (log.get_size() != std::filesystem::file_size(path))
+        {
+            std::cerr << "Log size does not match its file" << std::endl;
+            exit(1);
+        }
+    }
+
+    auto check_replay = [&](size_t num_keys)
+    {
+        tendb::skip_list::SkipList table(true);
+        tendb::WriteAheadLog::replay(path, table);
+        for (size_t i = 0; i < num_keys; ++i)
+        {
+            const tendb::skip_list::Data *data = table.get_data(keys[i]);
+            if (!data || data->is_deleted() != (i % 2 == 1) || (!data->is_deleted() && data->value() != keys[i]))
+            {
+                std::cerr << "Replayed log mismatch for key: " << keys[i] << std::endl;
+                exit(1);
+            }
+        }
+    };
+    check_replay(keys.size());
+
+    // A torn record at the end is ignored, and the records before it are kept
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) - 3);
+    tendb::skip_list::SkipList table(true);
+    if (tendb::WriteAheadLog::replay(path, table) != keys.size() + keys.size() / 2 - 1)
+    {
+        std::cerr << "Replay did not stop at the torn record" << std::endl;
+        exit(1);
+    }
+
+    // Writers racing on the same keys leave the memtable of the log as a replay of the log rebuilds it
+    std::filesystem::remove(path);
+    {
+        tendb::skip_list::SkipList memtable(true);
+        {
+            tendb::WriteAheadLog log(path, false, &memtable);
+            auto worker = [&](size_t t)
+            {
+                for (size_t i = 0; i < TEST_NUM_KEYS; ++i)
+                {
+                    log.add(keys[i], keys[(i + t) % keys.size()], (i + t) % 7 == 0);
+                }
+            };
+
+            std::vector<std::thread> threads;
+            for (size_t t = 0; t < num_threads; ++t)
+            {
+                threads.emplace_back(worker, t);
+            }
+            for (auto &thread : threads)
+            {
+                thread.join();
+            }
+        }
+
+        tendb::skip_list::SkipList replayed(true);
+        tendb::WriteAheadLog::replay(path, replayed);
+        for (size_t i = 0; i < TEST_NUM_KEYS; ++i)
+        {
+            const tendb::skip_list::Data *data = memtable.get_data(keys[i]);
+            const tendb::skip_list::Data *replayed_data = replayed.get_data(keys[i]);
+            if (!data || !replayed_data || data->is_deleted() != replayed_data->is_deleted() || data->value() != replayed_data->value())
+            {
+                std::cerr << "Memtable differs from its replayed log for key: " << keys[i] << std::endl;
+                exit(1);
+            }
+        }
+    }
+
+    std::filesystem::remove(path);
+    std::cout << "test_write_ahead_log done" << std::endl;
+}
+
+void test_recovery()
+{
+    std::string directory = "test_db";
+    std::string crashed_directory = "test_db_crashed";
+    std::filesystem::remove_all(directory);
+    std::filesystem::remove_all(crashed_directory);
+
+    std::vector<std::string> keys = generate_keys_sequence(TEST_NUM_KEYS);
+    std::map<std::string, std::string> expected;
+    {
+        tendb::DBOptions options = small_options();
+        options.sync = true;
+        tendb::DB db(directory, options);
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            db.put(keys[i], keys[i]);
+            expected[keys[i]] = keys[i];
+            if (i % 4 == 0)
+            {
+                db.del(keys[i / 2]);
+                expected.erase(keys[i / 2]);
+            }
+        }
+
+        // A copy of the open store is what a crash leaves behind: runs, logs that were not flushed, and no final flush
+        std::filesystem::copy(directory, crashed_directory);
+    }
+
+    {
+        tendb::DB db(crashed_directory, small_options());
+        check_db(db, keys, expected);
+    }
+    for (const auto &entry : std::filesystem::directory_iterator(crashed_directory))
+    {
+        if (entry.path().extension() == ".log" && std::filesystem::file_size(entry.path()) > 0)
+        {
+            std::cerr << "Replayed log was not removed: " << entry.path() << std::endl;
+            exit(1);
+        }
+    }
+
+    // Every log is replayed into a run of its own, so that a crash during recovery cannot replay an older log over a newer run
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    for (uint64_t number = 1; number <= 2; ++number)
+    {
+        tendb::WriteAheadLog log((std::filesystem::path(directory) / (std::to_string(number) + ".log")).string(), false);
+        log.add(keys[0], "log_" + std::to_string(number));
+    }
+    {
+        tendb::DB db(directory, small_options());
+        if (db.get_num_runs() != 2 || db.get(keys[0]) != "log_2")
+        {
+            std::cerr << "Logs were not recovered into a run each, in order" << std::endl;
+            exit(1);
+        }
+    }
+
+    std::filesystem::remove_all(directory);
+    std::filesystem::remove_all(crashed_directory);
+    std::cout << "test_recovery done" << std::endl;
+}
+
+void benchmark_put()
+{
+    std::string directory = "test_db";
+    std::filesystem::remove_all(directory);
+
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+    std::mt19937 g(0xC0FFEE);
+    std::shuffle(keys.begin(), keys.end(), g);
+
+    tendb::DBOptions options;
+    options.memtable_size = 1024 * 1024;
+    options.sync = false;
+    tendb::DB db(directory, options);
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    for (const auto &key : keys)
+    {
+        db.put(key, key);
+    }
+    db.flush();
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+    std::cout << "benchmark_put: " << duration.count() << "μs" << std::endl;
+}
+
+void benchmark_flush()
+{
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+    std::mt19937 g(0xC0FFEE);
+    std::shuffle(keys.begin(), keys.end(), g);
+
+    tendb::skip_list::SkipList table(true);
+    for (const auto &key : keys)
+    {
+        table.put(key, key);
+    }
+
+    std::string path = "test.pbt";
+    tendb::pbt::Writer writer(path);
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    tendb::flush_skip_list(table, writer);
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+    std::cout << "benchmark_flush: " << duration.count() << "μs" << std::endl;
+}
+
+void benchmark_get()
+{
+    std::string directory = "test_db";
+    std::filesystem::remove_all(directory);
+
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+    std::mt19937 g(0xC0FFEE);
+    std::shuffle(keys.begin(), keys.end(), g);
+
+    tendb::DBOptions options;
+    options.memtable_size = 1024 * 1024;
+    options.sync = false;
+    tendb::DB db(directory, options);
+    for (const auto &key : keys)
+    {
+        db.put(key, key);
+    }
+    db.flush();
+
+    std::shuffle(keys.begin(), keys.end(), g);
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    volatile uint64_t total_size = 0; // Do something with the value to prevent compiler optimizations
+    for (const auto &key : keys)
+    {
+        total_size += db.get(key)->size();
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+    std::cout << "benchmark_get: " << duration.count() << "μs" << std::endl;
+}
+
+void benchmark_put_sync(size_t num_threads)
+{
+    constexpr size_t num_keys = 2000;
+
+    std::string directory = "test_db";
+    std::filesystem::remove_all(directory);
+
+    std::vector<std::string> keys = generate_keys_sequence(num_keys);
+    tendb::DB db(directory);
+
+    // Every write waits for its sync, so more writers only help through group commit
+    auto worker = [&](size_t t)
+    {
+        for (size_t i = t; i < keys.size(); i += num_threads)
+        {
+            db.put(keys[i], keys[i]);
+        }
+    };
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < num_threads; ++t)
+    {
+        threads.emplace_back(worker, t);
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+    std::cout << "benchmark_put_sync (" << num_threads << " threads): " << duration.count() << "μs" << std::endl;
+}
+
+int main()
+{
+    test_put_get_del();
+    test_compaction_tiers();
+    test_background_error();
+    test_reopen();
+    test_concurrent();
+    test_flush_skip_list();
+    test_write_ahead_log();
+    test_recovery();
+
+    benchmark_put();
+    benchmark_put_sync(1);
+    benchmark_put_sync(4);
+    benchmark_put_sync(16);
+    benchmark_flush();
+    benchmark_get();
+
+    return 0;
+}
@@ -1,17 +1,33 @@
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <filesystem>
 #include <fstream>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <memory>
+#include <numeric>
 #include <random>
 #include <string>
 #include <string_view>
+#include <thread>
 
+#include "key_encoding.hpp"
+#include "pbt/batch_reader.hpp"
 #include "pbt/reader.hpp"
+#include "pbt/sorter.hpp"
+#include "pbt/split_writer.hpp"
+#include "pbt/storage.hpp"
+#include "pbt/table_cache.hpp"
 #include "pbt/writer.hpp"
 
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 constexpr static size_t TEST_NUM_KEYS = 100;
 constexpr static size_t BENCHMARK_NUM_KEYS = 100000;
 
@@ -102,162 +118,1828 @@ void test_get_at()
     std::cout << "test_get_at done" << std::endl;
 }
 
-void test_merge()
+void test_index_shapes()
 {
-    std::vector<std::string> keys = generate_keys_sequence(TEST_NUM_KEYS);
-    std::vector<std::string> values = generate_values_sequence(TEST_NUM_KEYS);
+    for (uint32_t branch_factor : {2, 3, 8})
+    {
+        for (size_t num_keys : {0, 1, 2, 3, 7, 8, 9, 63, 64, 65, 100, 513})
+        {
+            std::vector<std::string> keys = generate_keys_sequence(num_keys);
+            std::vector<std::string> values = generate_values_sequence(num_keys);
 
-    std::string path_a = "test_a.pbt";
-    tendb::pbt::Writer writer_a(path_a);
-    write_test_data(writer_a, keys, values);
-    tendb::pbt::Reader reader_a(path_a);
+            for (bool defer_index : {false, true})
+            {
+                tendb::pbt::Options options;
+                options.branch_factor = branch_factor;
+                options.defer_index = defer_index;
 
-    std::string path_b = "test_b.pbt";
-    tendb::pbt::Writer writer_b(path_b);
-    write_test_data(writer_b, keys, values);
-    tendb::pbt::Reader reader_b(path_b);
+                std::string path = "test.pbt";
+                tendb::pbt::Writer writer(path, options);
+                write_test_data(writer, keys, values);
+                tendb::pbt::Reader reader(path, options);
 
-    std::string path_target = "test_target.pbt";
-    tendb::pbt::Writer writer_target(path_target);
-    std::array<const tendb::pbt::Reader *, 2> reader_sources = {&reader_a, &reader_b};
-    writer_target.merge(reader_sources.data(), reader_sources.size());
-    writer_target.finish();
-    tendb::pbt::Reader reader_target(path_target);
+                if (reader.get_header()->num_items != num_keys)
+                {
+                    std::cerr << "Item count mismatch for " << num_keys << " keys with branch factor " << branch_factor << std::endl;
+                    exit(1);
+                }
 
-    for (size_t i = 0; i < TEST_NUM_KEYS; ++i)
+                for (size_t i = 0; i < num_keys; ++i)
+                {
+                    const tendb::pbt::KeyValueItem *entry = reader.get(keys[i]);
+                    const tendb::pbt::KeyValueItem *entry_at = reader.at(i);
+                    if (!entry || entry != entry_at || entry->value() != values[i])
+                    {
+                        std::cerr << "Entry mismatch for key: " << keys[i] << " of " << num_keys << " keys with branch factor " << branch_factor << std::endl;
+                        exit(1);
+                    }
+                }
+
+                if (reader.get("zzz") != nullptr || reader.at(num_keys) != nullptr)
+                {
+                    std::cerr << "Found entry outside of " << num_keys << " keys with branch factor " << branch_factor << std::endl;
+                    exit(1);
+                }
+            }
+        }
+    }
+
+    std::cout << "test_index_shapes done" << std::endl;
+}
+
+void test_parallel_index()
+{
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
+
+    tendb::pbt::Options options;
+    options.branch_factor = 3;
+
+    std::string path = "test.pbt";
     {
-        const tendb::pbt::KeyValueItem *entry = reader_target.get(keys[i]);
-        if (!entry)
+        tendb::pbt::Writer writer(path, options);
+        write_test_data(writer, keys, values);
+    }
+    tendb::pbt::Header expected = *tendb::pbt::Reader(path, options).get_header();
+
+    options.defer_index = true;
+    for (uint32_t index_threads : {1, 4})
+    {
+        options.index_threads = index_threads;
+
+        tendb::pbt::Writer writer(path, options);
+        write_test_data(writer, keys, values);
+        tendb::pbt::Reader reader(path, options);
+
+        const tendb::pbt::Header *header = reader.get_header();
+        if (header->depth != expected.depth || header->num_leaf_nodes != expected.num_leaf_nodes || header->num_internal_nodes != expected.num_internal_nodes)
         {
-            std::cerr << "Entry not found after merge for key: " << keys[i] << std::endl;
+            std::cerr << "Tree shape mismatch with " << index_threads << " index threads" << std::endl;
             exit(1);
         }
-        if (entry->value() != values[i])
+
+        for (size_t i = 0; i < BENCHMARK_NUM_KEYS; ++i)
         {
-            std::cerr << "Value mismatch after merge for key: " << keys[i] << ", expected: " << values[i] << ", got: " << entry->value() << std::endl;
-            exit(1);
+            const tendb::pbt::KeyValueItem *entry = reader.get(keys[i]);
+            if (!entry || entry != reader.at(i) || entry->value() != values[i] || reader.rank(keys[i]) != i)
+            {
+                std::cerr << "Entry mismatch for key: " << keys[i] << " with " << index_threads << " index threads" << std::endl;
+                exit(1);
+            }
         }
     }
 
-    std::cout << "test_merge done" << std::endl;
+    std::cout << "test_parallel_index done" << std::endl;
 }
 
-void benchmark_iterate_all_sequential()
+void test_writeback_window()
 {
     std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
     std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
 
+    for (bool defer_index : {false, true})
+    {
+        tendb::pbt::Options options;
+        options.writeback_window = 64 * 1024;
+        options.defer_index = defer_index;
+
+        std::string path = "test.pbt";
+        tendb::pbt::Writer writer(path, options);
+        write_test_data(writer, keys, values);
+        tendb::pbt::Reader reader(path, options);
+
+        for (size_t i = 0; i < BENCHMARK_NUM_KEYS; ++i)
+        {
+            const tendb::pbt::KeyValueItem *entry = reader.get(keys[i]);
+            if (!entry || entry->value() != values[i])
+            {
+                std::cerr << "Entry mismatch for key: " << keys[i] << " with writeback window" << std::endl;
+                exit(1);
+            }
+        }
+    }
+
+    std::cout << "test_writeback_window done" << std::endl;
+}
+
+void test_rank_and_count()
+{
+    std::vector<std::string> keys = generate_keys_sequence(TEST_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(TEST_NUM_KEYS);
+
     std::string path = "test.pbt";
     tendb::pbt::Writer writer(path);
     write_test_data(writer, keys, values);
     tendb::pbt::Reader reader(path);
 
-    auto t1 = std::chrono::high_resolution_clock::now();
-    tendb::pbt::KeyValueItem::Iterator itr = reader.begin();
-    tendb::pbt::KeyValueItem::Iterator end = reader.end();
-    volatile uint64_t total_size = 0;
-    for (; itr != end; ++itr)
+    for (size_t i = 0; i < TEST_NUM_KEYS; ++i)
     {
-        const tendb::pbt::KeyValueItem *item = *itr;
-        total_size += item->value().size(); // Do something with the value to prevent compiler optimizations
+        size_t rank = reader.rank(keys[i]);
+        if (rank != i)
+        {
+            std::cerr << "Rank mismatch for key: " << keys[i] << ", expected: " << i << ", got: " << rank << std::endl;
+            exit(1);
+        }
     }
-    auto t2 = std::chrono::high_resolution_clock::now();
 
-    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
-    std::cout << "benchmark_iterate_all_sequential: " << duration.count() << "μs" << std::endl;
+    if (reader.rank("") != 0 || reader.rank("zzz") != TEST_NUM_KEYS)
+    {
+        std::cerr << "Rank mismatch for keys outside of the key range" << std::endl;
+        exit(1);
+    }
+
+    for (size_t i = 0; i < TEST_NUM_KEYS; i += 7)
+    {
+        for (size_t j = 0; j < TEST_NUM_KEYS; j += 5)
+        {
+            size_t expected = j > i ? j - i : 0;
+            size_t count = reader.count(keys[i], keys[j]);
+            if (count != expected)
+            {
+                std::cerr << "Count mismatch for range: [" << keys[i] << ", " << keys[j] << "), expected: " << expected << ", got: " << count << std::endl;
+                exit(1);
+            }
+        }
+    }
+
+    if (reader.count("", "zzz") != TEST_NUM_KEYS)
+    {
+        std::cerr << "Count mismatch for the full key range" << std::endl;
+        exit(1);
+    }
+
+    std::cout << "test_rank_and_count done" << std::endl;
 }
 
-void benchmark_write()
+void test_compare_fn()
 {
-    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
-    std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<std::string> keys = generate_keys_sequence(TEST_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(TEST_NUM_KEYS);
+    std::reverse(keys.begin(), keys.end());
+    std::reverse(values.begin(), values.end());
+
+    tendb::pbt::Options options;
+    options.compare_fn = [](const std::string_view &a, const std::string_view &b)
+    {
+        return b.compare(a);
+    };
+
+    std::string path = "test.pbt";
+    tendb::pbt::Writer writer(path, options);
+    write_test_data(writer, keys, values);
+    tendb::pbt::Reader reader(path, options);
+
+    for (size_t i = 0; i < TEST_NUM_KEYS; ++i)
+    {
+        const tendb::pbt::KeyValueItem *entry = reader.get(keys[i]);
+        if (!entry || entry->value() != values[i])
+        {
+            std::cerr << "Entry mismatch with reversed comparator for key: " << keys[i] << std::endl;
+            exit(1);
+        }
+        if (reader.rank(keys[i]) != i)
+        {
+            std::cerr << "Rank mismatch with reversed comparator for key: " << keys[i] << std::endl;
+            exit(1);
+        }
+    }
+
+    std::cout << "test_compare_fn done" << std::endl;
+}
+
+void test_key_encoding()
+{
+    // Composite keys of a signed integer and a string, in their natural order
+    std::vector<std::pair<int64_t, std::string>> tuples;
+    for (int64_t i = -5; i < 5; ++i)
+    {
+        tuples.emplace_back(i * 1000, "");
+        tuples.emplace_back(i * 1000, std::string("a\0b", 3));
+        tuples.emplace_back(i * 1000, "ab");
+    }
+
+    std::vector<std::string> keys;
+    for (const auto &tuple : tuples)
+    {
+        keys.push_back(tendb::key_encoding::encode_key(tuple.first, tuple.second));
+    }
+    if (!std::is_sorted(keys.begin(), keys.end()) || std::adjacent_find(keys.begin(), keys.end()) != keys.end())
+    {
+        std::cerr << "Encoded composite keys are not in the order of the tuples" << std::endl;
+        exit(1);
+    }
 
     std::string path = "test.pbt";
     tendb::pbt::Writer writer(path);
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        writer.add(keys[i], std::to_string(i));
+    }
+    writer.finish();
+    tendb::pbt::Reader reader(path);
 
-    auto t1 = std::chrono::high_resolution_clock::now();
-    write_test_data(writer, keys, values);
-    auto t2 = std::chrono::high_resolution_clock::now();
+    size_t index = 0;
+    for (auto itr = reader.begin(); itr != reader.end(); ++itr, ++index)
+    {
+        std::string_view key = (*itr)->key();
+        int64_t number = tendb::key_encoding::decode_int64(key);
+        std::string text = tendb::key_encoding::decode_string(key);
+        if (number != tuples[index].first || text != tuples[index].second || !key.empty())
+        {
+            std::cerr << "Decoded composite key mismatch at index: " << index << std::endl;
+            exit(1);
+        }
+    }
 
-    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
-    std::cout << "benchmark_write: " << duration.count() << "μs" << std::endl;
+    std::vector<double> numbers = {-std::numeric_limits<double>::infinity(), -1e300, -2.5, -1e-300, 0.0, 1e-300, 2.5, 1e300, std::numeric_limits<double>::infinity()};
+    std::vector<std::string> encoded_numbers;
+    for (double number : numbers)
+    {
+        encoded_numbers.push_back(tendb::key_encoding::encode_key(number));
+
+        std::string_view key = encoded_numbers.back();
+        if (tendb::key_encoding::decode_double(key) != number)
+        {
+            std::cerr << "Decoded double mismatch for: " << number << std::endl;
+            exit(1);
+        }
+    }
+    if (!std::is_sorted(encoded_numbers.begin(), encoded_numbers.end()) || tendb::key_encoding::encode_key(-0.0) != tendb::key_encoding::encode_key(0.0))
+    {
+        std::cerr << "Encoded doubles are not in numeric order" << std::endl;
+        exit(1);
+    }
+
+    std::cout << "test_key_encoding done" << std::endl;
 }
 
-void benchmark_read_all_sequential()
+void test_split()
 {
-    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
-    std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<std::string> keys = generate_keys_sequence(TEST_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(TEST_NUM_KEYS);
 
     std::string path = "test.pbt";
     tendb::pbt::Writer writer(path);
     write_test_data(writer, keys, values);
     tendb::pbt::Reader reader(path);
 
-    auto t1 = std::chrono::high_resolution_clock::now();
-    volatile uint64_t total_size = 0;
-    for (const auto &key : keys)
+    for (size_t num_ranges = 1; num_ranges <= 20; ++num_ranges)
     {
-        const tendb::pbt::KeyValueItem *item = reader.get(key);
-        total_size += item->value().size(); // Do something with the value to prevent compiler optimizations
+        std::vector<tendb::pbt::ItemRange> ranges = reader.split(num_ranges);
+        if (ranges.empty() || ranges.size() > num_ranges)
+        {
+            std::cerr << "Unexpected number of ranges: " << ranges.size() << ", requested: " << num_ranges << std::endl;
+            exit(1);
+        }
+
+        uint64_t expected_start = 0;
+        for (const auto &range : ranges)
+        {
+            if (range.item_start != expected_start || range.item_end <= range.item_start)
+            {
+                std::cerr << "Ranges are not contiguous at item: " << expected_start << std::endl;
+                exit(1);
+            }
+
+            uint64_t index = range.item_start;
+            for (auto itr = range.begin; itr != range.end; ++itr, ++index)
+            {
+                if ((*itr)->key() != keys[index])
+                {
+                    std::cerr << "Key mismatch in range at index: " << index << ", expected: " << keys[index] << ", got: " << (*itr)->key() << std::endl;
+                    exit(1);
+                }
+            }
+            if (index != range.item_end)
+            {
+                std::cerr << "Range iterators do not match item indices: " << index << " != " << range.item_end << std::endl;
+                exit(1);
+            }
+
+            expected_start = range.item_end;
+        }
+
+        if (expected_start != TEST_NUM_KEYS)
+        {
+            std::cerr << "Ranges do not cover all items: " << expected_start << std::endl;
+            exit(1);
+        }
     }
-    auto t2 = std::chrono::high_resolution_clock::now();
 
-    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
-    std::cout << "benchmark_read_all_sequential: " << duration.count() << "μs" << std::endl;
+    std::cout << "test_split done" << std::endl;
 }
 
-void benchmark_read_all_random()
+void test_scan_parallel()
 {
-    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
-    std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<std::string> keys = generate_keys_sequence(TEST_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(TEST_NUM_KEYS);
 
     std::string path = "test.pbt";
     tendb::pbt::Writer writer(path);
     write_test_data(writer, keys, values);
     tendb::pbt::Reader reader(path);
 
-    std::mt19937 g(0xC0FFEE);
-    std::shuffle(keys.begin(), keys.end(), g);
+    std::atomic<uint64_t> num_items = 0;
+    auto worker = [&](size_t, const tendb::pbt::ItemRange &range)
+    {
+        for (auto itr = range.begin; itr != range.end; ++itr)
+        {
+            ++num_items;
+        }
+    };
+    reader.scan_parallel(8, 4, worker);
 
-    auto t1 = std::chrono::high_resolution_clock::now();
-    volatile uint64_t total_size = 0; // Do something with the value to prevent compiler optimizations
-    for (const auto &key : keys)
+    if (num_items != TEST_NUM_KEYS)
     {
-        const tendb::pbt::KeyValueItem *item = reader.get(key);
-        total_size += item->value().size();
+        std::cerr << "Parallel scan visited " << num_items << " items, expected: " << TEST_NUM_KEYS << std::endl;
+        exit(1);
     }
-    auto t2 = std::chrono::high_resolution_clock::now();
 
-    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
-    std::cout << "benchmark_read_all_random: " << duration.count() << "μs" << std::endl;
+    std::cout << "test_scan_parallel done" << std::endl;
 }
 
-void benchmark_merge()
+void test_storage_stable_address()
+{
+    std::string path = "test_storage.bin";
+    tendb::pbt::Storage storage(path, false);
+
+    char *address = reinterpret_cast<char *>(storage.get_address());
+    address[0] = 'x';
+
+    for (uint64_t size = 2 * 1024 * 1024; size <= 64 * 1024 * 1024; size *= 2)
+    {
+        storage.set_size(size);
+        reinterpret_cast<char *>(storage.get_address())[size - 1] = 'y';
+
+#if !defined(_WIN32)
+        if (storage.get_address() != address)
+        {
+            std::cerr << "Storage address changed after growing to " << size << " bytes" << std::endl;
+            exit(1);
+        }
+#endif
+    }
+
+    if (reinterpret_cast<char *>(storage.get_address())[0] != 'x')
+    {
+        std::cerr << "Storage lost data after growing" << std::endl;
+        exit(1);
+    }
+
+    std::cout << "test_storage_stable_address done" << std::endl;
+}
+
+void check_in_memory_tree(const tendb::pbt::Reader &reader, const std::vector<std::string> &keys, const std::vector<std::string> &values)
+{
+    if (reader.get_header()->num_items != keys.size())
+    {
+        std::cerr << "Item count mismatch in tree on storage backend" << std::endl;
+        exit(1);
+    }
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        const tendb::pbt::KeyValueItem *item = reader.get(keys[i]);
+        if (!item || item->value() != values[i])
+        {
+            std::cerr << "Entry mismatch in tree on storage backend at index " << i << std::endl;
+            exit(1);
+        }
+    }
+}
+
+void test_storage_backends()
 {
     std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
     std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
 
-    std::string path_a = "test_a.pbt";
-    tendb::pbt::Writer writer_a(path_a);
-    write_test_data(writer_a, keys, values);
-    tendb::pbt::Reader reader_a(path_a);
+    // Write in memory with both index builds, and read the bytes back in place
+    for (bool defer_index : {false, true})
+    {
+        tendb::pbt::Options options;
+        options.defer_index = defer_index;
+        tendb::pbt::Writer writer(std::make_unique<tendb::pbt::MemoryBackend>(), options);
+        write_test_data(writer, keys, values);
 
-    std::string path_b = "test_b.pbt";
-    tendb::pbt::Writer writer_b(path_b);
-    write_test_data(writer_b, keys, values);
-    tendb::pbt::Reader reader_b(path_b);
+        const tendb::pbt::Storage &storage = writer.get_storage();
+        tendb::pbt::Reader reader(std::make_unique<tendb::pbt::SpanBackend>(storage.get_address(), storage.get_size()));
+        if (reader.get_header()->root_offset == 0 || reader.begin() == reader.end() || (*reader.begin())->key() != keys[0])
+        {
+            std::cerr << "In-memory tree does not start at the first key" << std::endl;
+            exit(1);
+        }
+        check_in_memory_tree(reader, keys, values);
+    }
 
-    std::string path_target = "test_target.pbt";
-    tendb::pbt::Writer writer_target(path_target);
-    std::array<const tendb::pbt::Reader *, 2> reader_sources{&reader_a, &reader_b};
+    // A parallel merge of in-memory trees keeps its partitions in memory too
+    {
+        std::vector<std::string> even_keys, odd_keys, even_values, odd_values;
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            (i % 2 == 0 ? even_keys : odd_keys).push_back(keys[i]);
+            (i % 2 == 0 ? even_values : odd_values).push_back(values[i]);
+        }
+        tendb::pbt::Writer writer_even(std::make_unique<tendb::pbt::MemoryBackend>());
+        write_test_data(writer_even, even_keys, even_values);
+        tendb::pbt::Writer writer_odd(std::make_unique<tendb::pbt::MemoryBackend>());
+        write_test_data(writer_odd, odd_keys, odd_values);
 
-    auto t1 = std::chrono::high_resolution_clock::now();
-    writer_target.merge(reader_sources.data(), reader_sources.size());
-    writer_target.finish();
-    auto t2 = std::chrono::high_resolution_clock::now();
+        tendb::pbt::Reader reader_even(std::make_unique<tendb::pbt::SpanBackend>(writer_even.get_storage().get_address(), writer_even.get_storage().get_size()));
+        tendb::pbt::Reader reader_odd(std::make_unique<tendb::pbt::SpanBackend>(writer_odd.get_storage().get_address(), writer_odd.get_storage().get_size()));
+        std::array<const tendb::pbt::Reader *, 2> sources = {&reader_even, &reader_odd};
 
-    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
-    std::cout << "benchmark_merge: " << duration.count() << "μs" << std::endl;
+        tendb::pbt::MergeOptions merge_options;
+        merge_options.num_threads = 4;
+        tendb::pbt::Writer writer(std::make_unique<tendb::pbt::MemoryBackend>());
+        writer.merge(sources.data(), sources.size(), merge_options);
+        writer.finish();
+
+        tendb::pbt::Reader reader(std::make_unique<tendb::pbt::SpanBackend>(writer.get_storage().get_address(), writer.get_storage().get_size()));
+        check_in_memory_tree(reader, keys, values);
+    }
+
+    // Read-only bytes cannot grow
+    {
+        char bytes[64] = {};
+        tendb::pbt::Storage storage(std::make_unique<tendb::pbt::SpanBackend>(bytes, sizeof(bytes)));
+        bool thrown = false;
+        try
+        {
+            storage.set_size(128);
+        }
+        catch (const std::runtime_error &)
+        {
+            thrown = true;
+        }
+        if (!thrown || storage.get_address() != bytes || storage.get_size() != sizeof(bytes))
+        {
+            std::cerr << "Span storage was resized" << std::endl;
+            exit(1);
+        }
+    }
+
+#if defined(__linux__)
+    // A borrowed memfd is written and read through the file backend, and stays open afterwards
+    {
+        int fd = memfd_create("test_storage_backends", 0);
+        if (fd < 0)
+        {
+            std::cerr << "Failed to create memfd" << std::endl;
+            exit(1);
+        }
+        {
+            tendb::pbt::Writer writer(std::make_unique<tendb::pbt::FileBackend>(fd, false));
+            write_test_data(writer, keys, values);
+        }
+        {
+            tendb::pbt::Reader reader(std::make_unique<tendb::pbt::FileBackend>(fd, true));
+            check_in_memory_tree(reader, keys, values);
+        }
+        if (close(fd) != 0)
+        {
+            std::cerr << "Borrowed file descriptor was closed by the storage" << std::endl;
+            exit(1);
+        }
+    }
+#endif
+
+    std::cout << "test_storage_backends done" << std::endl;
+}
+
+#if defined(__linux__)
+void test_batch_reader()
+{
+    std::vector<std::string> keys = generate_keys_sequence(TEST_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(TEST_NUM_KEYS);
+    for (size_t i = 0; i < values.size(); i += 10)
+    {
+        values[i].resize(10000, 'x'); // Larger than the first read of an item
+    }
+
+    // Long keys with a large branch factor give nodes that are larger than the first read of a node
+    std::vector<std::string> long_keys = keys;
+    for (auto &key : long_keys)
+    {
+        key.resize(200, 'k');
+    }
+    std::sort(long_keys.begin(), long_keys.end());
+    tendb::pbt::Options large_nodes;
+    large_nodes.branch_factor = 64;
+
+    for (bool long_nodes : {false, true})
+    {
+        const std::vector<std::string> &tree_keys = long_nodes ? long_keys : keys;
+        std::string path = "test.pbt";
+        {
+            tendb::pbt::Writer writer(path, long_nodes ? large_nodes : tendb::pbt::Options());
+            write_test_data(writer, tree_keys, values);
+        }
+        tendb::pbt::Reader reader(path);
+
+        std::vector<std::string> lookup_keys = tree_keys;
+        lookup_keys.push_back("");
+        lookup_keys.push_back("key_");
+        lookup_keys.push_back("zzz");
+        std::mt19937 g(0xC0FFEE);
+        std::shuffle(lookup_keys.begin(), lookup_keys.end(), g);
+        std::vector<std::string_view> lookup_views(lookup_keys.begin(), lookup_keys.end());
+
+        for (unsigned queue_depth : {1u, 4u, 64u})
+        {
+            tendb::pbt::BatchReader batch_reader(path, tendb::pbt::Options(), queue_depth);
+            std::vector<bool> seen(lookup_keys.size());
+            auto check = [&](size_t key_index, const tendb::pbt::KeyValueItem *item)
+            {
+                const tendb::pbt::KeyValueItem *expected = reader.get(lookup_keys[key_index]);
+                bool matches = item == nullptr ? expected == nullptr : expected != nullptr && item->key() == expected->key() && item->value() == expected->value();
+                if (!matches || seen[key_index])
+                {
+                    std::cerr << "Batch lookup mismatch for key: " << lookup_keys[key_index] << std::endl;
+                    exit(1);
+                }
+                seen[key_index] = true;
+            };
+            batch_reader.get(lookup_views.data(), lookup_views.size(), check);
+
+            if (std::find(seen.begin(), seen.end(), false) != seen.end())
+            {
+                std::cerr << "Batch lookup missed a key" << std::endl;
+                exit(1);
+            }
+        }
+    }
+
+    {
+        std::string path = "test_empty.pbt";
+        {
+            tendb::pbt::Writer writer(path);
+            writer.finish();
+        }
+        tendb::pbt::BatchReader batch_reader(path);
+        std::string_view key = "key_0";
+        size_t num_found = 0;
+        auto count = [&](size_t, const tendb::pbt::KeyValueItem *item)
+        {
+            num_found += item != nullptr;
+        };
+        batch_reader.get(&key, 1, count);
+        if (num_found != 0)
+        {
+            std::cerr << "Batch lookup found a key in an empty tree" << std::endl;
+            exit(1);
+        }
+        std::filesystem::remove(path);
+    }
+
+    std::cout << "test_batch_reader done" << std::endl;
+}
+#endif
+
+void test_table_cache()
+{
+    constexpr size_t num_files = 8;
+    constexpr size_t capacity = 3;
+    std::vector<std::string> keys = generate_keys_sequence(num_files * TEST_NUM_KEYS);
+
+    // Every file holds its own range of the keys
+    std::vector<std::string> paths;
+    for (size_t j = 0; j < num_files; ++j)
+    {
+        paths.push_back("test_" + std::to_string(j) + ".pbt");
+        tendb::pbt::Writer writer(paths.back());
+        for (size_t i = j * TEST_NUM_KEYS; i < (j + 1) * TEST_NUM_KEYS; ++i)
+        {
+            writer.add(keys[i], keys[i]);
+        }
+        writer.finish();
+    }
+
+    tendb::pbt::TableCache cache(capacity);
+    for (size_t j = 0; j < num_files; ++j)
+    {
+        if (j < num_files / 2)
+        {
+            cache.add(paths[j]);
+        }
+        else
+        {
+            cache.add(tendb::pbt::TableInfo{paths[j], keys[j * TEST_NUM_KEYS], keys[(j + 1) * TEST_NUM_KEYS - 1], TEST_NUM_KEYS});
+        }
+    }
+    if (cache.get_num_files() != num_files || cache.get_num_open() != capacity)
+    {
+        std::cerr << "Table cache holds " << cache.get_num_open() << " open readers for " << cache.get_num_files() << " files" << std::endl;
+        exit(1);
+    }
+
+    tendb::pbt::TableInfo info;
+    if (!cache.get_info(paths[1], info) || info.first_key != keys[TEST_NUM_KEYS] || info.last_key != keys[2 * TEST_NUM_KEYS - 1] || info.num_items != TEST_NUM_KEYS)
+    {
+        std::cerr << "Table cache has wrong metadata for an opened file" << std::endl;
+        exit(1);
+    }
+
+    std::vector<tendb::pbt::TableInfo> found = cache.find(keys[2 * TEST_NUM_KEYS + 50], keys[4 * TEST_NUM_KEYS + 10]);
+    if (found.size() != 3 || found[0].path != paths[2] || found[1].path != paths[3] || found[2].path != paths[4])
+    {
+        std::cerr << "Table cache found the wrong files for a key range" << std::endl;
+        exit(1);
+    }
+
+    // A handle stays usable after its reader is evicted by other files
+    std::shared_ptr<const tendb::pbt::Reader> handle = cache.get(paths[0]);
+    tendb::pbt::KeyValueItem::Iterator itr = handle->begin();
+    for (size_t j = 1; j < num_files; ++j)
+    {
+        const tendb::pbt::KeyValueItem *item = cache.get(paths[j])->get(keys[j * TEST_NUM_KEYS]);
+        if (!item || item->value() != keys[j * TEST_NUM_KEYS])
+        {
+            std::cerr << "Table cache reader mismatch for file: " << paths[j] << std::endl;
+            exit(1);
+        }
+        if (cache.get_num_open() > capacity)
+        {
+            std::cerr << "Table cache holds more readers than its capacity" << std::endl;
+            exit(1);
+        }
+    }
+    for (size_t i = 0; i < TEST_NUM_KEYS; ++i, ++itr)
+    {
+        if ((*itr)->key() != keys[i])
+        {
+            std::cerr << "Evicted reader mismatch at index " << i << std::endl;
+            exit(1);
+        }
+    }
+
+    // Lookups from multiple threads share the same readers
+    std::atomic<size_t> num_found = 0;
+    auto lookup = [&](size_t t)
+    {
+        std::mt19937 g(static_cast<uint32_t>(t));
+        for (size_t n = 0; n < 1000; ++n)
+        {
+            size_t i = g() % keys.size();
+            if (cache.get(paths[i / TEST_NUM_KEYS])->get(keys[i]))
+            {
+                ++num_found;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < 4; ++t)
+    {
+        threads.emplace_back(lookup, t);
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    if (num_found != 4000)
+    {
+        std::cerr << "Table cache lookups from multiple threads failed" << std::endl;
+        exit(1);
+    }
+
+    cache.remove(paths[num_files - 1]);
+    if (cache.get_info(paths[num_files - 1], info) || cache.get_num_files() != num_files - 1)
+    {
+        std::cerr << "Table cache kept a removed file" << std::endl;
+        exit(1);
+    }
+
+    handle.reset();
+    for (const auto &path : paths)
+    {
+        std::filesystem::remove(path);
+    }
+
+    std::cout << "test_table_cache done" << std::endl;
+}
+
+void test_sorter()
+{
+    constexpr size_t num_keys = 10000;
+    std::vector<std::string> keys = generate_keys_sequence(num_keys);
+
+    // Every key is added twice, first with version 0 in a random order and then with version 1 in another random order
+    std::mt19937 rng(42);
+    std::vector<std::pair<std::string, std::string>> input;
+    for (int version : {0, 1})
+    {
+        std::vector<std::string> shuffled = keys;
+        std::shuffle(shuffled.begin(), shuffled.end(), rng);
+        for (const auto &key : shuffled)
+        {
+            input.emplace_back(key, std::to_string(version) + "_" + key);
+        }
+    }
+
+    for (uint64_t memory_budget : {tendb::pbt::Sorter::default_memory_budget, static_cast<uint64_t>(64 * 1024)})
+    {
+        for (size_t num_threads : {1, 4})
+        {
+            std::string path = "test.pbt";
+            {
+                tendb::pbt::Sorter sorter(path, tendb::pbt::Options(), memory_budget, num_threads);
+                for (const auto &[key, value] : input)
+                {
+                    sorter.add(key, value);
+                }
+                sorter.finish();
+            }
+            tendb::pbt::Reader reader(path);
+
+            if (reader.get_header()->num_items != 2 * num_keys)
+            {
+                std::cerr << "Item count mismatch with memory budget " << memory_budget << std::endl;
+                exit(1);
+            }
+
+            // Versions of equal keys must be in the order they were added
+            for (size_t i = 0; i < 2 * num_keys; ++i)
+            {
+                const tendb::pbt::KeyValueItem *entry = reader.at(i);
+                std::string expected_value = std::to_string(i % 2) + "_" + keys[i / 2];
+                if (entry->key() != keys[i / 2] || entry->value() != expected_value)
+                {
+                    std::cerr << "Entry mismatch at index " << i << " with memory budget " << memory_budget << " and " << num_threads << " threads" << std::endl;
+                    exit(1);
+                }
+            }
+
+            if (std::filesystem::exists(path + ".run0"))
+            {
+                std::cerr << "Run file was not removed" << std::endl;
+                exit(1);
+            }
+        }
+    }
+
+    std::cout << "test_sorter done" << std::endl;
+}
+
+void test_merge()
+{
+    std::vector<std::string> keys = generate_keys_sequence(TEST_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(TEST_NUM_KEYS);
+
+    std::string path_a = "test_a.pbt";
+    tendb::pbt::Writer writer_a(path_a);
+    write_test_data(writer_a, keys, values);
+    tendb::pbt::Reader reader_a(path_a);
+
+    std::string path_b = "test_b.pbt";
+    tendb::pbt::Writer writer_b(path_b);
+    write_test_data(writer_b, keys, values);
+    tendb::pbt::Reader reader_b(path_b);
+
+    std::string path_target = "test_target.pbt";
+    tendb::pbt::Writer writer_target(path_target);
+    std::array<const tendb::pbt::Reader *, 2> reader_sources = {&reader_a, &reader_b};
+    writer_target.merge(reader_sources.data(), reader_sources.size());
+    writer_target.finish();
+    tendb::pbt::Reader reader_target(path_target);
+
+    for (size_t i = 0; i < TEST_NUM_KEYS; ++i)
+    {
+        const tendb::pbt::KeyValueItem *entry = reader_target.get(keys[i]);
+        if (!entry)
+        {
+            std::cerr << "Entry not found after merge for key: " << keys[i] << std::endl;
+            exit(1);
+        }
+        if (entry->value() != values[i])
+        {
+            std::cerr << "Value mismatch after merge for key: " << keys[i] << ", expected: " << values[i] << ", got: " << entry->value() << std::endl;
+            exit(1);
+        }
+    }
+
+    std::cout << "test_merge done" << std::endl;
+}
+
+void test_merge_many()
+{
+    for (size_t num_sources : {1, 2, 3, 7, 16})
+    {
+        // Source j holds every key whose index is a multiple of j + 1, so some keys are in many sources and some sources are small
+        // The empty key is in every source, and the last source is empty
+        std::vector<std::string> keys = generate_keys_sequence(TEST_NUM_KEYS);
+        std::vector<std::string> paths;
+        std::vector<std::unique_ptr<tendb::pbt::Reader>> readers;
+        std::vector<const tendb::pbt::Reader *> sources;
+        std::vector<std::pair<std::string, std::string>> expected;
+        for (size_t j = 0; j < num_sources; ++j)
+        {
+            paths.push_back("test_" + std::to_string(j) + ".pbt");
+            tendb::pbt::Writer writer(paths.back());
+            if (j + 1 < num_sources || num_sources == 1)
+            {
+                writer.add("", std::to_string(j));
+                expected.emplace_back("", std::to_string(j));
+                for (size_t i = 0; i < TEST_NUM_KEYS; i += j + 1)
+                {
+                    writer.add(keys[i], std::to_string(j));
+                    expected.emplace_back(keys[i], std::to_string(j));
+                }
+            }
+            writer.finish();
+            readers.push_back(std::make_unique<tendb::pbt::Reader>(paths.back()));
+            sources.push_back(readers.back().get());
+        }
+
+        // Equal keys are expected in source order
+        auto key_less = [](const auto &a, const auto &b)
+        {
+            return a.first < b.first;
+        };
+        std::stable_sort(expected.begin(), expected.end(), key_less);
+
+        std::string path_target = "test_target.pbt";
+        tendb::pbt::Writer writer_target(path_target);
+        writer_target.merge(sources.data(), sources.size());
+        writer_target.finish();
+        tendb::pbt::Reader reader_target(path_target);
+
+        if (reader_target.get_header()->num_items != expected.size())
+        {
+            std::cerr << "Item count mismatch after merging " << num_sources << " sources" << std::endl;
+            exit(1);
+        }
+        for (size_t i = 0; i < expected.size(); ++i)
+        {
+            const tendb::pbt::KeyValueItem *entry = reader_target.at(i);
+            if (entry->key() != expected[i].first || entry->value() != expected[i].second)
+            {
+                std::cerr << "Entry mismatch at index " << i << " after merging " << num_sources << " sources" << std::endl;
+                exit(1);
+            }
+        }
+
+        readers.clear();
+        for (const auto &path : paths)
+        {
+            std::filesystem::remove(path);
+        }
+    }
+
+    std::cout << "test_merge_many done" << std::endl;
+}
+
+void test_merge_deduplicate()
+{
+    std::vector<std::string> keys = generate_keys_sequence(TEST_NUM_KEYS);
+
+    // The newer source overwrites the first half of the keys and deletes the next tenth
+    std::string path_new = "test_new.pbt";
+    tendb::pbt::Writer writer_new(path_new);
+    for (size_t i = 0; i < TEST_NUM_KEYS * 6 / 10; ++i)
+    {
+        if (i < TEST_NUM_KEYS / 2)
+        {
+            writer_new.add(keys[i], "new");
+        }
+        else
+        {
+            writer_new.add_tombstone(keys[i]);
+        }
+    }
+    writer_new.finish();
+    tendb::pbt::Reader reader_new(path_new);
+
+    std::string path_old = "test_old.pbt";
+    tendb::pbt::Writer writer_old(path_old);
+    for (size_t i = 0; i < TEST_NUM_KEYS; ++i)
+    {
+        writer_old.add(keys[i], "old");
+    }
+    writer_old.finish();
+    tendb::pbt::Reader reader_old(path_old);
+
+    std::array<const tendb::pbt::Reader *, 2> reader_sources = {&reader_new, &reader_old};
+    for (bool bottom_most : {false, true})
+    {
+        tendb::pbt::MergeOptions merge_options;
+        merge_options.deduplicate = true;
+        merge_options.bottom_most = bottom_most;
+
+        std::string path_target = "test_target.pbt";
+        tendb::pbt::Writer writer_target(path_target);
+        writer_target.merge(reader_sources.data(), reader_sources.size(), merge_options);
+        writer_target.finish();
+        tendb::pbt::Reader reader_target(path_target);
+
+        size_t expected_num_items = bottom_most ? TEST_NUM_KEYS * 9 / 10 : TEST_NUM_KEYS;
+        if (reader_target.get_header()->num_items != expected_num_items)
+        {
+            std::cerr << "Item count mismatch after deduplicating merge, bottom-most: " << bottom_most << std::endl;
+            exit(1);
+        }
+
+        for (size_t i = 0; i < TEST_NUM_KEYS; ++i)
+        {
+            const tendb::pbt::KeyValueItem *entry = reader_target.get(keys[i]);
+            bool is_deleted = i >= TEST_NUM_KEYS / 2 && i < TEST_NUM_KEYS * 6 / 10;
+            bool ok;
+            if (is_deleted)
+            {
+                ok = bottom_most ? entry == nullptr : entry != nullptr && entry->is_tombstone() && entry->value().empty();
+            }
+            else
+            {
+                ok = entry != nullptr && !entry->is_tombstone() && entry->value() == (i < TEST_NUM_KEYS / 2 ? "new" : "old");
+            }
+            if (!ok)
+            {
+                std::cerr << "Entry mismatch after deduplicating merge for key: " << keys[i] << ", bottom-most: " << bottom_most << std::endl;
+                exit(1);
+            }
+        }
+    }
+
+    // Without deduplication, every version is kept
+    std::string path_target = "test_target.pbt";
+    tendb::pbt::Writer writer_target(path_target);
+    writer_target.merge(reader_sources.data(), reader_sources.size());
+    writer_target.finish();
+    tendb::pbt::Reader reader_target(path_target);
+    if (reader_target.get_header()->num_items != TEST_NUM_KEYS * 16 / 10)
+    {
+        std::cerr << "Item count mismatch after merge without deduplication" << std::endl;
+        exit(1);
+    }
+
+    std::cout << "test_merge_deduplicate done" << std::endl;
+}
+
+void test_merge_disjoint()
+{
+    constexpr size_t num_keys = 1000;
+    std::vector<std::string> keys = generate_keys_sequence(num_keys);
+    std::vector<std::string> values = generate_values_sequence(num_keys);
+
+    // Sources hold consecutive key ranges, given out of order, and the boundary keys of neighbouring ranges are in both sources
+    std::vector<std::pair<size_t, size_t>> ranges = {{500, 750}, {0, 251}, {750, 1000}, {250, 501}};
+    std::vector<std::string> paths;
+    std::vector<std::unique_ptr<tendb::pbt::Reader>> readers;
+    std::vector<const tendb::pbt::Reader *> sources;
+    std::vector<std::pair<std::string, std::string>> expected;
+    for (size_t j = 0; j < ranges.size(); ++j)
+    {
+        paths.push_back("test_" + std::to_string(j) + ".pbt");
+        tendb::pbt::Writer writer(paths.back());
+        for (size_t i = ranges[j].first; i < ranges[j].second; ++i)
+        {
+            writer.add(keys[i], values[i] + "_" + std::to_string(j));
+            expected.emplace_back(keys[i], values[i] + "_" + std::to_string(j));
+        }
+        writer.finish();
+        readers.push_back(std::make_unique<tendb::pbt::Reader>(paths.back()));
+        sources.push_back(readers.back().get());
+    }
+
+    // Equal keys are expected in source order
+    auto key_less = [](const auto &a, const auto &b)
+    {
+        return a.first < b.first;
+    };
+    std::stable_sort(expected.begin(), expected.end(), key_less);
+
+    std::string path_target = "test_target.pbt";
+    tendb::pbt::Writer writer_target(path_target);
+    writer_target.merge(sources.data(), sources.size());
+    writer_target.finish();
+    tendb::pbt::Reader reader_target(path_target);
+
+    if (reader_target.get_header()->num_items != expected.size())
+    {
+        std::cerr << "Item count mismatch after merging disjoint sources" << std::endl;
+        exit(1);
+    }
+    for (size_t i = 0; i < expected.size(); ++i)
+    {
+        const tendb::pbt::KeyValueItem *entry = reader_target.at(i);
+        if (entry->key() != expected[i].first || entry->value() != expected[i].second || reader_target.rank(entry->key()) > i)
+        {
+            std::cerr << "Entry mismatch at index " << i << " after merging disjoint sources" << std::endl;
+            exit(1);
+        }
+    }
+
+    readers.clear();
+    for (const auto &path : paths)
+    {
+        std::filesystem::remove(path);
+    }
+
+    std::cout << "test_merge_disjoint done" << std::endl;
+}
+
+void test_merge_parallel()
+{
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+
+    // Keys are dealt round-robin over three sources, and the fourth source holds a newer version of every tenth key
+    constexpr size_t num_sources = 4;
+    std::vector<std::string> paths;
+    std::vector<std::unique_ptr<tendb::pbt::Reader>> readers;
+    std::vector<const tendb::pbt::Reader *> sources;
+    for (size_t j = 0; j < num_sources; ++j)
+    {
+        paths.push_back("test_" + std::to_string(j) + ".pbt");
+        tendb::pbt::Writer writer(paths.back());
+        for (size_t i = 0; i < BENCHMARK_NUM_KEYS; ++i)
+        {
+            if (j == 0 ? i % 10 == 0 : i % (num_sources - 1) == j - 1)
+            {
+                writer.add(keys[i], std::to_string(j));
+            }
+        }
+        writer.finish();
+        readers.push_back(std::make_unique<tendb::pbt::Reader>(paths.back()));
+        sources.push_back(readers.back().get());
+    }
+
+    for (bool deduplicate : {false, true})
+    {
+        tendb::pbt::MergeOptions merge_options;
+        merge_options.deduplicate = deduplicate;
+
+        std::string path_expected = "test_expected.pbt";
+        tendb::pbt::Writer writer_expected(path_expected);
+        writer_expected.merge(sources.data(), sources.size(), merge_options);
+        writer_expected.finish();
+        tendb::pbt::Reader reader_expected(path_expected);
+
+        for (uint32_t num_threads : {2, 4, 7})
+        {
+            merge_options.num_threads = num_threads;
+
+            // Partitions record the leaf nodes both for an index that is deferred and for one that would be built while adding
+            tendb::pbt::Options options;
+            options.defer_index = num_threads == 4;
+
+            std::string path_target = "test_target.pbt";
+            tendb::pbt::Writer writer_target(path_target, options);
+            writer_target.merge(sources.data(), sources.size(), merge_options);
+            writer_target.finish();
+            tendb::pbt::Reader reader_target(path_target);
+
+            if (reader_target.get_header()->num_items != reader_expected.get_header()->num_items)
+            {
+                std::cerr << "Item count mismatch after parallel merge with " << num_threads << " threads" << std::endl;
+                exit(1);
+            }
+
+            tendb::pbt::KeyValueItem::Iterator itr = reader_target.begin();
+            tendb::pbt::KeyValueItem::Iterator itr_expected = reader_expected.begin();
+            for (size_t i = 0; itr != reader_target.end(); ++i, ++itr, ++itr_expected)
+            {
+                if ((*itr)->key() != (*itr_expected)->key() || (*itr)->value() != (*itr_expected)->value() || reader_target.at(i) != *itr)
+                {
+                    std::cerr << "Entry mismatch at index " << i << " after parallel merge with " << num_threads << " threads" << std::endl;
+                    exit(1);
+                }
+            }
+        }
+    }
+
+    readers.clear();
+    for (const auto &path : paths)
+    {
+        std::filesystem::remove(path);
+    }
+
+    std::cout << "test_merge_parallel done" << std::endl;
+}
+
+void test_merge_filter()
+{
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+
+    std::string path_source = "test_source.pbt";
+    tendb::pbt::Writer writer_source(path_source);
+    for (size_t i = 0; i < BENCHMARK_NUM_KEYS; ++i)
+    {
+        writer_source.add(keys[i], std::to_string(i));
+    }
+    writer_source.finish();
+    tendb::pbt::Reader reader_source(path_source);
+
+    // Even items expire, and odd items that are a multiple of three get a new value
+    auto filter = [](const std::string_view &, const std::string_view &value, std::string &new_value)
+    {
+        size_t i = std::stoull(std::string(value));
+        if (i % 2 == 0)
+        {
+            return tendb::pbt::FilterDecision::remove;
+        }
+        if (i % 3 == 0)
+        {
+            new_value = "new_" + std::string(value);
+            return tendb::pbt::FilterDecision::change_value;
+        }
+        return tendb::pbt::FilterDecision::keep;
+    };
+
+    std::array<const tendb::pbt::Reader *, 1> reader_sources = {&reader_source};
+    for (uint32_t num_threads : {1, 4})
+    {
+        for (bool bottom_most : {false, true})
+        {
+            tendb::pbt::MergeOptions merge_options;
+            merge_options.deduplicate = true;
+            merge_options.bottom_most = bottom_most;
+            merge_options.num_threads = num_threads;
+            merge_options.filter_fn = filter;
+
+            std::string path_target = "test_target.pbt";
+            tendb::pbt::Writer writer_target(path_target);
+            writer_target.merge(reader_sources.data(), reader_sources.size(), merge_options);
+            writer_target.finish();
+            tendb::pbt::Reader reader_target(path_target);
+
+            for (size_t i = 0; i < BENCHMARK_NUM_KEYS; ++i)
+            {
+                const tendb::pbt::KeyValueItem *entry = reader_target.get(keys[i]);
+                bool ok;
+                if (i % 2 == 0)
+                {
+                    // Without bottom-most, removed items must keep shadowing older items
+                    ok = bottom_most ? entry == nullptr : entry != nullptr && entry->is_tombstone();
+                }
+                else
+                {
+                    std::string expected_value = (i % 3 == 0 ? "new_" : "") + std::to_string(i);
+                    ok = entry != nullptr && !entry->is_tombstone() && entry->value() == expected_value;
+                }
+                if (!ok)
+                {
+                    std::cerr << "Entry mismatch after filtered merge for key: " << keys[i] << ", bottom-most: " << bottom_most << ", threads: " << num_threads << std::endl;
+                    exit(1);
+                }
+            }
+        }
+    }
+
+    // A filter that decides differently when it sees an item again, like a TTL that runs out during the merge
+    // Every item is passed to it once, so each keeps the longer value of its first call
+    std::vector<std::atomic<uint32_t>> num_calls(BENCHMARK_NUM_KEYS);
+    auto changing_filter = [&](const std::string_view &, const std::string_view &value, std::string &new_value)
+    {
+        size_t i = std::stoull(std::string(value));
+        if (num_calls[i].fetch_add(1) > 0)
+        {
+            return tendb::pbt::FilterDecision::remove;
+        }
+        new_value = "first_call_" + std::string(value);
+        return tendb::pbt::FilterDecision::change_value;
+    };
+
+    tendb::pbt::MergeOptions merge_options;
+    merge_options.deduplicate = true;
+    merge_options.bottom_most = true;
+    merge_options.num_threads = 4;
+    merge_options.filter_fn = changing_filter;
+
+    std::string path_target = "test_target.pbt";
+    tendb::pbt::Writer writer_target(path_target);
+    writer_target.merge(reader_sources.data(), reader_sources.size(), merge_options);
+    writer_target.finish();
+    tendb::pbt::Reader reader_target(path_target);
+    for (size_t i = 0; i < BENCHMARK_NUM_KEYS; ++i)
+    {
+        const tendb::pbt::KeyValueItem *entry = reader_target.get(keys[i]);
+        if (num_calls[i].load() != 1 || entry == nullptr || entry->value() != "first_call_" + std::to_string(i))
+        {
+            std::cerr << "Entry mismatch after merge with a changing filter for key: " << keys[i] << std::endl;
+            exit(1);
+        }
+    }
+
+    std::cout << "test_merge_filter done" << std::endl;
+}
+
+void test_split_writer()
+{
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
+
+    // Two sources with the same keys, so that every key appears twice in a row when merged
+    std::string path_a = "test_a.pbt";
+    tendb::pbt::Writer writer_a(path_a);
+    write_test_data(writer_a, keys, values);
+    tendb::pbt::Reader reader_a(path_a);
+
+    std::string path_b = "test_b.pbt";
+    tendb::pbt::Writer writer_b(path_b);
+    write_test_data(writer_b, keys, values);
+    tendb::pbt::Reader reader_b(path_b);
+
+    std::array<const tendb::pbt::Reader *, 2> reader_sources = {&reader_a, &reader_b};
+
+    constexpr uint64_t max_file_size = 256 * 1024;
+    constexpr uint64_t max_items = 9999; // Odd, so that a limit on items falls between equal keys
+
+    // A single source is merged as runs of items, which are cut at the limits as well
+    for (size_t config = 0; config < 4; ++config)
+    {
+        size_t num_sources = config < 2 ? 2 : 1;
+        bool limit_items = config % 2 == 1;
+        tendb::pbt::SplitWriter split_writer("test_split.pbt", tendb::pbt::Options(), limit_items ? UINT64_MAX : max_file_size, limit_items ? max_items : UINT64_MAX);
+        split_writer.merge(reader_sources.data(), num_sources);
+        std::vector<tendb::pbt::OutputFile> files = split_writer.finish();
+
+        if (files.size() < 2)
+        {
+            std::cerr << "Merge was not split into multiple files" << std::endl;
+            exit(1);
+        }
+
+        size_t index = 0;
+        for (const auto &file : files)
+        {
+            tendb::pbt::Reader reader(file.path);
+            const tendb::pbt::Header *header = reader.get_header();
+            if (header->num_items != file.num_items || header->num_items % num_sources != 0 || (limit_items && header->num_items > max_items + 1))
+            {
+                std::cerr << "Item count mismatch in split file: " << file.path << std::endl;
+                exit(1);
+            }
+            if (reader.at(0)->key() != file.first_key || reader.at(header->num_items - 1)->key() != file.last_key)
+            {
+                std::cerr << "Key range mismatch in split file: " << file.path << std::endl;
+                exit(1);
+            }
+            for (size_t i = 0; i < header->num_items; ++i, ++index)
+            {
+                if (reader.at(i)->key() != keys[index / num_sources])
+                {
+                    std::cerr << "Entry mismatch in split file: " << file.path << " at index " << i << std::endl;
+                    exit(1);
+                }
+            }
+        }
+        if (index != num_sources * BENCHMARK_NUM_KEYS)
+        {
+            std::cerr << "Item count mismatch over all split files" << std::endl;
+            exit(1);
+        }
+
+        for (const auto &file : files)
+        {
+            std::filesystem::remove(file.path);
+        }
+    }
+
+    std::cout << "test_split_writer done" << std::endl;
+}
+
+void benchmark_iterate_all_sequential()
+{
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
+
+    std::string path = "test.pbt";
+    tendb::pbt::Writer writer(path);
+    write_test_data(writer, keys, values);
+    tendb::pbt::Reader reader(path);
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    tendb::pbt::KeyValueItem::Iterator itr = reader.begin();
+    tendb::pbt::KeyValueItem::Iterator end = reader.end();
+    volatile uint64_t total_size = 0;
+    for (; itr != end; ++itr)
+    {
+        const tendb::pbt::KeyValueItem *item = *itr;
+        total_size += item->value().size(); // Do something with the value to prevent compiler optimizations
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+    std::cout << "benchmark_iterate_all_sequential: " << duration.count() << "μs" << std::endl;
+}
+
+void benchmark_iterate_all_parallel()
+{
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
+
+    std::string path = "test.pbt";
+    tendb::pbt::Writer writer(path);
+    write_test_data(writer, keys, values);
+    tendb::pbt::Reader reader(path);
+
+    size_t num_threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+
+    std::atomic<uint64_t> total_size = 0;
+    auto worker = [&](size_t, const tendb::pbt::ItemRange &range)
+    {
+        uint64_t range_size = 0;
+        for (auto itr = range.begin; itr != range.end; ++itr)
+        {
+            range_size += (*itr)->value().size(); // Do something with the value to prevent compiler optimizations
+        }
+        total_size += range_size;
+    };
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    reader.scan_parallel(num_threads, num_threads, worker);
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+    std::cout << "benchmark_iterate_all_parallel: " << duration.count() << "μs" << std::endl;
+}
+
+void benchmark_write()
+{
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
+
+    std::string path = "test.pbt";
+    tendb::pbt::Writer writer(path);
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    write_test_data(writer, keys, values);
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+    std::cout << "benchmark_write: " << duration.count() << "μs" << std::endl;
+}
+
+void benchmark_write_parallel_index()
+{
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
+
+    tendb::pbt::Options options;
+    options.defer_index = true;
+
+    std::string path = "test.pbt";
+    tendb::pbt::Writer writer(path, options);
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    write_test_data(writer, keys, values);
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+    std::cout << "benchmark_write_parallel_index: " << duration.count() << "μs" << std::endl;
+}
+
+void benchmark_write_writeback_window()
+{
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
+
+    tendb::pbt::Options options;
+    options.writeback_window = 1024 * 1024;
+
+    std::string path = "test.pbt";
+    tendb::pbt::Writer writer(path, options);
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    write_test_data(writer, keys, values);
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+    std::cout << "benchmark_write_writeback_window: " << duration.count() << "μs" << std::endl;
+}
+
+void benchmark_write_memory()
+{
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
+
+    tendb::pbt::Writer writer(std::make_unique<tendb::pbt::MemoryBackend>());
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    write_test_data(writer, keys, values);
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+    std::cout << "benchmark_write_memory: " << duration.count() << "μs" << std::endl;
+}
+
+void benchmark_sorter()
+{
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<size_t> order(BENCHMARK_NUM_KEYS);
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), std::mt19937(42));
+
+    std::string path = "test.pbt";
+    tendb::pbt::Sorter sorter(path, tendb::pbt::Options(), 1024 * 1024);
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    for (size_t i : order)
+    {
+        sorter.add(keys[i], values[i]);
+    }
+    sorter.finish();
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+    std::cout << "benchmark_sorter: " << duration.count() << "μs" << std::endl;
+}
+
+void benchmark_read_all_sequential()
+{
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
+
+    std::string path = "test.pbt";
+    tendb::pbt::Writer writer(path);
+    write_test_data(writer, keys, values);
+    tendb::pbt::Reader reader(path);
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    volatile uint64_t total_size = 0;
+    for (const auto &key : keys)
+    {
+        const tendb::pbt::KeyValueItem *item = reader.get(key);
+        total_size += item->value().size(); // Do something with the value to prevent compiler optimizations
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+    std::cout << "benchmark_read_all_sequential: " << duration.count() << "μs" << std::endl;
+}
+
+void benchmark_read_all_random()
+{
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
+
+    std::string path = "test.pbt";
+    tendb::pbt::Writer writer(path);
+    write_test_data(writer, keys, values);
+    tendb::pbt::Reader reader(path);
+
+    std::mt19937 g(0xC0FFEE);
+    std::shuffle(keys.begin(), keys.end(), g);
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    volatile uint64_t total_size = 0; // Do something with the value to prevent compiler optimizations
+    for (const auto &key : keys)
+    {
+        const tendb::pbt::KeyValueItem *item = reader.get(key);
+        total_size += item->value().size();
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+    std::cout << "benchmark_read_all_random: " << duration.count() << "μs" << std::endl;
+}
+
+void benchmark_read_all_random_memory()
+{
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
+
+    tendb::pbt::Writer writer(std::make_unique<tendb::pbt::MemoryBackend>());
+    write_test_data(writer, keys, values);
+    tendb::pbt::Reader reader(std::make_unique<tendb::pbt::SpanBackend>(writer.get_storage().get_address(), writer.get_storage().get_size()));
+
+    std::mt19937 g(0xC0FFEE);
+    std::shuffle(keys.begin(), keys.end(), g);
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    volatile uint64_t total_size = 0; // Do something with the value to prevent compiler optimizations
+    for (const auto &key : keys)
+    {
+        const tendb::pbt::KeyValueItem *item = reader.get(key);
+        total_size += item->value().size();
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+    std::cout << "benchmark_read_all_random_memory: " << duration.count() << "μs" << std::endl;
+}
+
+void benchmark_read_all_random_compare_fn()
+{
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
+
+    std::string path = "test.pbt";
+    tendb::pbt::Writer writer(path);
+    write_test_data(writer, keys, values);
+
+    // A comparator that is not LexicalCompare forces every compare through std::function
+    tendb::pbt::Options options;
+    options.compare_fn = [](const std::string_view &a, const std::string_view &b)
+    {
+        return a.compare(b);
+    };
+    tendb::pbt::Reader reader(path, options);
+
+    std::mt19937 g(0xC0FFEE);
+    std::shuffle(keys.begin(), keys.end(), g);
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    volatile uint64_t total_size = 0; // Do something with the value to prevent compiler optimizations
+    for (const auto &key : keys)
+    {
+        const tendb::pbt::KeyValueItem *item = reader.get(key);
+        total_size += item->value().size();
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+    std::cout << "benchmark_read_all_random_compare_fn: " << duration.count() << "μs" << std::endl;
+}
+
+#if defined(__linux__)
+constexpr static size_t COLD_BENCHMARK_VALUE_SIZE = 1000;
+constexpr static size_t COLD_BENCHMARK_NUM_LOOKUPS = 1000;
+
+// Writes a tree of about 100 MB and picks random keys to look up in it
+std::vector<std::string> write_cold_benchmark_data(const std::string &path)
+{
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
+    for (auto &value : values)
+    {
+        value.resize(COLD_BENCHMARK_VALUE_SIZE, 'x');
+    }
+    {
+        tendb::pbt::Writer writer(path);
+        write_test_data(writer, keys, values);
+    }
+
+    std::mt19937 g(0xC0FFEE);
+    std::shuffle(keys.begin(), keys.end(), g);
+    keys.resize(COLD_BENCHMARK_NUM_LOOKUPS);
+    return keys;
+}
+
+// Drops the file from the page cache, so that every read goes to the device as for a file larger than memory
+void evict_from_page_cache(const std::string &path)
+{
+    tendb::pbt::Storage storage(path, true);
+    storage.drop_pages(0, storage.get_size());
+}
+
+void benchmark_read_random_cold_mmap()
+{
+    std::string path = "test_cold.pbt";
+    std::vector<std::string> keys = write_cold_benchmark_data(path);
+    evict_from_page_cache(path);
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    tendb::pbt::Reader reader(path);
+    volatile uint64_t total_size = 0; // Do something with the value to prevent compiler optimizations
+    for (const auto &key : keys)
+    {
+        const tendb::pbt::KeyValueItem *item = reader.get(key);
+        total_size += item->value().size();
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+    std::cout << "benchmark_read_random_cold_mmap: " << duration.count() << "μs" << std::endl;
+    std::filesystem::remove(path);
+}
+
+void benchmark_read_random_cold_batch()
+{
+    std::string path = "test_cold.pbt";
+    std::vector<std::string> keys = write_cold_benchmark_data(path);
+    std::vector<std::string_view> key_views(keys.begin(), keys.end());
+    evict_from_page_cache(path);
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    tendb::pbt::BatchReader batch_reader(path);
+    volatile uint64_t total_size = 0; // Do something with the value to prevent compiler optimizations
+    auto add_size = [&](size_t, const tendb::pbt::KeyValueItem *item)
+    {
+        total_size += item->value().size();
+    };
+    batch_reader.get(key_views.data(), key_views.size(), add_size);
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+    std::cout << "benchmark_read_random_cold_batch: " << duration.count() << "μs" << (batch_reader.is_async() ? "" : " (io_uring unavailable, synchronous reads)") << std::endl;
+    std::filesystem::remove(path);
+}
+#endif
+
+void benchmark_merge()
+{
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
+
+    std::string path_a = "test_a.pbt";
+    tendb::pbt::Writer writer_a(path_a);
+    write_test_data(writer_a, keys, values);
+    tendb::pbt::Reader reader_a(path_a);
+
+    std::string path_b = "test_b.pbt";
+    tendb::pbt::Writer writer_b(path_b);
+    write_test_data(writer_b, keys, values);
+    tendb::pbt::Reader reader_b(path_b);
+
+    std::string path_target = "test_target.pbt";
+    tendb::pbt::Writer writer_target(path_target);
+    std::array<const tendb::pbt::Reader *, 2> reader_sources{&reader_a, &reader_b};
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    writer_target.merge(reader_sources.data(), reader_sources.size());
+    writer_target.finish();
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+    std::cout << "benchmark_merge: " << duration.count() << "μs" << std::endl;
+}
+
+void benchmark_merge_compare_fn()
+{
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
+
+    std::string path_a = "test_a.pbt";
+    tendb::pbt::Writer writer_a(path_a);
+    write_test_data(writer_a, keys, values);
+    tendb::pbt::Reader reader_a(path_a);
+
+    std::string path_b = "test_b.pbt";
+    tendb::pbt::Writer writer_b(path_b);
+    write_test_data(writer_b, keys, values);
+    tendb::pbt::Reader reader_b(path_b);
+
+    // A comparator that is not LexicalCompare forces every compare through std::function
+    tendb::pbt::Options options;
+    options.compare_fn = [](const std::string_view &a, const std::string_view &b)
+    {
+        return a.compare(b);
+    };
+
+    std::string path_target = "test_target.pbt";
+    tendb::pbt::Writer writer_target(path_target, options);
+    std::array<const tendb::pbt::Reader *, 2> reader_sources{&reader_a, &reader_b};
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    writer_target.merge(reader_sources.data(), reader_sources.size());
+    writer_target.finish();
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+    std::cout << "benchmark_merge_compare_fn: " << duration.count() << "μs" << std::endl;
+}
+
+void benchmark_merge_many()
+{
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
+
+    for (size_t num_sources : {2, 8, 32, 128})
+    {
+        // Keys are dealt round-robin over the sources, so that every output item comes from a different source than the last
+        std::vector<std::string> paths;
+        std::vector<std::unique_ptr<tendb::pbt::Reader>> readers;
+        std::vector<const tendb::pbt::Reader *> sources;
+        for (size_t j = 0; j < num_sources; ++j)
+        {
+            paths.push_back("test_" + std::to_string(j) + ".pbt");
+            tendb::pbt::Writer writer(paths.back());
+            for (size_t i = j; i < BENCHMARK_NUM_KEYS; i += num_sources)
+            {
+                writer.add(keys[i], values[i]);
+            }
+            writer.finish();
+            readers.push_back(std::make_unique<tendb::pbt::Reader>(paths.back()));
+            sources.push_back(readers.back().get());
+        }
+
+        std::string path_target = "test_target.pbt";
+        tendb::pbt::Writer writer_target(path_target);
+
+        auto t1 = std::chrono::high_resolution_clock::now();
+        writer_target.merge(sources.data(), sources.size());
+        writer_target.finish();
+        auto t2 = std::chrono::high_resolution_clock::now();
+
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+        std::cout << "benchmark_merge_many (" << num_sources << " sources): " << duration.count() << "μs" << std::endl;
+
+        readers.clear();
+        for (const auto &path : paths)
+        {
+            std::filesystem::remove(path);
+        }
+    }
+}
+
+void benchmark_merge_disjoint()
+{
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
+
+    // Every source holds a consecutive range of keys, as with time-partitioned files
+    constexpr size_t num_sources = 30;
+    std::vector<std::string> paths;
+    std::vector<std::unique_ptr<tendb::pbt::Reader>> readers;
+    std::vector<const tendb::pbt::Reader *> sources;
+    for (size_t j = 0; j < num_sources; ++j)
+    {
+        paths.push_back("test_" + std::to_string(j) + ".pbt");
+        tendb::pbt::Writer writer(paths.back());
+        for (size_t i = BENCHMARK_NUM_KEYS * j / num_sources; i < BENCHMARK_NUM_KEYS * (j + 1) / num_sources; ++i)
+        {
+            writer.add(keys[i], values[i]);
+        }
+        writer.finish();
+        readers.push_back(std::make_unique<tendb::pbt::Reader>(paths.back()));
+        sources.push_back(readers.back().get());
+    }
+
+    std::string path_target = "test_target.pbt";
+    tendb::pbt::Writer writer_target(path_target);
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    writer_target.merge(sources.data(), sources.size());
+    writer_target.finish();
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+    std::cout << "benchmark_merge_disjoint: " << duration.count() << "μs" << std::endl;
+
+    readers.clear();
+    for (const auto &path : paths)
+    {
+        std::filesystem::remove(path);
+    }
+}
+
+void benchmark_merge_parallel()
+{
+    std::vector<std::string> keys = generate_keys_sequence(BENCHMARK_NUM_KEYS);
+    std::vector<std::string> values = generate_values_sequence(BENCHMARK_NUM_KEYS);
+
+    // Keys are dealt round-robin over the sources, so that no runs can be copied as a whole
+    constexpr size_t num_sources = 8;
+    std::vector<std::string> paths;
+    std::vector<std::unique_ptr<tendb::pbt::Reader>> readers;
+    std::vector<const tendb::pbt::Reader *> sources;
+    for (size_t j = 0; j < num_sources; ++j)
+    {
+        paths.push_back("test_" + std::to_string(j) + ".pbt");
+        tendb::pbt::Writer writer(paths.back());
+        for (size_t i = j; i < BENCHMARK_NUM_KEYS; i += num_sources)
+        {
+            writer.add(keys[i], values[i]);
+        }
+        writer.finish();
+        readers.push_back(std::make_unique<tendb::pbt::Reader>(paths.back()));
+        sources.push_back(readers.back().get());
+    }
+
+    for (uint32_t num_threads : {1, 2, 4, 8})
+    {
+        tendb::pbt::MergeOptions merge_options;
+        merge_options.num_threads = num_threads;
+
+        tendb::pbt::Options options;
+        options.defer_index = true;
+
+        std::string path_target = "test_target.pbt";
+        tendb::pbt::Writer writer_target(path_target, options);
+
+        auto t1 = std::chrono::high_resolution_clock::now();
+        writer_target.merge(sources.data(), sources.size(), merge_options);
+        writer_target.finish();
+        auto t2 = std::chrono::high_resolution_clock::now();
+
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1);
+        std::cout << "benchmark_merge_parallel (" << num_threads << " threads): " << duration.count() << "μs" << std::endl;
+    }
+
+    readers.clear();
+    for (const auto &path : paths)
+    {
+        std::filesystem::remove(path);
+    }
 }
 
 void benchmark_map_read_all_sequential()
@@ -315,13 +1997,49 @@ int main()
 {
     test_write_and_read();
     test_get_at();
+    test_index_shapes();
+    test_parallel_index();
+    test_writeback_window();
+    test_rank_and_count();
+    test_compare_fn();
+    test_key_encoding();
+    test_split();
+    test_scan_parallel();
+    test_storage_stable_address();
+    test_storage_backends();
+#if defined(__linux__)
+    test_batch_reader();
+#endif
+    test_table_cache();
+    test_sorter();
     test_merge();
+    test_merge_many();
+    test_merge_deduplicate();
+    test_merge_disjoint();
+    test_merge_parallel();
+    test_merge_filter();
+    test_split_writer();
 
     benchmark_iterate_all_sequential();
+    benchmark_iterate_all_parallel();
     benchmark_write();
+    benchmark_write_parallel_index();
+    benchmark_write_writeback_window();
+    benchmark_write_memory();
+    benchmark_sorter();
     benchmark_read_all_sequential();
     benchmark_read_all_random();
+    benchmark_read_all_random_memory();
+    benchmark_read_all_random_compare_fn();
+#if defined(__linux__)
+    benchmark_read_random_cold_mmap();
+    benchmark_read_random_cold_batch();
+#endif
     benchmark_merge();
+    benchmark_merge_compare_fn();
+    benchmark_merge_many();
+    benchmark_merge_disjoint();
+    benchmark_merge_parallel();
 
     benchmark_map_read_all_sequential();
     benchmark_map_read_all_random();
@@ -2,6 +2,7 @@
 #include <chrono>
 #include <iostream>
 #include <map>
+#include <optional>
 #include <random>
 #include <string>
 #include <string_view>
@@ -278,6 +279,398 @@ void test_skip_list_delete()
     std::cout << "test_skip_list_delete done" << std::endl;
 }
 
+void test_skip_list_snapshot()
+{
+    tendb::skip_list::SkipList skip_list;
+    std::vector<std::string> keys = generate_keys_sequence();
+
+    for (size_t i = 0; i < keys.size() / 2; ++i)
+    {
+        skip_list.put(keys[i], "old");
+    }
+    tendb::skip_list::Snapshot snapshot = skip_list.snapshot();
+
+    // Overwrite and delete the old keys, and add the new keys after the snapshot
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        if (i % 2 == 0)
+        {
+            skip_list.put(keys[i], "new");
+        }
+        else
+        {
+            skip_list.del(keys[i]);
+        }
+    }
+
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        std::optional<std::string_view> old_value = skip_list.get(keys[i], snapshot);
+        std::optional<std::string_view> new_value = skip_list.get(keys[i]);
+        if (old_value != (i < keys.size() / 2 ? std::optional<std::string_view>("old") : std::nullopt) ||
+            new_value != (i % 2 == 0 ? std::optional<std::string_view>("new") : std::nullopt))
+        {
+            std::cerr << "Error: snapshot read mismatch for key: " << keys[i] << std::endl;
+            exit(1);
+        }
+    }
+
+    size_t count = 0;
+    for (auto it = skip_list.begin(snapshot); it != skip_list.end(); ++it)
+    {
+        if (it->value() != "old")
+        {
+            std::cerr << "Error: snapshot iterator returned a newer value for key: " << it->key() << std::endl;
+            exit(1);
+        }
+        ++count;
+    }
+    if (count != keys.size() / 2)
+    {
+        std::cerr << "Error: snapshot iterator returned " << count << " keys instead of " << keys.size() / 2 << std::endl;
+        exit(1);
+    }
+
+    std::cout << "test_skip_list_snapshot done" << std::endl;
+}
+
+void test_skip_list_snapshot_multithread()
+{
+    constexpr size_t num_keys = 1000;
+    constexpr size_t num_rounds = 50;
+
+    tendb::skip_list::SkipList skip_list;
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < num_keys; ++i)
+    {
+        std::string number = std::to_string(i);
+        keys.push_back("key_" + std::string(4 - number.size(), '0') + number);
+    }
+
+    // One writer writes the keys in order, once per round, so a consistent scan sees a prefix of the keys at one round
+    // and the rest at the round before; other writers add unrelated keys, so that writes finish out of order
+    std::atomic<bool> done{false};
+    auto writer = [&]()
+    {
+        for (size_t round = 1; round <= num_rounds; ++round)
+        {
+            for (const auto &key : keys)
+            {
+                skip_list.put(key, std::to_string(round));
+            }
+        }
+        done = true;
+    };
+    auto noise_writer = [&](size_t thread_id)
+    {
+        for (size_t i = 0; !done; ++i)
+        {
+            skip_list.put("other_" + std::to_string(thread_id) + "_" + std::to_string(i % num_keys), "value");
+        }
+    };
+    auto scanner = [&]()
+    {
+        while (!done)
+        {
+            tendb::skip_list::Snapshot snapshot = skip_list.snapshot();
+            std::vector<int> rounds;
+            for (const auto &key : keys)
+            {
+                std::optional<std::string_view> value = skip_list.get(key, snapshot);
+                rounds.push_back(value ? std::stoi(std::string(*value)) : 0);
+            }
+            for (size_t i = 1; i < rounds.size(); ++i)
+            {
+                if (rounds[i] > rounds[i - 1] || rounds[0] - rounds[i] > 1)
+                {
+                    std::cerr << "Error: inconsistent snapshot at key: " << keys[i] << std::endl;
+                    exit(1);
+                }
+            }
+
+            // The same snapshot reads the same values later on
+            for (size_t i = 0; i < keys.size(); i += 97)
+            {
+                std::optional<std::string_view> value = skip_list.get(keys[i], snapshot);
+                if ((value ? std::stoi(std::string(*value)) : 0) != rounds[i])
+                {
+                    std::cerr << "Error: snapshot read is not repeatable at key: " << keys[i] << std::endl;
+                    exit(1);
+                }
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.emplace_back(writer);
+    threads.emplace_back(scanner);
+    for (size_t i = 0; i < 3; ++i)
+    {
+        threads.emplace_back(noise_writer, i);
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    std::cout << "test_skip_list_snapshot_multithread done" << std::endl;
+}
+
+void test_skip_list_reclamation()
+{
+    constexpr size_t num_keys = 1000;
+    constexpr size_t num_rounds = 200;
+
+    tendb::skip_list::SkipList skip_list;
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < num_keys; ++i)
+    {
+        keys.push_back("key_" + std::to_string(i));
+    }
+
+    for (const auto &key : keys)
+    {
+        skip_list.put(key, "initial");
+    }
+
+    // A snapshot taken before the overwrites keeps the versions it sees
+    {
+        tendb::skip_list::Snapshot snapshot = skip_list.snapshot();
+
+        // Overwriting the same keys reuses the memory of replaced versions, so the memory usage levels off
+        size_t usage_after_warmup = 0;
+        for (size_t round = 0; round < num_rounds; ++round)
+        {
+            std::string value = "value_" + std::to_string(round);
+            for (const auto &key : keys)
+            {
+                skip_list.put(key, value);
+            }
+            if (round == num_rounds / 10)
+            {
+                usage_after_warmup = skip_list.get_memory_usage();
+            }
+        }
+
+        for (const auto &key : keys)
+        {
+            if (skip_list.get(key, snapshot) != "initial")
+            {
+                std::cerr << "Error: snapshot lost its version of key: " << key << std::endl;
+                exit(1);
+            }
+            if (skip_list.get(key) != "value_" + std::to_string(num_rounds - 1))
+            {
+                std::cerr << "Error: incorrect value for key: " << key << std::endl;
+                exit(1);
+            }
+        }
+
+        if (skip_list.get_memory_usage() > usage_after_warmup * 2)
+        {
+            std::cerr << "Error: memory usage grew from " << usage_after_warmup << " to " << skip_list.get_memory_usage()
+                      << " bytes while overwriting the same keys" << std::endl;
+            exit(1);
+        }
+    }
+
+    // Once the snapshot is released, the next overwrites prune the versions it kept
+    for (const auto &key : keys)
+    {
+        skip_list.put(key, "final");
+        if (skip_list.get(key) != "final")
+        {
+            std::cerr << "Error: incorrect value after releasing the snapshot for key: " << key << std::endl;
+            exit(1);
+        }
+    }
+
+    std::cout << "test_skip_list_reclamation done" << std::endl;
+}
+
+void test_skip_list_remove()
+{
+    constexpr size_t num_operations = 100000;
+    constexpr size_t window = 100;
+
+    // Like a queue, every new key is added and the oldest key is deleted, so only the keys in the window are live
+    tendb::skip_list::SkipList skip_list;
+    auto make_key = [](size_t i)
+    {
+        std::string number = std::to_string(i);
+        return "key_" + std::string(8 - number.size(), '0') + number;
+    };
+    size_t usage_after_warmup = 0;
+    for (size_t i = 0; i < num_operations; ++i)
+    {
+        skip_list.put(make_key(i), "value");
+        if (i >= window)
+        {
+            skip_list.del(make_key(i - window));
+        }
+        if (i == num_operations / 10)
+        {
+            usage_after_warmup = skip_list.get_memory_usage();
+        }
+    }
+
+    // Deleted keys are removed, so not even an iterator that includes deleted keys sees them
+    size_t count = 0;
+    for (auto it = skip_list.begin(true); it != skip_list.end(); ++it)
+    {
+        if (it->key() != make_key(num_operations - window + count))
+        {
+            std::cerr << "Error: unexpected key after removals: " << it->key() << std::endl;
+            exit(1);
+        }
+        ++count;
+    }
+    if (count != window)
+    {
+        std::cerr << "Error: " << count << " keys left instead of " << window << std::endl;
+        exit(1);
+    }
+
+    if (skip_list.get_memory_usage() > usage_after_warmup * 2)
+    {
+        std::cerr << "Error: memory usage grew from " << usage_after_warmup << " to " << skip_list.get_memory_usage()
+                  << " bytes while the number of live keys stayed the same" << std::endl;
+        exit(1);
+    }
+
+    for (size_t i = num_operations - window; i < num_operations; ++i)
+    {
+        skip_list.del(make_key(i));
+    }
+    if (!skip_list.is_empty())
+    {
+        std::cerr << "Error: skip list should be empty after deleting all keys" << std::endl;
+        exit(1);
+    }
+
+    // A snapshot still sees the keys that were deleted after it
+    skip_list.put("a", "value");
+    {
+        tendb::skip_list::Snapshot snapshot = skip_list.snapshot();
+        skip_list.del("a");
+        if (skip_list.get("a", snapshot) != "value" || skip_list.get("a").has_value())
+        {
+            std::cerr << "Error: delete should only be visible after the snapshot" << std::endl;
+            exit(1);
+        }
+    }
+
+    // A skip list that keeps tombstones visits them with an iterator that includes deleted keys
+    tendb::skip_list::SkipList tombstones(true);
+    for (size_t i = 0; i < window; ++i)
+    {
+        tombstones.put(make_key(i), "value");
+        tombstones.del(make_key(i));
+    }
+    count = 0;
+    for (auto it = tombstones.begin(true); it != tombstones.end(); ++it)
+    {
+        count += it->is_deleted() ? 1 : 0;
+    }
+    if (count != window || tombstones.begin() != tombstones.end())
+    {
+        std::cerr << "Error: tombstones should be kept" << std::endl;
+        exit(1);
+    }
+
+    std::cout << "test_skip_list_remove done" << std::endl;
+}
+
+void test_skip_list_remove_multithread()
+{
+    constexpr size_t num_threads = 4;
+    constexpr size_t num_keys = 1000;
+    constexpr size_t num_rounds = 50;
+
+    tendb::skip_list::SkipList skip_list;
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < num_keys; ++i)
+    {
+        std::string number = std::to_string(i);
+        keys.push_back("key_" + std::string(4 - number.size(), '0') + number);
+    }
+
+    // Each writer owns every num_threads-th key, so neighbouring keys are inserted and removed concurrently,
+    // and all writers also put and delete a few shared keys
+    std::atomic<size_t> num_done{0};
+    auto writer = [&](size_t thread_id)
+    {
+        std::mt19937_64 rng(thread_id);
+        for (size_t round = 0; round < num_rounds; ++round)
+        {
+            for (size_t i = thread_id; i < num_keys; i += num_threads)
+            {
+                if ((round + i) % 2 == 0)
+                {
+                    skip_list.put(keys[i], keys[i]);
+                }
+                else
+                {
+                    skip_list.del(keys[i]);
+                }
+
+                const std::string &shared_key = keys[rng() % 10];
+                if (rng() % 2 == 0)
+                {
+                    skip_list.put(shared_key, shared_key);
+                }
+                else
+                {
+                    skip_list.del(shared_key);
+                }
+            }
+        }
+        ++num_done;
+    };
+
+    // Scans see every key at most once and in order, while nodes are linked and unlinked around them
+    auto scanner = [&]()
+    {
+        while (num_done < num_threads)
+        {
+            std::string last_key;
+            for (auto it = skip_list.begin(); it != skip_list.end(); ++it)
+            {
+                if (!last_key.empty() && it->key() <= last_key)
+                {
+                    std::cerr << "Error: scan is out of order at key: " << it->key() << std::endl;
+                    exit(1);
+                }
+                last_key = it->key();
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < num_threads; ++i)
+    {
+        threads.emplace_back(writer, i);
+    }
+    threads.emplace_back(scanner);
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    // The last round puts the owned keys whose index is odd, and deletes the others
+    for (size_t i = 10; i < num_keys; ++i)
+    {
+        bool live = (num_rounds - 1 + i) % 2 == 0;
+        if (skip_list.get(keys[i]).has_value() != live)
+        {
+            std::cerr << "Error: incorrect state after concurrent removals for key: " << keys[i] << std::endl;
+            exit(1);
+        }
+    }
+
+    std::cout << "test_skip_list_remove_multithread done" << std::endl;
+}
+
 /**
  * Benchmark the performance of adding key-value pairs to a std::map.
  */
@@ -565,8 +958,13 @@ int main()
     test_skip_list_duplicate_keys();
     test_skip_list_large_data();
     test_skip_list_delete();
+    test_skip_list_snapshot();
+    test_skip_list_reclamation();
+    test_skip_list_remove();
 
     test_skip_list_multithread_xwrite();
+    test_skip_list_snapshot_multithread();
+    test_skip_list_remove_multithread();
 
     // multithread_xreadwrite_test_skip_list(); // test to verify concurrent read/write operations
 